@@ -0,0 +1,356 @@
+/**************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/**************************************/
+#include "bitmap.h"
+#include "png.h"
+/**************************************/
+
+//! Inflate state
+struct Inflate_t
+{
+    const uint8_t *Src;
+    size_t   SrcSize, SrcPos;
+    uint32_t BitBuf;
+    int      BitCnt;
+    int      Error;
+    uint8_t *Dst;
+    size_t   DstSize, DstPos;
+};
+
+//! Canonical Huffman table
+struct Huffman_t
+{
+    int16_t Count[16];
+    int16_t Symbol[288];
+};
+
+/**************************************/
+
+//! Read bits from the stream
+static int Inflate_GetBits(struct Inflate_t *s, int n)
+{
+    while(s->BitCnt < n)
+    {
+        if(s->SrcPos >= s->SrcSize)
+        {
+            s->Error = 1;
+            return 0;
+        }
+        s->BitBuf |= (uint32_t)s->Src[s->SrcPos++] << s->BitCnt;
+        s->BitCnt += 8;
+    }
+    int v = s->BitBuf & ((1u << n) - 1);
+    s->BitBuf >>= n;
+    s->BitCnt  -= n;
+    return v;
+}
+
+//! Build Huffman table from code lengths
+static void Huffman_Build(struct Huffman_t *h, const uint8_t *Lengths, int n)
+{
+    int i;
+    int16_t Offs[16];
+    memset(h->Count, 0, sizeof(h->Count));
+    for(i=0; i<n; i++) h->Count[Lengths[i]]++;
+    h->Count[0] = 0;
+    Offs[1] = 0;
+    for(i=1; i<15; i++) Offs[i+1] = Offs[i] + h->Count[i];
+    for(i=0; i<n; i++) if(Lengths[i]) h->Symbol[Offs[Lengths[i]]++] = i;
+}
+
+//! Decode a symbol
+static int Huffman_Decode(struct Inflate_t *s, const struct Huffman_t *h)
+{
+    int Len, Code = 0, First = 0, Index = 0;
+    for(Len=1; Len<16; Len++)
+    {
+        Code |= Inflate_GetBits(s, 1);
+        int Count = h->Count[Len];
+        if(Code - Count < First) return h->Symbol[Index + (Code - First)];
+        Index += Count;
+        First  = (First + Count) << 1;
+        Code <<= 1;
+    }
+    s->Error = 1;
+    return 0;
+}
+
+/**************************************/
+
+//! Decode a compressed block
+static void Inflate_Codes(struct Inflate_t *s, const struct Huffman_t *LitLen, const struct Huffman_t *Dist)
+{
+    static const int16_t LenBase[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+    static const int16_t LenExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+    static const int16_t DistBase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+    static const int16_t DistExtra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+    while(!s->Error)
+    {
+        int Sym = Huffman_Decode(s, LitLen);
+        if(Sym < 256)
+        {
+            if(s->DstPos >= s->DstSize) break;
+            s->Dst[s->DstPos++] = Sym;
+        }
+        else if(Sym == 256) return;
+        else
+        {
+            Sym -= 257;
+            if(Sym >= 29) break;
+            int Len = LenBase[Sym] + Inflate_GetBits(s, LenExtra[Sym]);
+            Sym = Huffman_Decode(s, Dist);
+            if(Sym >= 30) break;
+            size_t Offs = DistBase[Sym] + Inflate_GetBits(s, DistExtra[Sym]);
+            if(Offs > s->DstPos || s->DstPos + Len > s->DstSize) break;
+            while(Len--)
+            {
+                s->Dst[s->DstPos] = s->Dst[s->DstPos - Offs];
+                s->DstPos++;
+            }
+        }
+    }
+    s->Error = 1;
+}
+
+//! Decompress zlib stream
+//! Returns the number of bytes decompressed, or 0 on error
+static size_t Inflate(uint8_t *Dst, size_t DstSize, const uint8_t *Src, size_t SrcSize)
+{
+    int i;
+    struct Inflate_t s = {Src, SrcSize, 2, 0, 0, 0, Dst, DstSize, 0};
+    if(SrcSize < 2 || (Src[0] & 0x0F) != 8) return 0;
+
+    int Last;
+    do
+    {
+        Last = Inflate_GetBits(&s, 1);
+        int Type = Inflate_GetBits(&s, 2);
+        if(Type == 0)
+        {
+            //! Stored block
+            s.BitBuf = 0, s.BitCnt = 0;
+            if(s.SrcPos + 4 > s.SrcSize) return 0;
+            size_t Len = s.Src[s.SrcPos] | s.Src[s.SrcPos+1]<<8;
+            s.SrcPos += 4;
+            if(s.SrcPos + Len > s.SrcSize || s.DstPos + Len > s.DstSize) return 0;
+            memcpy(s.Dst + s.DstPos, s.Src + s.SrcPos, Len);
+            s.SrcPos += Len;
+            s.DstPos += Len;
+        }
+        else if(Type == 1)
+        {
+            //! Fixed Huffman codes
+            uint8_t Lengths[288+30];
+            struct Huffman_t LitLen, Dist;
+            for(i=0;   i<144; i++) Lengths[i] = 8;
+            for(;      i<256; i++) Lengths[i] = 9;
+            for(;      i<280; i++) Lengths[i] = 7;
+            for(;      i<288; i++) Lengths[i] = 8;
+            for(i=288; i<318; i++) Lengths[i] = 5;
+            Huffman_Build(&LitLen, Lengths, 288);
+            Huffman_Build(&Dist, Lengths+288, 30);
+            Inflate_Codes(&s, &LitLen, &Dist);
+        }
+        else if(Type == 2)
+        {
+            //! Dynamic Huffman codes
+            static const uint8_t Order[19] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+            uint8_t Lengths[288+32];
+            struct Huffman_t LitLen, Dist;
+            int nLen  = Inflate_GetBits(&s, 5) + 257;
+            int nDist = Inflate_GetBits(&s, 5) + 1;
+            int nCode = Inflate_GetBits(&s, 4) + 4;
+            if(nLen > 286 || nDist > 30) return 0;
+            for(i=0; i<19; i++) Lengths[Order[i]] = (i < nCode) ? Inflate_GetBits(&s, 3) : 0;
+            Huffman_Build(&LitLen, Lengths, 19);
+            for(i=0; i<nLen+nDist && !s.Error; )
+            {
+                int Sym = Huffman_Decode(&s, &LitLen);
+                if(Sym < 16) Lengths[i++] = Sym;
+                else
+                {
+                    int Rep, Val = 0;
+                    if(Sym == 16)
+                    {
+                        if(!i) return 0;
+                        Val = Lengths[i-1];
+                        Rep = 3 + Inflate_GetBits(&s, 2);
+                    }
+                    else if(Sym == 17) Rep =  3 + Inflate_GetBits(&s, 3);
+                    else               Rep = 11 + Inflate_GetBits(&s, 7);
+                    if(i + Rep > nLen+nDist) return 0;
+                    while(Rep--) Lengths[i++] = Val;
+                }
+            }
+            Huffman_Build(&LitLen, Lengths, nLen);
+            Huffman_Build(&Dist, Lengths+nLen, nDist);
+            Inflate_Codes(&s, &LitLen, &Dist);
+        }
+        else return 0;
+        if(s.Error) return 0;
+    } while(!Last);
+    return s.DstPos;
+}
+
+/**************************************/
+
+//! Read big-endian 32-bit value
+static uint32_t ReadU32BE(const uint8_t *x)
+{
+    return (uint32_t)x[0]<<24 | (uint32_t)x[1]<<16 | (uint32_t)x[2]<<8 | x[3];
+}
+
+//! Paeth predictor
+static int Paeth(int a, int b, int c)
+{
+    int p  = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+/**************************************/
+
+//! Load PNG image as BGRA
+int BmpCtx_FromPNG(struct BmpCtx_t *Ctx, const char *Filename)
+{
+    int x, y;
+    Ctx->Width  = 0;
+    Ctx->Height = 0;
+    Ctx->Stride = 0;
+    Ctx->Layout = 0;
+    Ctx->ColPal = NULL;
+    Ctx->PxBGR  = NULL;
+
+    //! Read whole file
+    FILE *File = fopen(Filename, "rb");
+    if(!File) return 0;
+    fseek(File, 0, SEEK_END);
+    long Size = ftell(File);
+    rewind(File);
+    uint8_t *Data = malloc(Size);
+    if(!Data || fread(Data, 1, Size, File) != (size_t)Size || Size < 8 || memcmp(Data, "\x89PNG\r\n\x1A\n", 8))
+    {
+        fclose(File);
+        free(Data);
+        return 0;
+    }
+    fclose(File);
+
+    //! Parse chunks, gathering the compressed data
+    int W = 0, H = 0, ColourType = -1, Ok = 1;
+    struct BGRA8_t Pal[256];
+    memset(Pal, 0xFF, sizeof(Pal));
+    uint8_t *Compressed = malloc(Size);
+    size_t CompressedSize = 0;
+    long Pos = 8;
+    while(Ok && Compressed && Pos + 12 <= Size)
+    {
+        uint32_t Len = ReadU32BE(Data + Pos);
+        const uint8_t *Type  = Data + Pos + 4;
+        const uint8_t *Chunk = Data + Pos + 8;
+        if(Len > (uint32_t)(Size - Pos - 12)) break;
+        if(!memcmp(Type, "IHDR", 4) && Len >= 13)
+        {
+            W = ReadU32BE(Chunk);
+            H = ReadU32BE(Chunk + 4);
+            ColourType = Chunk[9];
+            if(Chunk[8] != 8 || Chunk[12] != 0) Ok = 0; //! 8-bit, non-interlaced only
+        }
+        else if(!memcmp(Type, "PLTE", 4))
+        {
+            for(x=0; x<(int)Len/3 && x<256; x++)
+            {
+                Pal[x].r = Chunk[x*3+0];
+                Pal[x].g = Chunk[x*3+1];
+                Pal[x].b = Chunk[x*3+2];
+            }
+        }
+        else if(!memcmp(Type, "tRNS", 4) && ColourType == 3)
+        {
+            for(x=0; x<(int)Len && x<256; x++) Pal[x].a = Chunk[x];
+        }
+        else if(!memcmp(Type, "IDAT", 4))
+        {
+            memcpy(Compressed + CompressedSize, Chunk, Len);
+            CompressedSize += Len;
+        }
+        else if(!memcmp(Type, "IEND", 4)) break;
+        Pos += Len + 12;
+    }
+    free(Data);
+
+    //! Decompress and unfilter
+    int Bpp;
+    switch(ColourType)
+    {
+    case 0: Bpp = 1; break;
+    case 2: Bpp = 3; break;
+    case 3: Bpp = 1; break;
+    case 4: Bpp = 2; break;
+    case 6: Bpp = 4; break;
+    default: Bpp = 0; Ok = 0; break;
+    }
+    size_t RowSize = (size_t)W*Bpp;
+    uint8_t *Raw = NULL;
+    if(Ok && Compressed && W > 0 && H > 0)
+    {
+        Raw = malloc((RowSize+1)*H);
+        if(!Raw || Inflate(Raw, (RowSize+1)*H, Compressed, CompressedSize) != (RowSize+1)*H) Ok = 0;
+    }
+    else Ok = 0;
+    free(Compressed);
+    if(Ok)
+    {
+        for(y=0; y<H; y++)
+        {
+            uint8_t *Row  = Raw + y*(RowSize+1);
+            uint8_t *Prev = y ? (Row - (RowSize+1)) : NULL;
+            int Filter = *Row++;
+            if(Prev) Prev++;
+            for(x=0; x<(int)RowSize; x++)
+            {
+                int a = (x >= Bpp) ? Row[x-Bpp] : 0;
+                int b = Prev ? Prev[x] : 0;
+                int c = (Prev && x >= Bpp) ? Prev[x-Bpp] : 0;
+                switch(Filter)
+                {
+                case 1: Row[x] += a; break;
+                case 2: Row[x] += b; break;
+                case 3: Row[x] += (a + b) / 2; break;
+                case 4: Row[x] += Paeth(a, b, c); break;
+                }
+            }
+        }
+    }
+
+    //! Convert to BGRA (bottom-up)
+    if(Ok && BmpCtx_Create(Ctx, W, H, 0))
+    {
+        for(y=0; y<H; y++)
+        {
+            const uint8_t *Src = Raw + y*(RowSize+1) + 1;
+            struct BGRA8_t *Dst = Ctx->PxBGR + (H-1-y)*W;
+            for(x=0; x<W; x++, Src += Bpp)
+            {
+                switch(ColourType)
+                {
+                case 0: Dst[x] = (struct BGRA8_t){Src[0], Src[0], Src[0], 0xFF};   break;
+                case 2: Dst[x] = (struct BGRA8_t){Src[2], Src[1], Src[0], 0xFF};   break;
+                case 3: Dst[x] = Pal[Src[0]];                                      break;
+                case 4: Dst[x] = (struct BGRA8_t){Src[0], Src[0], Src[0], Src[1]}; break;
+                case 6: Dst[x] = (struct BGRA8_t){Src[2], Src[1], Src[0], Src[3]}; break;
+                }
+            }
+        }
+    }
+    else Ok = 0;
+    free(Raw);
+    return Ok;
+}
+
+/**************************************/
+//! EOF
+/**************************************/
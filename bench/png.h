@@ -0,0 +1,15 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include "bitmap.h"
+/**************************************/
+
+//! Load PNG image as BGRA
+//! NOTE: Only 8-bit, non-interlaced greyscale/RGB/palette/RGBA images are supported
+//! NOTE: Image is vertically inverted (as with BmpCtx_FromFile())
+//! NOTE: This internally creates the context
+int BmpCtx_FromPNG(struct BmpCtx_t *Ctx, const char *Filename);
+
+/**************************************/
+//! EOF
+/**************************************/
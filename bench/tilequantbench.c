@@ -0,0 +1,290 @@
+/**************************************/
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/**************************************/
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+/**************************************/
+#include "bitmap.h"
+#include "dither.h"
+#include "png.h"
+#include "qualetize.h"
+#include "quantize.h"
+#include "stats.h"
+#include "tiles.h"
+/**************************************/
+
+//! Benchmark harness
+//! Each configuration is run in its own process so that the peak RSS
+//! reported is that of the configuration alone. Results are written
+//! to stdout as JSON lines (one object per configuration).
+
+/**************************************/
+
+//! Synthetic image size
+#define SYNTH_W 256
+#define SYNTH_H 256
+
+//! Images available
+struct BenchImage_t
+{
+    const char *Name;
+    const char *File; //! NULL = Synthetic
+};
+static const struct BenchImage_t Images[] =
+{
+    {"gradient",    NULL},
+    {"noise",       NULL},
+    {"pixelart",    NULL},
+    {"sparsealpha", NULL},
+    {"cat",         "cat.png"},
+    {"cat-q1",      "cat-q1.png"},
+    {"cat-q2",      "cat-q2.png"},
+    {"cat-q4",      "cat-q4.png"},
+    {"cat-q8",      "cat-q8.png"},
+    {"cat-q16",     "cat-q16.png"},
+};
+
+//! Parameter sweep
+static const int nPalettesSweep[] = {1, 4, 16};
+static const int nColoursSweep[]  = {4, 16};
+static const int TileSizeSweep[]  = {8, 16};
+static const struct
+{
+    const char *Name;
+    int   Mode;
+    float Level;
+} DitherSweep[] =
+{
+    {"none",  DITHER_NONE,           0.0f},
+    {"floyd", DITHER_FLOYDSTEINBERG, 1.0f},
+    {"ord8",  DITHER_ORDERED(3),     0.5f},
+};
+#define SWEEP_COUNT(x) (int)(sizeof(x) / sizeof((x)[0]))
+
+/**************************************/
+
+//! Deterministic pseudo-random numbers
+static uint32_t Bench_Rand(uint32_t *Seed)
+{
+    *Seed = *Seed * 1664525u + 1013904223u;
+    return *Seed >> 8;
+}
+
+//! Generate synthetic image
+static int Bench_Generate(struct BmpCtx_t *Ctx, const char *Name)
+{
+    int x, y;
+    uint32_t Seed = 12345;
+    if(!BmpCtx_Create(Ctx, SYNTH_W, SYNTH_H, 0)) return 0;
+    struct BGRA8_t *Px = Ctx->PxBGR;
+    if(!strcmp(Name, "gradient"))
+    {
+        //! Smooth ramps in all three colour channels
+        for(y=0; y<SYNTH_H; y++) for(x=0; x<SYNTH_W; x++)
+        {
+            *Px++ = (struct BGRA8_t){x * 255 / (SYNTH_W-1), y * 255 / (SYNTH_H-1), (x+y) * 255 / (SYNTH_W+SYNTH_H-2), 0xFF};
+        }
+    }
+    else if(!strcmp(Name, "noise"))
+    {
+        //! Uniform white noise
+        for(y=0; y<SYNTH_H; y++) for(x=0; x<SYNTH_W; x++)
+        {
+            uint32_t r = Bench_Rand(&Seed);
+            *Px++ = (struct BGRA8_t){r, r >> 8, r >> 16, 0xFF};
+        }
+    }
+    else if(!strcmp(Name, "pixelart"))
+    {
+        //! 4x4 blocks drawn from a few local 8-colour ramps
+        struct BGRA8_t Ramp[4][8];
+        int i, j;
+        for(i=0; i<4; i++)
+        {
+            uint32_t r = Bench_Rand(&Seed);
+            for(j=0; j<8; j++) Ramp[i][j] = (struct BGRA8_t){(r & 0xFF) * j / 7, ((r >> 8) & 0xFF) * j / 7, ((r >> 16) & 0xFF) * j / 7, 0xFF};
+        }
+        for(y=0; y<SYNTH_H; y++) for(x=0; x<SYNTH_W; x++)
+        {
+            int Region = (x / 64 + y / 64) & 3;
+            uint32_t Block = (uint32_t)(x/4) * 2654435761u ^ (uint32_t)(y/4) * 40503u;
+            *Px++ = Ramp[Region][(Block >> 13) & 7];
+        }
+    }
+    else if(!strcmp(Name, "sparsealpha"))
+    {
+        //! Mostly transparent, with a few opaque shapes
+        for(y=0; y<SYNTH_H; y++) for(x=0; x<SYNTH_W; x++)
+        {
+            int dx = (x & 63) - 32, dy = (y & 63) - 32;
+            int Inside = dx*dx + dy*dy < 12*12;
+            uint32_t r = Bench_Rand(&Seed);
+            *Px++ = Inside ? (struct BGRA8_t){r, x, y, 0xFF} : (struct BGRA8_t){0, 0, 0, 0};
+        }
+    }
+    else
+    {
+        BmpCtx_Destroy(Ctx);
+        return 0;
+    }
+    return 1;
+}
+
+/**************************************/
+
+//! Convert RMS error to PSNR
+static void Bench_PrintPSNR(const char *Name, float RMSE, int Comma)
+{
+    //! NOTE: JSON has no infinity, so use null for zero (or invalid) error
+    if(RMSE > 0.0f && isfinite(RMSE)) printf("\"%s\":%.3f%s", Name, -20.0*log10(RMSE), Comma ? "," : "");
+    else            printf("\"%s\":null%s", Name, Comma ? "," : "");
+}
+
+//! Run a single configuration and print its results
+static int Bench_Run(const struct BenchImage_t *Img, int nPalettes, int nColours, int TileSize, int DitherIdx, int nPasses)
+{
+    static const struct BGRA8_t BitRange = {.b = 0x1F, .g = 0x1F, .r = 0x1F, .a = 0x01};
+    int DitherMode    = DitherSweep[DitherIdx].Mode;
+    float DitherLevel = DitherSweep[DitherIdx].Level;
+
+    //! Get image
+    struct BmpCtx_t Image;
+    if(!(Img->File ? BmpCtx_FromPNG(&Image, Img->File) : Bench_Generate(&Image, Img->Name)))
+    {
+        fprintf(stderr, "Unable to get image %s\n", Img->Name);
+        return 0;
+    }
+    if(Image.Width%TileSize || Image.Height%TileSize)
+    {
+        BmpCtx_Destroy(&Image);
+        return 1;
+    }
+
+    //! Process
+    struct QuantStats_t Stats;
+    struct QuantCtrl_t  Ctrl = {.Stats = &Stats};
+    QuantStats_Clear(&Stats);
+    double StartTime = QuantStats_GetTime();
+    QuantCtrl_BeginStage(&Ctrl, QUANTSTAGE_CONVERT);
+    struct TilesData_t *TilesData = TilesData_FromBitmap(&Image, TileSize, TileSize, &BitRange, DitherMode, DitherLevel);
+    QuantCtrl_EndStage(&Ctrl);
+    uint8_t        *PxData  = malloc(Image.Width * Image.Height * sizeof(uint8_t));
+    struct BGRAf_t *Palette = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRAf_t));
+    if(!TilesData || !PxData || !Palette)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(Palette);
+        free(PxData);
+        free(TilesData);
+        BmpCtx_Destroy(&Image);
+        return 0;
+    }
+    struct BGRAf_t RMSE = Qualetize(
+                              &Image,
+                              TilesData,
+                              PxData,
+                              Palette,
+                              nPalettes,
+                              nColours,
+                              1,
+                              nPasses,
+                              nPasses,
+                              &BitRange,
+                              DitherMode,
+                              DitherLevel,
+                              0,
+                              &Ctrl
+                          );
+    double TotalTime = QuantStats_GetTime() - StartTime;
+
+    //! Get peak memory usage
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+
+    //! Output results
+    printf("{\"image\":\"%s\",\"width\":%d,\"height\":%d,", Img->Name, Image.Width, Image.Height);
+    printf("\"np\":%d,\"ps\":%d,\"tw\":%d,\"th\":%d,\"dither\":\"%s\",\"passes\":%d,", nPalettes, nColours, TileSize, TileSize, DitherSweep[DitherIdx].Name, nPasses);
+    printf("\"time_ms\":{\"convert\":%.3f,\"tiles\":%.3f,\"colours\":%.3f,\"dither\":%.3f,\"total\":%.3f},",
+        Stats.Stage[QUANTSTAGE_CONVERT].Time*1000.0,
+        Stats.Stage[QUANTSTAGE_TILES  ].Time*1000.0,
+        Stats.Stage[QUANTSTAGE_COLOURS].Time*1000.0,
+        Stats.Stage[QUANTSTAGE_DITHER ].Time*1000.0,
+        TotalTime*1000.0
+    );
+    printf("\"mpix_per_s\":%.3f,", (Image.Width * Image.Height) / (TotalTime * 1.0e6));
+    printf("\"peak_rss_kb\":%ld,", (long)Usage.ru_maxrss);
+    printf("\"psnr_db\":{");
+    Bench_PrintPSNR("b", RMSE.b, 1);
+    Bench_PrintPSNR("g", RMSE.g, 1);
+    Bench_PrintPSNR("r", RMSE.r, 1);
+    Bench_PrintPSNR("a", RMSE.a, 0);
+    printf("}}\n");
+    fflush(stdout);
+
+    //! Clean up
+    free(Palette);
+    free(PxData);
+    free(TilesData);
+    BmpCtx_Destroy(&Image);
+    return 1;
+}
+
+/**************************************/
+
+int main(int argc, const char *argv[])
+{
+    int argi, i, np, ps, ts, d;
+    const char *ImageFilter = NULL;
+    int nPasses = 0;
+    for(argi=1; argi<argc; argi++)
+    {
+        if     (!strncmp(argv[argi], "-image:",  7)) ImageFilter = argv[argi] + 7;
+        else if(!strncmp(argv[argi], "-passes:", 8)) nPasses = atoi(argv[argi] + 8);
+        else
+        {
+            fprintf(stderr,
+                "tilequantbench - Benchmark harness\n"
+                "Usage:\n"
+                " tilequantbench [options]\n"
+                "Options:\n"
+                " -image:Name - Only run the named image\n"
+                " -passes:0   - Set tile and colour cluster passes (0 = default)\n"
+                "Images are read relative to the working directory.\n"
+            );
+            return 1;
+        }
+    }
+
+    //! Run every configuration in a separate process
+    int nFailed = 0;
+    for(i=0; i<SWEEP_COUNT(Images); i++)
+    {
+        if(ImageFilter && strcmp(ImageFilter, Images[i].Name)) continue;
+        for(np=0; np<SWEEP_COUNT(nPalettesSweep); np++)
+        for(ps=0; ps<SWEEP_COUNT(nColoursSweep);  ps++)
+        for(ts=0; ts<SWEEP_COUNT(TileSizeSweep);  ts++)
+        for(d =0; d <SWEEP_COUNT(DitherSweep);    d++)
+        {
+            pid_t Pid = fork();
+            if(Pid == 0)
+            {
+                int Ok = Bench_Run(&Images[i], nPalettesSweep[np], nColoursSweep[ps], TileSizeSweep[ts], d, nPasses);
+                exit(Ok ? 0 : 1);
+            }
+            int Status = 1;
+            if(Pid < 0 || waitpid(Pid, &Status, 0) < 0 || !WIFEXITED(Status) || WEXITSTATUS(Status) != 0) nFailed++;
+        }
+    }
+    if(nFailed) fprintf(stderr, "%d configurations failed\n", nFailed);
+    return nFailed ? 1 : 0;
+}
+
+/**************************************/
+//! EOF
+/**************************************/
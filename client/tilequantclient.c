@@ -0,0 +1,228 @@
+/**************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/**************************************/
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+/**************************************/
+#include "bitmap.h"
+#include "serve.h"
+/**************************************/
+
+//! Example client for tilequant --serve
+//! The image is decoded straight into shared memory, which the server
+//! quantizes in place; only the request and reply go over the socket.
+
+/**************************************/
+
+//! Round up to a multiple of 64 bytes
+#define ALIGN64(x) (((x) + 63) &~ (uint64_t)63)
+
+/**************************************/
+
+//! Connect to the server
+static int ConnectServer(const char *SocketPath)
+{
+    struct sockaddr_un Addr = {.sun_family = AF_UNIX};
+    if(strlen(SocketPath) >= sizeof(Addr.sun_path)) return -1;
+    strcpy(Addr.sun_path, SocketPath);
+    int Fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(Fd < 0) return -1;
+    if(connect(Fd, (const struct sockaddr*)&Addr, sizeof(Addr)) < 0)
+    {
+        close(Fd);
+        return -1;
+    }
+    return Fd;
+}
+
+//! Send a job and wait for its reply
+//! Returns 0 on failure
+static int RunJob(int ConnFd, int MemFd, const struct ServeRequest_t *Req, int nArgs, const char *const *Args, struct ServeReply_t *Reply)
+{
+    int i;
+    struct
+    {
+        struct ServeRequest_t Req;
+        char Args[SERVE_MAX_ARGS_SIZE];
+    } Msg;
+    size_t MsgSize = sizeof(Msg.Req);
+    Msg.Req = *Req;
+    for(i=0; i<nArgs; i++)
+    {
+        size_t Len = strlen(Args[i]) + 1;
+        if(MsgSize + Len > sizeof(Msg)) return 0;
+        memcpy((char*)&Msg + MsgSize, Args[i], Len);
+        MsgSize += Len;
+    }
+
+    //! Send the request with the shared memory attached
+    union
+    {
+        char Buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr Align;
+    } Control;
+    memset(&Control, 0, sizeof(Control));
+    struct iovec  Iov = {.iov_base = &Msg, .iov_len = MsgSize};
+    struct msghdr Hdr = {.msg_iov = &Iov, .msg_iovlen = 1, .msg_control = Control.Buf, .msg_controllen = sizeof(Control.Buf)};
+    struct cmsghdr *Cmsg = CMSG_FIRSTHDR(&Hdr);
+    Cmsg->cmsg_level = SOL_SOCKET;
+    Cmsg->cmsg_type  = SCM_RIGHTS;
+    Cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(Cmsg), &MemFd, sizeof(int));
+    if(sendmsg(ConnFd, &Hdr, MSG_NOSIGNAL) != (ssize_t)MsgSize) return 0;
+
+    //! Wait for the reply
+    ssize_t Size;
+    do Size = recv(ConnFd, Reply, sizeof(*Reply), 0); while(Size < 0 && errno == EINTR);
+    return Size == (ssize_t)sizeof(*Reply) && Reply->Magic == SERVE_MAGIC;
+}
+
+/**************************************/
+
+int main(int argc, const char *argv[])
+{
+    int i;
+    if(argc < 4)
+    {
+        printf(
+            "tilequantclient - Client for tilequant --serve\n"
+            "Usage:\n"
+            " tilequantclient Socket Input.bmp Output.bmp [options]\n"
+            "Options are as for tilequant, except for -palette, -stats, -trace, -simd\n"
+            "and lists of values to sweep over.\n"
+        );
+        return 1;
+    }
+    if(argc-4 > SERVE_MAX_ARGS)
+    {
+        printf("Too many options\n");
+        return -1;
+    }
+
+    //! Get input image
+    struct BmpCtx_t Image;
+    if(!BmpCtx_FromFile(&Image, argv[2]))
+    {
+        printf("Unable to read input file\n");
+        return -1;
+    }
+
+    //! Lay out the shared memory
+    struct ServeRequest_t Req = {.Magic = SERVE_MAGIC, .Version = SERVE_VERSION};
+    uint64_t nPx = (uint64_t)Image.Width * Image.Height;
+    Req.Width     = Image.Width;
+    Req.Height    = Image.Height;
+    Req.Layout    = Image.Layout & (BMPCTX_ORDER_MASK | BMPCTX_TOPDOWN);
+    Req.nArgs     = argc-4;
+    Req.PxOffset  = 0;
+    Req.IdxOffset = ALIGN64(Req.PxOffset  + nPx*sizeof(struct BGRA8_t));
+    Req.PalOffset = ALIGN64(Req.IdxOffset + nPx);
+    uint64_t MemSize = Req.PalOffset + BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t);
+
+    //! Create the shared memory, and store the pixels to it
+    //! NOTE: The server only accepts memory whose size is sealed
+    int MemFd = memfd_create("tilequant", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    uint8_t *Mem = MAP_FAILED;
+    if(MemFd >= 0 && !ftruncate(MemFd, MemSize) && !fcntl(MemFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+    {
+        Mem = mmap(NULL, MemSize, PROT_READ | PROT_WRITE, MAP_SHARED, MemFd, 0);
+    }
+    if(Mem == MAP_FAILED)
+    {
+        printf("Unable to create shared memory\n");
+        if(MemFd >= 0) close(MemFd);
+        BmpCtx_Destroy(&Image);
+        return -1;
+    }
+    struct BGRA8_t *Px = (struct BGRA8_t*)(Mem + Req.PxOffset);
+    for(i=0; i<Image.Height; i++)
+    {
+        //! NOTE: Rows are stored in the image's own order
+        int y = (Image.Layout & BMPCTX_TOPDOWN) ? (Image.Height-1 - i) : i;
+        const void *Row = BmpCtx_GetRow(&Image, y);
+        if(Image.ColPal)
+        {
+            int x;
+            const uint8_t *Idx = (const uint8_t*)Row;
+            for(x=0; x<Image.Width; x++) Px[(size_t)i*Image.Width + x] = Image.ColPal[Idx[x]];
+        }
+        else memcpy(&Px[(size_t)i*Image.Width], Row, Image.Width*sizeof(struct BGRA8_t));
+    }
+    BmpCtx_Destroy(&Image);
+
+    //! Run the job
+    struct ServeReply_t Reply;
+    int ConnFd = ConnectServer(argv[1]);
+    if(ConnFd < 0)
+    {
+        printf("Unable to connect to server\n");
+        munmap(Mem, MemSize);
+        close(MemFd);
+        return -1;
+    }
+    int Ok = RunJob(ConnFd, MemFd, &Req, argc-4, &argv[4], &Reply);
+    close(ConnFd);
+    if(!Ok || Reply.Status != SERVE_STATUS_OK)
+    {
+        static const char *const StatusText[] =
+        {
+            "Ok",
+            "Bad request",
+            "Unrecognized or unsupported options",
+            "Image not a multiple of tile size, or too many colours",
+            "Out of memory",
+        };
+        if(!Ok) printf("No reply from server\n");
+        else if(Reply.Status > 0 && Reply.Status < (int)(sizeof(StatusText)/sizeof(StatusText[0])))
+        {
+            printf("Server error: %s\n", StatusText[Reply.Status]);
+        }
+        else printf("Server error %d\n", Reply.Status);
+        munmap(Mem, MemSize);
+        close(MemFd);
+        return -1;
+    }
+
+    //! Output PSNR
+    printf("PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}\n",
+        -8.68588963f*logf(Reply.RMSE[0]),
+        -8.68588963f*logf(Reply.RMSE[1]),
+        -8.68588963f*logf(Reply.RMSE[2]),
+        -8.68588963f*logf(Reply.RMSE[3]));
+    if(Reply.TargetReached) printf("Target PSNR reached; refinement was stopped early\n");
+    if(Reply.OutOfTime) printf("Time budget reached; refinement was stopped early\n");
+
+    //! Output image straight from the shared memory
+    struct BmpCtx_t Output =
+    {
+        .Width  = Req.Width,
+        .Height = Req.Height,
+        .Stride = 0,
+        .Layout = Req.Layout & BMPCTX_TOPDOWN,
+        .ColPal = (struct BGRA8_t*)(Mem + Req.PalOffset),
+        .PxIdx  = Mem + Req.IdxOffset,
+    };
+    Ok = BmpCtx_ToFile(&Output, argv[3]);
+    munmap(Mem, MemSize);
+    close(MemFd);
+    if(!Ok)
+    {
+        printf("Unable to write output file\n");
+        return -1;
+    }
+    printf("Ok\n");
+    return 0;
+}
+
+/**************************************/
+//! EOF
+/**************************************/
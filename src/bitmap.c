@@ -12,6 +12,8 @@
 #define CLEAR_CONTEXT(Ctx)  \
 	Ctx->Width  = 0,    \
 	Ctx->Height = 0,    \
+	Ctx->Stride = 0,    \
+	Ctx->Layout = 0,    \
 	Ctx->ColPal = NULL, \
 	Ctx->PxBGR  = NULL
 
@@ -58,6 +60,8 @@ int BmpCtx_Create(struct BmpCtx_t *Ctx, int w, int h, int PalCol)
 {
     Ctx->Width  = w;
     Ctx->Height = h;
+    Ctx->Stride = 0;
+    Ctx->Layout = 0;
     if(PalCol)
     {
         Ctx->ColPal = calloc(PalCol, sizeof(struct BGRA8_t));
@@ -85,95 +89,131 @@ void BmpCtx_Destroy(struct BmpCtx_t *Ctx)
 
 /**************************************/
 
-//! Load from file
-int BmpCtx_FromFile(struct BmpCtx_t *Ctx, const char *Filename)
+//! Skip bytes of a stream
+//! NOTE: This reads rather than seeks, so that pipes work
+static int SkipBytes(FILE *File, size_t n)
+{
+    uint8_t Buf[256];
+    while(n)
+    {
+        size_t k = (n < sizeof(Buf)) ? n : sizeof(Buf);
+        if(fread(Buf, 1, k, File) != k) return 0;
+        n -= k;
+    }
+    return 1;
+}
+
+/**************************************/
+
+//! Load from stream
+int BmpCtx_FromStream(struct BmpCtx_t *Ctx, FILE *File)
 {
     CLEAR_CONTEXT(Ctx);
 
-    //! Open file, read headers
-    FILE *File = fopen(Filename, "rb");
-    if(!File) return 0;
+    //! Read headers
+    //! NOTE: The stream is read strictly in order, and Pos tracks
+    //! where we are to skip forward to the palette and pixels.
     struct BMFH_t bmFH;
-    fread(&bmFH, 1, sizeof(bmFH), File);
     struct BMIH_t bmIH;
-    fread(&bmIH, 1, sizeof(bmIH), File);
+    if(fread(&bmFH, 1, sizeof(bmFH), File) != sizeof(bmFH)) return 0;
+    if(fread(&bmIH, 1, sizeof(bmIH), File) != sizeof(bmIH)) return 0;
+    size_t Pos = sizeof(bmFH) + sizeof(bmIH);
+    if(bmFH.Type != ('B'|'M'<<8) || bmIH.Size < sizeof(bmIH) || bmFH.Offs < sizeof(bmFH) + bmIH.Size) return 0;
+    if(!SkipBytes(File, sizeof(bmFH) + bmIH.Size - Pos)) return 0;
+    Pos = sizeof(bmFH) + bmIH.Size;
     Ctx->Width  = bmIH.Width;
     Ctx->Height = bmIH.Height;
 
     //! Read pixels
     int nPx = Ctx->Width*Ctx->Height;
-    if(bmFH.Type == ('B'|'M'<<8)) switch(bmIH.BitCnt)
-        {
-        //! 8bit palettized
-        case 8:
-        {
-            //! Read palette
-            Ctx->ColPal = malloc(BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
-            if(!Ctx->ColPal) break;
-            fread(Ctx->ColPal, BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t), File);
-
-            //! Read pixels
-            fseek(File, bmFH.Offs, SEEK_SET);
-            Ctx->PxIdx = malloc(nPx * sizeof(uint8_t));
-            if(!Ctx->PxIdx) break;
-            fread(Ctx->PxIdx, sizeof(uint8_t), nPx, File);
-        }
-        break;
+    switch(bmIH.BitCnt)
+    {
+    //! 8bit palettized
+    case 8:
+    {
+        //! Read palette
+        //! NOTE: This lies between the headers and the pixels, and
+        //! entries not stored in the file are left clear
+        size_t nCol = (bmFH.Offs - Pos) / sizeof(struct BGRA8_t);
+        if(nCol > BMP_PALETTE_COLOURS) nCol = BMP_PALETTE_COLOURS;
+        Ctx->ColPal = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t));
+        if(!Ctx->ColPal) break;
+        if(fread(Ctx->ColPal, sizeof(struct BGRA8_t), nCol, File) != nCol) break;
+        Pos += nCol * sizeof(struct BGRA8_t);
+
+        //! Read pixels
+        if(!SkipBytes(File, bmFH.Offs - Pos)) break;
+        Ctx->PxIdx = malloc(nPx * sizeof(uint8_t));
+        if(!Ctx->PxIdx) break;
+        if(fread(Ctx->PxIdx, sizeof(uint8_t), nPx, File) != (size_t)nPx) DESTROY_AND_RETURN(Ctx, 0);
+    }
+    break;
 
-        //! BGR
-        case 24:
-        {
-            struct BGRA8_t *PxBGR = Ctx->PxBGR = malloc(nPx * sizeof(struct BGRA8_t));
-            if(!PxBGR) break;
+    //! BGR
+    case 24:
+    {
+        if(!SkipBytes(File, bmFH.Offs - Pos)) break;
+        struct BGRA8_t *PxBGR = Ctx->PxBGR = malloc(nPx * sizeof(struct BGRA8_t));
+        if(!PxBGR) break;
 
-            //! Convert pixels
-            int i;
-            for(i=0; i<nPx; i++)
+        //! Convert pixels
+        int i;
+        for(i=0; i<nPx; i++)
+        {
+            //! Read BGR
+            struct
             {
-                //! Read BGR
-                struct
-                {
-                    uint8_t b, g, r;
-                }  Col;
-                fread(&Col, 1, 3, File);
-
-                //! Store BGRA
-                PxBGR[i].b = Col.b;
-                PxBGR[i].g = Col.g;
-                PxBGR[i].r = Col.r;
-                PxBGR[i].a = 255;
-            }
+                uint8_t b, g, r;
+            }  Col;
+            if(fread(&Col, 1, 3, File) != 3) DESTROY_AND_RETURN(Ctx, 0);
+
+            //! Store BGRA
+            PxBGR[i].b = Col.b;
+            PxBGR[i].g = Col.g;
+            PxBGR[i].r = Col.r;
+            PxBGR[i].a = 255;
         }
-        break;
+    }
+    break;
 
-        //! BGRA
-        case 32:
-        {
-            //! Everything is prepared already, so straight read
-            Ctx->PxBGR = malloc(nPx * sizeof(struct BGRA8_t));
-            if(!Ctx->PxBGR) break;
-            fread(Ctx->PxBGR, sizeof(struct BGRA8_t), nPx, File);
-        }
-        break;
-        }
+    //! BGRA
+    case 32:
+    {
+        //! Everything is prepared already, so straight read
+        if(!SkipBytes(File, bmFH.Offs - Pos)) break;
+        Ctx->PxBGR = malloc(nPx * sizeof(struct BGRA8_t));
+        if(!Ctx->PxBGR) break;
+        if(fread(Ctx->PxBGR, sizeof(struct BGRA8_t), nPx, File) != (size_t)nPx) DESTROY_AND_RETURN(Ctx, 0);
+    }
+    break;
+    }
 
-    //! Close file, check success
-    fclose(File);
+    //! Check success
     if(Ctx->PxBGR || (Ctx->ColPal && Ctx->PxIdx)) return 1;
     else DESTROY_AND_RETURN(Ctx, 0);
 }
+
+//! Load from file
+int BmpCtx_FromFile(struct BmpCtx_t *Ctx, const char *Filename)
+{
+    CLEAR_CONTEXT(Ctx);
+    FILE *File = fopen(Filename, "rb");
+    if(!File) return 0;
+    int Ok = BmpCtx_FromStream(Ctx, File);
+    fclose(File);
+    return Ok;
+}
+
 /**************************************/
 
-//! Write to file
-int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename)
+//! Write to stream
+int BmpCtx_ToStream(const struct BmpCtx_t *Ctx, FILE *File)
 {
     //! Check image is valid
     int nPx = Ctx->Width*Ctx->Height;
     if(!nPx || (!Ctx->PxBGR && !(Ctx->ColPal && Ctx->PxIdx))) return 0;
 
-    //! Open file, write headers
-    FILE *File = fopen(Filename, "wb");
-    if(!File) return 0;
+    //! Write headers
     struct BMFH_t bmFH;
     memset(&bmFH, 0, sizeof(bmFH));
     struct BMIH_t bmIH;
@@ -197,8 +237,17 @@ int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename)
     else            fwrite(Ctx->PxBGR, nPx, sizeof(struct BGRA8_t), File);
 
     //! Done
-    fclose(File);
-    return 1;
+    return !ferror(File);
+}
+
+//! Write to file
+int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename)
+{
+    FILE *File = fopen(Filename, "wb");
+    if(!File) return 0;
+    int Ok = BmpCtx_ToStream(Ctx, File);
+    if(fclose(File) != 0) Ok = 0;
+    return Ok;
 }
 
 /**************************************/
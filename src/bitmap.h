@@ -2,15 +2,29 @@
 #pragma once
 /**************************************/
 #include <stdint.h>
+#include <stdio.h>
 /**************************************/
 #include "colourspace.h"
 /**************************************/
 #define BMP_PALETTE_COLOURS 256
 /**************************************/
 
+//! Pixel layout flags
+//! NOTE: The channel order applies to both direct pixels and palette colours.
+#define BMPCTX_ORDER_BGRA 0x00 //! Byte order: {BB, GG, RR, AA}
+#define BMPCTX_ORDER_RGBA 0x01 //! Byte order: {RR, GG, BB, AA}
+#define BMPCTX_ORDER_ARGB 0x02 //! Byte order: {AA, RR, GG, BB}
+#define BMPCTX_ORDER_ABGR 0x03 //! Byte order: {AA, BB, GG, RR}
+#define BMPCTX_ORDER_MASK 0x03
+#define BMPCTX_TOPDOWN    0x04 //! Rows are stored top-to-bottom (default is bottom-to-top, as in BMP)
+
+/**************************************/
+
 struct BmpCtx_t
 {
     int Width, Height;
+    int Stride; //! Bytes from one row to the next (0 = Tightly packed)
+    int Layout; //! Pixel layout flags (BMPCTX_ORDER_x | BMPCTX_TOPDOWN)
     struct BGRA8_t *ColPal;
     union
     {
@@ -21,6 +35,44 @@ struct BmpCtx_t
 
 /**************************************/
 
+//! Get a row of pixel data
+//! NOTE: Rows are always counted from the bottom, regardless of layout
+static inline const void *BmpCtx_GetRow(const struct BmpCtx_t *Ctx, int y)
+{
+    int Stride = Ctx->Stride;
+    if(!Stride) Stride = Ctx->Width * (Ctx->ColPal ? sizeof(uint8_t) : sizeof(struct BGRA8_t));
+    if(Ctx->Layout & BMPCTX_TOPDOWN) y = Ctx->Height-1 - y;
+    return (const uint8_t*)Ctx->PxIdx + (intptr_t)y*Stride;
+}
+
+//! Get a rectangle of an image as an image of its own
+//! NOTE: Rows are always counted from the bottom, regardless of layout
+static inline struct BmpCtx_t BmpCtx_GetRect(const struct BmpCtx_t *Ctx, int x, int y, int w, int h)
+{
+    struct BmpCtx_t Rect = *Ctx;
+    size_t PxSize = Ctx->ColPal ? sizeof(uint8_t) : sizeof(struct BGRA8_t);
+    const uint8_t *Base = BmpCtx_GetRow(Ctx, (Ctx->Layout & BMPCTX_TOPDOWN) ? (y+h-1) : y);
+    Rect.Width  = w;
+    Rect.Height = h;
+    Rect.Stride = Ctx->Stride ? Ctx->Stride : (int)(Ctx->Width * PxSize);
+    Rect.PxIdx  = (uint8_t*)Base + x*PxSize;
+    return Rect;
+}
+
+//! Re-order a colour's channels from the given layout into BGRA
+static inline struct BGRA8_t BmpCtx_ToBGRA(struct BGRA8_t x, int Layout)
+{
+    switch(Layout & BMPCTX_ORDER_MASK)
+    {
+    case BMPCTX_ORDER_RGBA: return (struct BGRA8_t){.b = x.r, .g = x.g, .r = x.b, .a = x.a};
+    case BMPCTX_ORDER_ARGB: return (struct BGRA8_t){.b = x.a, .g = x.r, .r = x.g, .a = x.b};
+    case BMPCTX_ORDER_ABGR: return (struct BGRA8_t){.b = x.g, .g = x.r, .r = x.a, .a = x.b};
+    }
+    return x;
+}
+
+/**************************************/
+
 //! Create context
 //! Pass PalCol=0 for BGRA
 int BmpCtx_Create(struct BmpCtx_t *Ctx, int w, int h, int PalCol);
@@ -33,11 +85,21 @@ void BmpCtx_Destroy(struct BmpCtx_t *Ctx);
 //! NOTE: This internally creates the context
 int BmpCtx_FromFile(struct BmpCtx_t *Ctx, const char *Filename);
 
+//! Load from stream (eg. stdin)
+//! The stream is read strictly in order, without seeking, and is left
+//! just past the pixels (so that images may follow one another).
+//! NOTE: File must be in binary mode
+int BmpCtx_FromStream(struct BmpCtx_t *Ctx, FILE *File);
+
 //! Write to file
 //! To write a BGRA image, set ColPal=nullptr
 //! NOTE: Always 32bit BGRA; 24bit BGR is never used for output
 int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename);
 
+//! Write to stream (eg. stdout)
+//! NOTE: File must be in binary mode, and is not flushed
+int BmpCtx_ToStream(const struct BmpCtx_t *Ctx, FILE *File);
+
 /**************************************/
 //! EOF
 /**************************************/
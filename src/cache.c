@@ -0,0 +1,381 @@
+/**************************************/
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+/**************************************/
+#ifdef _WIN32
+# include <windows.h>
+# include <process.h>
+# define getpid _getpid
+#else
+# include <dirent.h>
+# include <unistd.h>
+# include <sys/stat.h>
+#endif
+/**************************************/
+#include "bitmap.h"
+#include "cache.h"
+#include "colourspace.h"
+#include "quantize.h"
+/**************************************/
+
+//! Entry file header
+#define CACHE_MAGIC 0x31435154 //! "TQC1"
+struct CacheHeader_t
+{
+    uint32_t Magic;   //! CACHE_MAGIC
+    uint32_t Version; //! CACHE_VERSION
+    struct CacheKey_t Key;
+    int32_t  Width;
+    int32_t  Height;
+    int32_t  nTiles;
+    int32_t  nColours;
+    float    RMSE[4];
+    int32_t  TargetReached;
+    int32_t  Reserved;
+};
+
+//! Extension of entry files
+#define CACHE_EXT ".tqc"
+
+//! Extension of temporary files (appended to the entry name)
+#define CACHE_TEMP_EXT ".tmp"
+
+/**************************************/
+
+//! Hash state
+//! This runs two lanes of 64-bit multiply-rotate rounds over 16-byte
+//! blocks, which is fast enough that hashing is negligible next to
+//! reading the image.
+#define HASH_PRIME1 0x9E3779B185EBCA87ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+struct CacheHash_t
+{
+    uint64_t Lane[2];
+    uint64_t Len;
+    uint8_t  Buf[16];
+    int      nBuf;
+};
+
+static inline uint64_t Rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64-r));
+}
+
+static inline uint64_t Avalanche64(uint64_t x)
+{
+    x ^= x >> 33, x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33, x *= 0xC4CEB9FE1A85EC53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static void CacheHash_Begin(struct CacheHash_t *Hash)
+{
+    Hash->Lane[0] = HASH_PRIME1 + HASH_PRIME2;
+    Hash->Lane[1] = HASH_PRIME2;
+    Hash->Len  = 0;
+    Hash->nBuf = 0;
+}
+
+static inline void CacheHash_Block(struct CacheHash_t *Hash, const uint8_t *Block)
+{
+    uint64_t a, b;
+    memcpy(&a, Block,   sizeof(a));
+    memcpy(&b, Block+8, sizeof(b));
+    Hash->Lane[0] = Rotl64(Hash->Lane[0] + a*HASH_PRIME2, 31) * HASH_PRIME1;
+    Hash->Lane[1] = Rotl64(Hash->Lane[1] + b*HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+static void CacheHash_Add(struct CacheHash_t *Hash, const void *Data, size_t Size)
+{
+    const uint8_t *Src = (const uint8_t*)Data;
+    Hash->Len += Size;
+
+    //! Complete any partial block first
+    if(Hash->nBuf)
+    {
+        size_t n = sizeof(Hash->Buf) - Hash->nBuf;
+        if(n > Size) n = Size;
+        memcpy(Hash->Buf + Hash->nBuf, Src, n);
+        Hash->nBuf += n, Src += n, Size -= n;
+        if(Hash->nBuf < (int)sizeof(Hash->Buf)) return;
+        CacheHash_Block(Hash, Hash->Buf);
+        Hash->nBuf = 0;
+    }
+    for(; Size >= sizeof(Hash->Buf); Src += sizeof(Hash->Buf), Size -= sizeof(Hash->Buf))
+    {
+        CacheHash_Block(Hash, Src);
+    }
+    memcpy(Hash->Buf, Src, Size);
+    Hash->nBuf = Size;
+}
+
+static void CacheHash_AddInt(struct CacheHash_t *Hash, int32_t x)
+{
+    CacheHash_Add(Hash, &x, sizeof(x));
+}
+
+static void CacheHash_AddFloat(struct CacheHash_t *Hash, float x)
+{
+    CacheHash_Add(Hash, &x, sizeof(x));
+}
+
+static struct CacheKey_t CacheHash_End(struct CacheHash_t *Hash)
+{
+    //! Pad the last block with zeros; the length tells it apart
+    if(Hash->nBuf)
+    {
+        memset(Hash->Buf + Hash->nBuf, 0, sizeof(Hash->Buf) - Hash->nBuf);
+        CacheHash_Block(Hash, Hash->Buf);
+    }
+    uint64_t a = Hash->Lane[0], b = Hash->Lane[1];
+    return (struct CacheKey_t)
+    {
+        {
+            Avalanche64((a ^ Hash->Len) + b*HASH_PRIME1),
+            Avalanche64((b + Hash->Len*HASH_PRIME2) ^ Rotl64(a, 27)),
+        }
+    };
+}
+
+/**************************************/
+
+//! Get the key of an image's pixels
+struct CacheKey_t Cache_GetImageKey(const struct BmpCtx_t *Image)
+{
+    int x, y;
+    struct CacheHash_t Hash;
+    CacheHash_Begin(&Hash);
+    CacheHash_AddInt(&Hash, Image->Width);
+    CacheHash_AddInt(&Hash, Image->Height);
+    for(y=0; y<Image->Height; y++)
+    {
+        const void *Row = BmpCtx_GetRow(Image, y);
+        if(!Image->ColPal && !(Image->Layout & BMPCTX_ORDER_MASK))
+        {
+            CacheHash_Add(&Hash, Row, Image->Width*sizeof(struct BGRA8_t));
+            continue;
+        }
+
+        //! Convert to BGRA8 a chunk at a time
+        struct BGRA8_t Px[64];
+        for(x=0; x<Image->Width; )
+        {
+            int n;
+            for(n=0; n<64 && x<Image->Width; n++, x++)
+            {
+                if(Image->ColPal) Px[n] = Image->ColPal[((const uint8_t*)Row)[x]];
+                else              Px[n] = ((const struct BGRA8_t*)Row)[x];
+                if(Image->Layout & BMPCTX_ORDER_MASK) Px[n] = BmpCtx_ToBGRA(Px[n], Image->Layout);
+            }
+            CacheHash_Add(&Hash, Px, n*sizeof(struct BGRA8_t));
+        }
+    }
+    return CacheHash_End(&Hash);
+}
+
+/**************************************/
+
+//! Get the key of a result
+struct CacheKey_t Cache_GetKey(
+    const struct CacheKey_t *ImageKey,
+    const struct CacheParams_t *Params,
+    const struct QuantCtrl_t *Ctrl,
+    const struct BGRA8_t *SrcPalette
+)
+{
+    static const struct QuantCtrl_t NoCtrl = {.Init = QUANTINIT_SPLIT, .Split = QUANTSPLIT_MAXDIST};
+    if(!Ctrl) Ctrl = &NoCtrl;
+
+    //! NOTE: Each value is hashed on its own, so that
+    //! padding in the structures does not get hashed
+    struct CacheHash_t Hash;
+    CacheHash_Begin(&Hash);
+    CacheHash_AddInt  (&Hash, CACHE_VERSION);
+    CacheHash_Add     (&Hash, ImageKey, sizeof(*ImageKey));
+    CacheHash_AddInt  (&Hash, Params->nPalettes);
+    CacheHash_AddInt  (&Hash, Params->nColoursPerPalette);
+    CacheHash_AddInt  (&Hash, Params->nUnusedColoursPerPalette);
+    CacheHash_AddInt  (&Hash, Params->TileW);
+    CacheHash_AddInt  (&Hash, Params->TileH);
+    CacheHash_AddInt  (&Hash, Params->nTileClusterPasses);
+    CacheHash_AddInt  (&Hash, Params->nColourClusterPasses);
+    CacheHash_Add     (&Hash, &Params->BitRange, sizeof(Params->BitRange));
+    CacheHash_AddInt  (&Hash, Params->DitherMode);
+    CacheHash_AddFloat(&Hash, Params->DitherLevel);
+    CacheHash_AddFloat(&Hash, Ctrl->TargetPSNR);
+    CacheHash_AddInt  (&Hash, Ctrl->CoarseToFine);
+    CacheHash_AddInt  (&Hash, Ctrl->MiniBatch);
+    CacheHash_AddInt  (&Hash, Ctrl->Init);
+    CacheHash_AddInt  (&Hash, Ctrl->Split);
+    CacheHash_AddFloat(&Hash, Ctrl->Tolerance);
+    CacheHash_AddInt  (&Hash, Ctrl->TileRefinePasses);
+    CacheHash_AddInt  (&Hash, SrcPalette != NULL);
+    if(SrcPalette)
+    {
+        CacheHash_Add(&Hash, SrcPalette, Params->nPalettes*Params->nColoursPerPalette*sizeof(struct BGRA8_t));
+    }
+    return CacheHash_End(&Hash);
+}
+
+/**************************************/
+
+//! Get the filename of an entry
+static void GetEntryFilename(char *Dst, int DstSize, const char *Dir, const struct CacheKey_t *Key)
+{
+    snprintf(Dst, DstSize, "%s/%016llx%016llx" CACHE_EXT, Dir, (unsigned long long)Key->Hash[0], (unsigned long long)Key->Hash[1]);
+}
+
+//! Get the sizes of the data of an entry
+static void GetEntrySizes(const struct CacheEntry_t *Entry, size_t Sizes[3])
+{
+    Sizes[0] = (size_t)Entry->Width * Entry->Height * sizeof(uint8_t);
+    Sizes[1] = (size_t)Entry->nColours * sizeof(struct BGRA8_t);
+    Sizes[2] = (size_t)Entry->nTiles   * sizeof(int32_t);
+}
+
+/**************************************/
+
+//! Load an entry
+int Cache_Load(const char *Dir, const struct CacheKey_t *Key, struct CacheEntry_t *Entry)
+{
+    char Filename[FILENAME_MAX];
+    GetEntryFilename(Filename, sizeof(Filename), Dir, Key);
+    FILE *File = fopen(Filename, "rb");
+    if(!File) return 0;
+
+    //! Check the header
+    struct CacheHeader_t Header;
+    int Ok = fread(&Header, sizeof(Header), 1, File) == 1 &&
+             Header.Magic    == CACHE_MAGIC   &&
+             Header.Version  == CACHE_VERSION &&
+             !memcmp(&Header.Key, Key, sizeof(*Key)) &&
+             Header.Width    == Entry->Width  &&
+             Header.Height   == Entry->Height &&
+             Header.nTiles   == Entry->nTiles &&
+             Header.nColours == Entry->nColours;
+
+    //! Read the data
+    size_t Sizes[3];
+    GetEntrySizes(Entry, Sizes);
+    if(Ok) Ok = fread(Entry->PxIdx,   1, Sizes[0], File) == Sizes[0] &&
+                fread(Entry->Palette, 1, Sizes[1], File) == Sizes[1] &&
+                (!Entry->TilePalIdx || fread(Entry->TilePalIdx, 1, Sizes[2], File) == Sizes[2]);
+    fclose(File);
+    if(!Ok) return 0;
+    Entry->RMSE = (struct BGRAf_t){Header.RMSE[0], Header.RMSE[1], Header.RMSE[2], Header.RMSE[3]};
+    Entry->TargetReached = Header.TargetReached;
+    return 1;
+}
+
+/**************************************/
+
+//! Store an entry
+int Cache_Store(const char *Dir, const struct CacheKey_t *Key, const struct CacheEntry_t *Entry)
+{
+    int i;
+    if(!Entry->TilePalIdx) return 0;
+
+    //! Create a temporary file that no other writer is using
+    //! NOTE: The process ID and an atomic counter keep the names of
+    //! writers apart (including threads of the same process), and
+    //! exclusive creation ("x") makes any remaining clash fail rather
+    //! than share the file, in which case the next name is tried.
+    static atomic_uint Counter = 0;
+    char Filename[FILENAME_MAX], TempName[FILENAME_MAX+32];
+    GetEntryFilename(Filename, sizeof(Filename), Dir, Key);
+    FILE *File = NULL;
+    for(i=0; i<16 && !File; i++)
+    {
+        snprintf(TempName, sizeof(TempName), "%s.%d.%u" CACHE_TEMP_EXT, Filename, (int)getpid(), atomic_fetch_add(&Counter, 1));
+        File = fopen(TempName, "wbx");
+    }
+    if(!File) return 0;
+
+    //! Write the entry
+    struct CacheHeader_t Header =
+    {
+        .Magic    = CACHE_MAGIC,
+        .Version  = CACHE_VERSION,
+        .Key      = *Key,
+        .Width    = Entry->Width,
+        .Height   = Entry->Height,
+        .nTiles   = Entry->nTiles,
+        .nColours = Entry->nColours,
+        .RMSE     = {Entry->RMSE.b, Entry->RMSE.g, Entry->RMSE.r, Entry->RMSE.a},
+        .TargetReached = Entry->TargetReached,
+    };
+    size_t Sizes[3];
+    GetEntrySizes(Entry, Sizes);
+    int Ok = fwrite(&Header, sizeof(Header), 1, File) == 1 &&
+             fwrite(Entry->PxIdx,      1, Sizes[0], File) == Sizes[0] &&
+             fwrite(Entry->Palette,    1, Sizes[1], File) == Sizes[1] &&
+             fwrite(Entry->TilePalIdx, 1, Sizes[2], File) == Sizes[2];
+    if(fclose(File) != 0) Ok = 0;
+
+    //! Move it into place
+    //! NOTE: Where rename() does not replace existing files, failing
+    //! means another writer got there first with the same data.
+    if(!Ok || rename(TempName, Filename) != 0)
+    {
+        remove(TempName);
+        return 0;
+    }
+    return 1;
+}
+
+/**************************************/
+
+//! Check if a filename is that of a temporary file
+static int IsTempFilename(const char *Name)
+{
+    size_t Len = strlen(Name), ExtLen = strlen(CACHE_TEMP_EXT);
+    return Len > ExtLen && !strcmp(Name + Len - ExtLen, CACHE_TEMP_EXT) && strstr(Name, CACHE_EXT ".");
+}
+
+//! Remove temporary files left behind by writers that never finished
+int Cache_RemoveStaleTemps(const char *Dir)
+{
+    int nRemoved = 0;
+    char Filename[FILENAME_MAX];
+#ifdef _WIN32
+    //! NOTE: FILETIME counts 100ns intervals
+    WIN32_FIND_DATAA Find;
+    snprintf(Filename, sizeof(Filename), "%s/*" CACHE_TEMP_EXT, Dir);
+    HANDLE FindHandle = FindFirstFileA(Filename, &Find);
+    if(FindHandle == INVALID_HANDLE_VALUE) return 0;
+    FILETIME NowFT;
+    GetSystemTimeAsFileTime(&NowFT);
+    ULONGLONG Now = ((ULONGLONG)NowFT.dwHighDateTime << 32) | NowFT.dwLowDateTime;
+    do
+    {
+        ULONGLONG Time = ((ULONGLONG)Find.ftLastWriteTime.dwHighDateTime << 32) | Find.ftLastWriteTime.dwLowDateTime;
+        if(!IsTempFilename(Find.cFileName) || Now - Time < (ULONGLONG)CACHE_STALE_TEMP_AGE*10000000) continue;
+        snprintf(Filename, sizeof(Filename), "%s/%s", Dir, Find.cFileName);
+        if(!remove(Filename)) nRemoved++;
+    } while(FindNextFileA(FindHandle, &Find));
+    FindClose(FindHandle);
+#else
+    DIR *D = opendir(Dir);
+    if(!D) return 0;
+    time_t Now = time(NULL);
+    struct dirent *Ent;
+    while((Ent = readdir(D)) != NULL)
+    {
+        struct stat St;
+        if(!IsTempFilename(Ent->d_name)) continue;
+        snprintf(Filename, sizeof(Filename), "%s/%s", Dir, Ent->d_name);
+        if(stat(Filename, &St) || difftime(Now, St.st_mtime) < CACHE_STALE_TEMP_AGE) continue;
+        if(!remove(Filename)) nRemoved++;
+    }
+    closedir(D);
+#endif
+    return nRemoved;
+}
+
+/**************************************/
+//! EOF
+/**************************************/
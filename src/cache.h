@@ -0,0 +1,110 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stdint.h>
+/**************************************/
+#include "bitmap.h"
+#include "colourspace.h"
+#include "quantize.h"
+/**************************************/
+
+//! Result cache
+//! Results are stored as one file per key in a cache directory, so that
+//! re-running on unchanged inputs (eg. in a build pipeline) can skip all
+//! processing. The key covers the pixels, every setting that affects the
+//! result, and CACHE_VERSION. Entries are written to a temporary file and
+//! then renamed into place, so that several processes can share one
+//! directory: readers only ever see complete entries, and writers racing
+//! on the same key store identical data.
+//! NOTE: Results under a time budget depend on timing, and so should not
+//! be cached.
+//! NOTE: A writer that dies mid-store leaves its temporary file behind;
+//! Cache_RemoveStaleTemps() clears these out.
+//! NOTE: Entries are stored in native byte order.
+
+//! Version of the results
+//! NOTE: This must be increased whenever a change to the processing
+//! changes the result for the same input and settings.
+#define CACHE_VERSION 1
+
+//! Age in seconds after which a temporary file is taken to be left over
+//! from a writer that never finished (no store takes anywhere near this)
+#define CACHE_STALE_TEMP_AGE 3600
+
+/**************************************/
+
+//! Cache key (a 128-bit hash)
+struct CacheKey_t
+{
+    uint64_t Hash[2];
+};
+
+//! Settings that affect the result (as given to Qualetize())
+struct CacheParams_t
+{
+    int   nPalettes;
+    int   nColoursPerPalette;
+    int   nUnusedColoursPerPalette;
+    int   TileW;
+    int   TileH;
+    int   nTileClusterPasses;
+    int   nColourClusterPasses;
+    struct BGRA8_t BitRange;
+    int   DitherMode;
+    float DitherLevel;
+};
+
+//! Cache entry
+//! The outputs are held in the caller's buffers, as produced by
+//! Qualetize(): PxIdx[Width*Height] (bottom-up), Palette[nColours]
+//! and TilePalIdx[nTiles] (bottom-up; NULL = Not stored/loaded).
+struct CacheEntry_t
+{
+    int     Width;
+    int     Height;
+    int     nTiles;
+    int     nColours;
+    struct BGRAf_t RMSE;
+    int     TargetReached;
+    uint8_t *PxIdx;
+    struct BGRA8_t *Palette;
+    int32_t *TilePalIdx;
+};
+
+/**************************************/
+
+//! Get the key of an image's pixels
+//! NOTE: Pixels are hashed as BGRA8 from the bottom row up, so the key
+//! does not depend on the layout or on whether the image is paletted.
+struct CacheKey_t Cache_GetImageKey(const struct BmpCtx_t *Image);
+
+//! Get the key of a result
+//! This combines the key of the image with the settings, the options in
+//! Ctrl that affect the result (Ctrl may be NULL), the palettes remapped
+//! to (SrcPalette[nPalettes*nColoursPerPalette]; NULL = None), and
+//! CACHE_VERSION.
+struct CacheKey_t Cache_GetKey(
+    const struct CacheKey_t *ImageKey,
+    const struct CacheParams_t *Params,
+    const struct QuantCtrl_t *Ctrl,
+    const struct BGRA8_t *SrcPalette
+);
+
+//! Load an entry
+//! Entry->{Width,Height,nTiles,nColours} and the output buffers must be
+//! set by the caller, and the stored entry must match them.
+//! Returns 0 if there is no such entry (the buffers may be overwritten).
+int Cache_Load(const char *Dir, const struct CacheKey_t *Key, struct CacheEntry_t *Entry);
+
+//! Store an entry
+//! This is safe to call from several threads at once.
+//! Returns 0 on failure, which only means that the entry is not cached.
+int Cache_Store(const char *Dir, const struct CacheKey_t *Key, const struct CacheEntry_t *Entry);
+
+//! Remove temporary files older than CACHE_STALE_TEMP_AGE
+//! Returns the number of files removed.
+int Cache_RemoveStaleTemps(const char *Dir);
+
+/**************************************/
+//! EOF
+/**************************************/
@@ -4,23 +4,30 @@
 /**************************************/
 #include "colourspace.h"
 #include "dither.h"
+#include "kdtree.h"
 #include "qualetize.h"
+#include "simd.h"
 /**************************************/
 
+//! Get the first palette entry considered for matching
+static inline int GetFirstPaletteEntry(int PalUnused)
+{
+    return PalUnused ? (PalUnused-1) : 0;
+}
+
 //! Palette entry matching
-static int FindPaletteEntry(const struct BGRAf_t *Px, const struct BGRAf_t *Pal, int MaxPalSize, int PalUnused)
+//! NOTE: PalYUV is the palette in YUVA mode (see BGRAf_AsYUV())
+//! NOTE: Tree, if not NULL, holds the entries from GetFirstPaletteEntry() on,
+//! and is searched starting from entry Guess (-1 = None).
+static inline int FindPaletteEntry(const struct BGRAf_t *Px, const struct BGRAf_t *PalYUV, int MaxPalSize, int PalUnused, struct KdTree_t *Tree, int Guess)
 {
-    int   i;
-    int   MinIdx = 0;
-    float MinDst = INFINITY;
-    struct BGRAf_t PxYUV = BGRAf_AsYUV(Px), PalYUV;
-    for(i=PalUnused-1; i<MaxPalSize; i++)
-    {
-        PalYUV = BGRAf_AsYUV(&Pal[i]);
-        float Dst = BGRAf_ColDistance(&PxYUV, &PalYUV);
-        if(Dst < MinDst) MinIdx = i, MinDst = Dst;
-    }
-    return MinIdx;
+    int   FirstEntry = GetFirstPaletteEntry(PalUnused);
+    float MinDst;
+    struct BGRAf_t PxYUV = BGRAf_AsYUV(Px);
+    int MinIdx;
+    if(Tree) MinIdx = KdTree_NearestL2(Tree, &PxYUV, Guess - FirstEntry, &MinDst);
+    else MinIdx = Simd_NearestPaletteL2(&PxYUV, PalYUV + FirstEntry, MaxPalSize - FirstEntry, &MinDst);
+    return (MinIdx < 0) ? 0 : (FirstEntry + MinIdx);
 }
 
 /**************************************/
@@ -28,6 +35,8 @@ static int FindPaletteEntry(const struct BGRAf_t *Px, const struct BGRAf_t *Pal,
 //! Handle conversion of image with given palette, return RMS error
 struct BGRAf_t DitherImage(
     const struct BmpCtx_t *Image,
+    int OriginX,
+    int OriginY,
     const struct BGRA8_t *BitRange,
     struct BGRAf_t *RawPxOutput,
 
@@ -46,6 +55,7 @@ struct BGRAf_t DitherImage(
 )
 {
     int i;
+    Simd_Init();
 
     //! Get parameters, pointers, etc.
     int x, y;
@@ -57,8 +67,9 @@ struct BGRAf_t DitherImage(
         0,0,0,0
     };
 #endif
-    const        uint8_t *PxSrcIdx = Image->ColPal ? Image->PxIdx  : NULL;
-    const struct BGRA8_t *PxSrcBGR = Image->ColPal ? Image->ColPal : Image->PxBGR;
+    const        uint8_t *PxSrcIdx = NULL;
+    const struct BGRA8_t *PxSrcBGR = NULL;
+    int PxSrcLayout = Image->Layout;
 
     //! Initialize dither patterns
     //! For Floyd-Steinberg dithering, we only keep track of two scanlines
@@ -127,6 +138,27 @@ struct BGRAf_t DitherImage(
         }
     }
 
+    //! Get YUVA copy of the palettes for matching
+    //! NOTE: Converting once here avoids doing so for every entry of every pixel
+    struct BGRAf_t TilePalettesYUV[BMP_PALETTE_COLOURS];
+    if(TilePxOutput) for(i=0; i<MaxTilePals*MaxPalSize; i++)
+        {
+            TilePalettesYUV[i] = BGRAf_AsYUV(&TilePalettes[i]);
+        }
+
+    //! Build k-d trees for large palettes
+    //! NOTE: As palettes share BMP_PALETTE_COLOURS entries, there can only
+    //! be a few palettes large enough to need one
+    struct KdTree_t PalTrees[BMP_PALETTE_COLOURS / KDTREE_MIN_POINTS];
+    int FirstEntry = GetFirstPaletteEntry(PalUnused);
+    int UseTrees = TilePxOutput && KdTree_Use(MaxPalSize - FirstEntry);
+    int LastPalIdx[BMP_PALETTE_COLOURS / KDTREE_MIN_POINTS];
+    if(UseTrees) for(i=0; i<MaxTilePals; i++)
+        {
+            KdTree_Build(&PalTrees[i], TilePalettesYUV + i*MaxPalSize + FirstEntry, sizeof(struct BGRAf_t), MaxPalSize - FirstEntry);
+            LastPalIdx[i] = -1;
+        }
+
     //! Begin processing of pixels
     int TileHeightCounter = TileH;
     struct BGRAf_t *DiffuseThisLine = Dither.DiffuseError + 1;    //! <- 1px padding on left
@@ -139,6 +171,15 @@ struct BGRAf_t DitherImage(
     {
         int TilePalIdx = 0;
         int TileWidthCounter = 0;
+
+        //! Get source pixels for this row
+        if(Image->ColPal)
+        {
+            PxSrcIdx = BmpCtx_GetRow(Image, y);
+            PxSrcBGR = Image->ColPal;
+        }
+        else PxSrcBGR = BmpCtx_GetRow(Image, y);
+
         for(x=0; x<ImgW; x++)
         {
             //! Advance tile palette index
@@ -155,6 +196,7 @@ struct BGRAf_t DitherImage(
                 struct BGRA8_t p;
                 if(PxSrcIdx) p = PxSrcBGR[*PxSrcIdx++];
                 else         p = *PxSrcBGR++;
+                if(PxSrcLayout & BMPCTX_ORDER_MASK) p = BmpCtx_ToBGRA(p, PxSrcLayout);
                 Px = Px_Original = BGRAf_FromBGRA8(&p);
             }
             if(DitherType != DITHER_NONE)
@@ -172,7 +214,7 @@ struct BGRAf_t DitherImage(
                 else
                 {
                     //! Adjust for dither matrix
-                    int Threshold = 0, xKey = x, yKey = x^y;
+                    int Threshold = 0, xKey = x+OriginX, yKey = (x+OriginX)^(y+OriginY);
                     int Bit = DitherType-1;
                     do
                     {
@@ -189,7 +231,13 @@ struct BGRAf_t DitherImage(
             //! Find matching palette entry, store to output, and get error
             if(TilePxOutput)
             {
-                int PalIdx  = FindPaletteEntry(&Px, TilePalettes + TilePalIdx*MaxPalSize, MaxPalSize, PalUnused);
+                //! NOTE: Neighbouring pixels tend to match the same entry,
+                //! so the last match is a good starting point for the search
+                struct KdTree_t *Tree = NULL;
+                int Guess = -1;
+                if(UseTrees) Tree = &PalTrees[TilePalIdx], Guess = LastPalIdx[TilePalIdx];
+                int PalIdx  = FindPaletteEntry(&Px, TilePalettesYUV + TilePalIdx*MaxPalSize, MaxPalSize, PalUnused, Tree, Guess);
+                if(Tree) LastPalIdx[TilePalIdx] = PalIdx;
                 PalIdx += TilePalIdx*MaxPalSize;
                 *TilePxOutput++ = PalIdx;
                 Px = TilePalettes[PalIdx];
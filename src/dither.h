@@ -9,10 +9,17 @@
 //! Notes:
 //!  -Passing RawPxOutput != NULL will store the dithered image there.
 //!  -Passing TilePxOutput != NULL will store the output image there,
-//!   using TilePalettes as a reference.
+//!   using TilePalettes as a reference. At most BMP_PALETTE_COLOURS
+//!   (MaxTilePals*MaxPalSize) palette entries are supported.
 //!  -DiffusionBuffer[] needs to be (Image->Width+2)*2 elements in size.
+//!  -When Image is a rectangle of a larger image (see BmpCtx_GetRect()),
+//!   {OriginX,OriginY} is its position, so that ordered dithering lines
+//!   up with the rest of the image. Error diffusion can't see outside
+//!   of the rectangle, however.
 struct BGRAf_t DitherImage(
     const struct BmpCtx_t *Image,
+    int OriginX,
+    int OriginY,
     const struct BGRA8_t *BitRange,
     struct BGRAf_t *RawPxOutput,
 
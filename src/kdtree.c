@@ -0,0 +1,200 @@
+/**************************************/
+#include <math.h>
+/**************************************/
+#include "colourspace.h"
+#include "kdtree.h"
+#include "simd.h"
+/**************************************/
+
+//! Get a coordinate of a point
+#define KDTREE_COORD(p, Axis) (((const float*)(p))[Axis])
+
+//! Number of points from which a tree search beats a linear search, for
+//! each Simd level (0 = Never). The wide kernels search all 256 points of
+//! a full palette faster than the tree can prune them.
+static const int KdTree_MinPoints[SIMD_LEVEL_COUNT] =
+{
+    KDTREE_MIN_POINTS, //! SIMD_LEVEL_SCALAR
+    256,               //! SIMD_LEVEL_SSE2
+    0,                 //! SIMD_LEVEL_AVX2
+    0,                 //! SIMD_LEVEL_AVX512
+};
+
+/**************************************/
+
+//! Swap two points (and their indices)
+static inline void KdTree_Swap(struct KdTree_t *Tree, int a, int b)
+{
+    struct BGRAf_t p = Tree->Points[a];
+    int            n = Tree->Index [a];
+    Tree->Points[a] = Tree->Points[b], Tree->Index[a] = Tree->Index[b];
+    Tree->Points[b] = p,               Tree->Index[b] = n;
+}
+
+//! Partially sort points [Lo,Hi) so that point Mid is in its sorted position
+static void KdTree_Select(struct KdTree_t *Tree, int Lo, int Hi, int Mid, int Axis)
+{
+    while(Hi - Lo > 1)
+    {
+        //! Lomuto partition around the middle point
+        int i, Store = Lo;
+        KdTree_Swap(Tree, (Lo+Hi)/2, Hi-1);
+        float Pivot = KDTREE_COORD(&Tree->Points[Hi-1], Axis);
+        for(i=Lo; i<Hi-1; i++) if(KDTREE_COORD(&Tree->Points[i], Axis) < Pivot)
+            {
+                KdTree_Swap(Tree, i, Store++);
+            }
+        KdTree_Swap(Tree, Store, Hi-1);
+        if(Store == Mid) break;
+        if(Store < Mid) Lo = Store+1;
+        else Hi = Store;
+    }
+}
+
+//! Build the node for points [Lo,Hi)
+//! Returns the node index
+static int KdTree_BuildNode(struct KdTree_t *Tree, int Lo, int Hi)
+{
+    int i, Axis;
+    int NodeIdx = Tree->nNodes++;
+    struct KdTreeNode_t *Node = &Tree->Nodes[NodeIdx];
+    if(Hi - Lo <= KDTREE_LEAF_SIZE)
+    {
+        Node->Axis = -1;
+        Node->Lo   = Lo;
+        Node->Hi   = Hi;
+        return NodeIdx;
+    }
+
+    //! Split along the axis of greatest spread
+    float MaxSpread = -1.0f;
+    Node->Axis = 0;
+    for(Axis=0; Axis<4; Axis++)
+    {
+        float Min = INFINITY, Max = -INFINITY;
+        for(i=Lo; i<Hi; i++)
+        {
+            float v = KDTREE_COORD(&Tree->Points[i], Axis);
+            if(v < Min) Min = v;
+            if(v > Max) Max = v;
+        }
+        if(Max - Min > MaxSpread) MaxSpread = Max - Min, Node->Axis = Axis;
+    }
+
+    //! Split at the median
+    int Mid = (Lo + Hi) / 2;
+    KdTree_Select(Tree, Lo, Hi, Mid, Node->Axis);
+    Node->Split = KDTREE_COORD(&Tree->Points[Mid], Node->Axis);
+    int ChildLo = KdTree_BuildNode(Tree, Lo,  Mid);
+    int ChildHi = KdTree_BuildNode(Tree, Mid, Hi);
+    Node = &Tree->Nodes[NodeIdx];
+    Node->Lo = ChildLo;
+    Node->Hi = ChildHi;
+    return NodeIdx;
+}
+
+/**************************************/
+
+//! Check if a tree is worth using
+int KdTree_Use(int nPoints)
+{
+    Simd_Init();
+    int MinPoints = KdTree_MinPoints[Simd.Level];
+    return MinPoints && nPoints >= MinPoints && nPoints <= KDTREE_MAX_POINTS;
+}
+
+/**************************************/
+
+//! Build tree
+void KdTree_Build(struct KdTree_t *Tree, const struct BGRAf_t *Points, size_t Stride, int nPoints)
+{
+    int i;
+    Tree->nPoints = nPoints;
+    Tree->nNodes  = 0;
+    for(i=0; i<nPoints; i++)
+    {
+        Tree->Points[i] = *(const struct BGRAf_t*)((const uint8_t*)Points + i*Stride);
+        Tree->Index [i] = i;
+    }
+    if(nPoints) KdTree_BuildNode(Tree, 0, nPoints);
+    for(i=0; i<nPoints; i++) Tree->Position[Tree->Index[i]] = i;
+}
+
+/**************************************/
+
+//! Get the distance between two points
+//! NOTE: This must match the Simd kernels exactly (see simd.c)
+static inline float KdTree_Distance(const struct BGRAf_t *x, const struct BGRAf_t *p, int L2)
+{
+    if(L2) return BGRAf_ColDistance(x, p);
+    struct BGRAf_t t = BGRAf_Sub(x, p);
+    t = BGRAf_Abs(&t);
+    return BGRAf_Sum(&t);
+}
+
+//! Search a node for a point nearer than *BestDist
+//! NOTE: No point on the far side of a split can be nearer than the distance
+//! along the split axis alone. This bound holds exactly in floating point, as
+//! the distances are sums of non-negative terms. Far sides are still searched
+//! when the bound equals *BestDist, so that ties resolve to the lowest index.
+#define KDTREE_DEFINE_SEARCH(Name, L2) \
+	static void KdTree_Search##Name(struct KdTree_t *Tree, int NodeIdx, const struct BGRAf_t *x, int *BestIdx, float *BestDist) { \
+		const struct KdTreeNode_t *Node = &Tree->Nodes[NodeIdx]; \
+		while(Node->Axis >= 0) { \
+			float d = KDTREE_COORD(x, Node->Axis) - Node->Split; \
+			float Bound = L2 ? (d*d) : fabsf(d); \
+			int Near = (d < 0.0f) ? Node->Lo : Node->Hi; \
+			int Far  = (d < 0.0f) ? Node->Hi : Node->Lo; \
+			KdTree_Search##Name(Tree, Near, x, BestIdx, BestDist); \
+			if(Bound > *BestDist) return; \
+			Node = &Tree->Nodes[Far]; \
+		} \
+		int n; \
+		for(n=Node->Lo; n<Node->Hi; n++) { \
+			float Dist = KdTree_Distance(x, &Tree->Points[n], L2); \
+			int   Idx  = Tree->Index[n]; \
+			if(Dist < *BestDist || (Dist == *BestDist && Idx < *BestIdx)) *BestIdx = Idx, *BestDist = Dist; \
+		} \
+		Tree->nDistEvals += Node->Hi - Node->Lo; \
+	}
+KDTREE_DEFINE_SEARCH(L1, 0)
+KDTREE_DEFINE_SEARCH(L2, 1)
+
+/**************************************/
+
+//! Find nearest point
+static inline int KdTree_Nearest(struct KdTree_t *Tree, const struct BGRAf_t *x, int Guess, float *Dist, int L2)
+{
+    int   BestIdx  = -1;
+    float BestDist = INFINITY;
+    if(Guess >= 0 && Guess < Tree->nPoints)
+    {
+        //! Start from the guess, so that the search can prune from the outset
+        //! NOTE: The guess does not need to be found again by the search,
+        //! as it only replaces it with a nearer (or tied, lower-index) point
+        BestDist = KdTree_Distance(x, &Tree->Points[Tree->Position[Guess]], L2);
+        if(BestDist < INFINITY) BestIdx = Guess;
+        Tree->nDistEvals++;
+    }
+    if(Tree->nPoints)
+    {
+        if(L2) KdTree_SearchL2(Tree, 0, x, &BestIdx, &BestDist);
+        else   KdTree_SearchL1(Tree, 0, x, &BestIdx, &BestDist);
+    }
+    *Dist = BestDist;
+    return BestIdx;
+}
+
+int KdTree_NearestL1(struct KdTree_t *Tree, const struct BGRAf_t *x, int Guess, float *Dist)
+{
+    return KdTree_Nearest(Tree, x, Guess, Dist, 0);
+}
+
+int KdTree_NearestL2(struct KdTree_t *Tree, const struct BGRAf_t *x, int Guess, float *Dist)
+{
+    return KdTree_Nearest(Tree, x, Guess, Dist, 1);
+}
+
+/**************************************/
+//! EOF
+/**************************************/
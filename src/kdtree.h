@@ -0,0 +1,62 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stddef.h>
+#include <stdint.h>
+/**************************************/
+#include "colourspace.h"
+/**************************************/
+
+//! Maximum number of points in a tree
+#define KDTREE_MAX_POINTS 256
+
+//! Minimum number of points KdTree_Use() will ever accept
+#define KDTREE_MIN_POINTS 64
+
+//! Maximum number of points in each leaf
+#define KDTREE_LEAF_SIZE 8
+
+/**************************************/
+
+struct KdTreeNode_t
+{
+    int   Axis;   //! Split axis (0..3 = b,g,r,a), or -1 for leaves
+    float Split;  //! Points in Lo have Axis <= Split, and those in Hi have Axis >= Split
+    int   Lo, Hi; //! Child nodes (or for leaves: range of points)
+};
+
+//! k-d tree for nearest-point searches
+//! NOTE: Searches give exactly the same result as a linear search
+//! with the Simd kernels, including resolving ties to the lowest index.
+struct KdTree_t
+{
+    int     nPoints;
+    int     nNodes;
+    int64_t nDistEvals; //! Distance evaluations performed by searches
+    struct BGRAf_t Points[KDTREE_MAX_POINTS]; //! Points, sorted into leaves
+    int            Index [KDTREE_MAX_POINTS]; //! Original index of each point
+    int         Position [KDTREE_MAX_POINTS]; //! Position of each original index in Points[]
+    struct KdTreeNode_t Nodes[4*KDTREE_MAX_POINTS/KDTREE_LEAF_SIZE]; //! <- Leaves hold at least LEAF_SIZE/2 points
+};
+
+/**************************************/
+
+//! Check if searching a tree of nPoints points is faster than a linear
+//! search with the currently-selected Simd kernels
+int KdTree_Use(int nPoints);
+
+//! Build tree from nPoints points spaced Stride bytes apart
+void KdTree_Build(struct KdTree_t *Tree, const struct BGRAf_t *Points, size_t Stride, int nPoints);
+
+//! Find the nearest point to x, by L1 (Simd.NearestL1) or L2 (Simd.NearestL2) distance
+//! Returns the original index of the point (or -1 if no distance is less
+//! than INFINITY), and stores the distance to *Dist.
+//! NOTE: Guess is the index of a point expected to be near x (eg. the result
+//! of a previous search), which speeds up the search; pass -1 for none. The
+//! result does not depend on the guess.
+int KdTree_NearestL1(struct KdTree_t *Tree, const struct BGRAf_t *x, int Guess, float *Dist);
+int KdTree_NearestL2(struct KdTree_t *Tree, const struct BGRAf_t *x, int Guess, float *Dist);
+
+/**************************************/
+//! EOF
+/**************************************/
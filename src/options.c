@@ -0,0 +1,444 @@
+/**************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/**************************************/
+#include "options.h"
+#include "qualetize.h"
+#include "quantize.h"
+/**************************************/
+
+//! strcmp() implementation that ACTUALLY returns the difference between
+//! characters instead of just the signs. Blame the C standard -_-
+static int mystrcmp(const char *s1, const char *s2)
+{
+    while(*s1 && *s1 == *s2) s1++, s2++;
+    return *s1 - *s2;
+}
+
+/**************************************/
+
+//! Options that may be swept, and the prefixes used to name them
+static const char *const SweepOption[OPTIONS_SWEEP_COUNT] = {"-bgra:", "-dither:", "-np:", "-ps:"};
+static const char *const SweepPrefix[OPTIONS_SWEEP_COUNT] = {"bgra",   "",         "np",   "ps"  };
+
+//! Get the number of values in a list
+static int GetListCount(const char *List)
+{
+    int n = 1;
+    while((List = strchr(List, '/')) != NULL) List++, n++;
+    return n;
+}
+
+//! Get value Idx of a list, and its length
+static const char *GetListValue(const char *List, int Idx, int *Len)
+{
+    while(Idx--) List = strchr(List, '/') + 1;
+    const char *End = strchr(List, '/');
+    *Len = End ? (int)(End - List) : (int)strlen(List);
+    return List;
+}
+
+/**************************************/
+
+//! Print the list of options
+void Options_PrintUsage(FILE *File)
+{
+    fprintf(File,
+        "Options:\n"
+        " -np:16            - Set number of palettes available\n"
+        " -ps:16            - Set number of colours per palette\n"
+        " -tw:8             - Set tile width\n"
+        " -th:8             - Set tile height\n"
+        " -bgra:5551        - Set BGRA bit depth\n"
+        " -dither:floyd,1.0 - Set dither mode, level\n"
+        " -tilepasses:0     - Set tile cluster passes (0 = default)\n"
+        " -colourpasses:0   - Set colour cluster passes (0 = default)\n"
+        " -palette:Pal.bmp  - Remap to existing palettes (palettized BMP or raw BGR555)\n"
+        " -stats            - Display timing and counters for each processing stage\n"
+        " -trace:Trace.json - Write stage timings as Chrome trace-event JSON\n"
+        " -simd:auto        - Set instruction set (auto, scalar, sse2, avx2, avx512)\n"
+        " -timebudget:0     - Set time limit in milliseconds (0 = none)\n"
+        " -targetpsnr:0     - Stop refining once each of B,G,R reaches this PSNR in dB (0 = none)\n"
+        " -coarse           - Cluster large palettes from a subsample first (faster)\n"
+        " -minibatch:0      - Refine large palettes from random batches of this many pixels (0 = none)\n"
+        " -init:split       - Set cluster initializer (split, mediancut, kmeans++)\n"
+        " -split:maxdist    - Set cluster split strategy (maxdist, pca)\n"
+        " -tolerance:0      - Stop refining once the error changes by less than this fraction (0 = exact)\n"
+        " -tilerefine:0     - Set tile-to-palette reassignment passes after clustering (0 = none)\n"
+        " -threads:0        - Set threads used to reassign tiles to palettes (0 = one per processor)\n"
+        " -ladder:16        - Sweep over 1, 2, 4, ... palettes up to this many\n"
+        " -cache:Dir        - Re-use results of previous runs stored in this directory\n"
+        "Sweeping options:\n"
+        " Lists of values for -np, -ps, -bgra and -dither (eg. -np:4/8/16) output\n"
+        " every combination, as Output-np4-ps16.bmp etc. The image is only read\n"
+        " once, and tile data and tile clustering are re-used where possible.\n"
+        " With -ladder (or an -np list of powers of two), tiles are clustered\n"
+        " only once, keeping the result at each level of cluster splitting.\n"
+        "Dither modes available (and default level):\n"
+        " -dither:none       - No dithering\n"
+        " -dither:floyd,1.0  - Floyd-Steinberg\n"
+        " -dither:ord2,0.5   - 2x2 ordered dithering\n"
+        " -dither:ord4,0.5   - 4x4 ordered dithering\n"
+        " -dither:ord8,0.5   - 8x8 ordered dithering\n"
+        " -dither:ord16,0.5  - 16x16 ordered dithering\n"
+        " -dither:ord32,0.5  - 32x32 ordered dithering\n"
+        " -dither:ord64,0.5  - 64x64 ordered dithering\n"
+    );
+}
+
+/**************************************/
+
+//! Set default options
+void Options_SetDefaults(struct Options_t *Opt)
+{
+    *Opt = (struct Options_t)
+    {
+        .nPalettes = 16,
+        .nColoursPerPalette = 16,
+        .nUnusedColoursPerPalette = 1,
+        .TileW = 8,
+        .TileH = 8,
+        .BitRange = {.b = 0x1F, .g = 0x1F, .r = 0x1F, .a = 0x01},
+        .DitherMode  = DITHER_FLOYDSTEINBERG,
+        .DitherLevel = 1.0f,
+        .Init  = QUANTINIT_SPLIT,
+        .Split = QUANTSPLIT_MAXDIST,
+    };
+}
+
+/**************************************/
+
+//! Parse options
+int Options_Parse(struct Options_t *Opt, int argc, const char *const *argv)
+{
+    int argi, nUnknown = 0;
+    for(argi=0; argi<argc; argi++)
+    {
+        int ArgOk = 0;
+
+        //! List of values to sweep over?
+        //! NOTE: The first value is parsed now, and the others
+        //! are selected with Options_SetSweep().
+        int k;
+        for(k=0; k<OPTIONS_SWEEP_COUNT; k++)
+        {
+            size_t PrefixLen = strlen(SweepOption[k]);
+            if(!strncmp(argv[argi], SweepOption[k], PrefixLen) && strchr(argv[argi], '/')) break;
+        }
+        if(k < OPTIONS_SWEEP_COUNT)
+        {
+            int  Len;
+            char Arg[64];
+            const char *ArgPtr = Arg;
+            const char *Value  = GetListValue(argv[argi] + strlen(SweepOption[k]), 0, &Len);
+            Opt->Sweep[k] = argv[argi] + strlen(SweepOption[k]);
+            snprintf(Arg, sizeof(Arg), "%s%.*s", SweepOption[k], Len, Value);
+            nUnknown += Options_Parse(Opt, 1, &ArgPtr);
+            continue;
+        }
+
+        //! NOTE: Options may come from untrusted clients (see serve.c),
+        //! so nothing may be read past the end of an argument.
+        const char *ArgStr;
+#define ARGMATCH(Input, Target) \
+	ArgStr = Input + strlen(Target); \
+	if(!strncmp(Input, Target, strlen(Target)))
+        //! nPalettes
+        ARGMATCH(argv[argi], "-np:") ArgOk = 1, Opt->nPalettes = atoi(ArgStr);
+
+        //! nColoursPerPalette
+        ARGMATCH(argv[argi], "-ps:") ArgOk = 1, Opt->nColoursPerPalette = atoi(ArgStr);
+
+        //! nUnusedColoursPerPalette
+
+        //! TileW
+        ARGMATCH(argv[argi], "-tw:") ArgOk = 1, Opt->TileW = atoi(ArgStr);
+
+        //! TileH
+        ARGMATCH(argv[argi], "-th:") ArgOk = 1, Opt->TileH = atoi(ArgStr);
+
+        //! BitRange
+        //! NOTE: Each channel must have 1..8 bits
+        ARGMATCH(argv[argi], "-bgra:")
+        {
+            for(k=0; k<4; k++) if(ArgStr[k] < '1' || ArgStr[k] > '8') break;
+            if(k == 4 && ArgStr[4] == '\0')
+            {
+                ArgOk = 1;
+                Opt->BitRange.b = (1 << (ArgStr[0] - '0')) - 1;
+                Opt->BitRange.g = (1 << (ArgStr[1] - '0')) - 1;
+                Opt->BitRange.r = (1 << (ArgStr[2] - '0')) - 1;
+                Opt->BitRange.a = (1 << (ArgStr[3] - '0')) - 1;
+            }
+        }
+
+        //! DitherMode,DitherLevel
+        ARGMATCH(argv[argi], "-dither:")
+        {
+            int d;
+#define DITHERMODE_MATCH(Input, Target, ModeValue, DefaultLevel) \
+	d = mystrcmp(Input, Target); \
+	if(!d || d == ',') { \
+		ArgOk = 1; \
+		Opt->DitherMode  = ModeValue; \
+		Opt->DitherLevel = !d ? DefaultLevel : atof(strchr(Input, ',')+1); \
+	}
+            DITHERMODE_MATCH(ArgStr, "none",  DITHER_NONE,           0.0f);
+            DITHERMODE_MATCH(ArgStr, "floyd", DITHER_FLOYDSTEINBERG, 1.0f);
+            DITHERMODE_MATCH(ArgStr, "ord2",  DITHER_ORDERED(1),     0.5f);
+            DITHERMODE_MATCH(ArgStr, "ord4",  DITHER_ORDERED(2),     0.5f);
+            DITHERMODE_MATCH(ArgStr, "ord8",  DITHER_ORDERED(3),     0.5f);
+            DITHERMODE_MATCH(ArgStr, "ord16", DITHER_ORDERED(4),     0.5f);
+            DITHERMODE_MATCH(ArgStr, "ord32", DITHER_ORDERED(5),     0.5f);
+            DITHERMODE_MATCH(ArgStr, "ord64", DITHER_ORDERED(6),     0.5f);
+#undef DITHERMODE_MATCH
+            if(!ArgOk) printf("Unrecognized dither mode: %s\n", ArgStr);
+            ArgOk = 1;
+        }
+
+        //! nTileClusterPasses
+        ARGMATCH(argv[argi], "-tilepasses:")
+        {
+            ArgOk = 1;
+            Opt->nTileClusterPasses = atoi(ArgStr);
+        }
+
+        //! nColourClusterPasses
+        ARGMATCH(argv[argi], "-colourpasses:")
+        {
+            ArgOk = 1;
+            Opt->nColourClusterPasses = atoi(ArgStr);
+        }
+
+        //! PaletteFile
+        ARGMATCH(argv[argi], "-palette:")
+        {
+            ArgOk = 1;
+            Opt->PaletteFile = ArgStr;
+        }
+
+        //! ShowStats
+        ARGMATCH(argv[argi], "-stats")
+        {
+            ArgOk = 1;
+            Opt->ShowStats = 1;
+        }
+
+        //! TraceFile
+        ARGMATCH(argv[argi], "-trace:")
+        {
+            ArgOk = 1;
+            Opt->TraceFile = ArgStr;
+        }
+
+        //! TimeBudget
+        ARGMATCH(argv[argi], "-timebudget:")
+        {
+            ArgOk = 1;
+            Opt->TimeBudget = atoi(ArgStr);
+        }
+
+        //! TargetPSNR
+        ARGMATCH(argv[argi], "-targetpsnr:")
+        {
+            ArgOk = 1;
+            Opt->TargetPSNR = atof(ArgStr);
+        }
+
+        //! CoarseToFine
+        ARGMATCH(argv[argi], "-coarse")
+        {
+            ArgOk = 1;
+            Opt->CoarseToFine = 1;
+        }
+
+        //! MiniBatch
+        ARGMATCH(argv[argi], "-minibatch:")
+        {
+            ArgOk = 1;
+            Opt->MiniBatch = atoi(ArgStr);
+        }
+
+        //! Init
+        ARGMATCH(argv[argi], "-init:")
+        {
+            ArgOk = 1;
+            if     (!strcmp(ArgStr, "split"))     Opt->Init = QUANTINIT_SPLIT;
+            else if(!strcmp(ArgStr, "mediancut")) Opt->Init = QUANTINIT_MEDIANCUT;
+            else if(!strcmp(ArgStr, "kmeans++"))  Opt->Init = QUANTINIT_KMEANSPP;
+            else printf("Unrecognized initializer: %s\n", ArgStr);
+        }
+
+        //! Split
+        ARGMATCH(argv[argi], "-split:")
+        {
+            ArgOk = 1;
+            if     (!strcmp(ArgStr, "maxdist")) Opt->Split = QUANTSPLIT_MAXDIST;
+            else if(!strcmp(ArgStr, "pca"))     Opt->Split = QUANTSPLIT_PRINCIPALAXIS;
+            else printf("Unrecognized split strategy: %s\n", ArgStr);
+        }
+
+        //! Tolerance
+        ARGMATCH(argv[argi], "-tolerance:")
+        {
+            ArgOk = 1;
+            Opt->Tolerance = atof(ArgStr);
+        }
+
+        //! Tile refinement passes
+        ARGMATCH(argv[argi], "-tilerefine:")
+        {
+            ArgOk = 1;
+            Opt->TileRefine = atoi(ArgStr);
+        }
+
+        //! Threads
+        ARGMATCH(argv[argi], "-threads:")
+        {
+            ArgOk = 1;
+            Opt->nThreads = atoi(ArgStr);
+        }
+
+        //! Palette-count ladder
+        //! NOTE: This replaces any list of -np values
+        ARGMATCH(argv[argi], "-ladder:")
+        {
+            ArgOk = 1;
+            Opt->Ladder = Opt->nPalettes = atoi(ArgStr);
+        }
+
+        //! Result cache
+        ARGMATCH(argv[argi], "-cache:")
+        {
+            ArgOk = 1;
+            Opt->CacheDir = ArgStr;
+        }
+
+        //! SIMD level
+        //! NOTE: Applied by the caller, as this is global state
+        ARGMATCH(argv[argi], "-simd:")
+        {
+            ArgOk = 1;
+            Opt->SimdName = ArgStr;
+        }
+#undef ARGMATCH
+        //! Unrecognized?
+        if(!ArgOk)
+        {
+            printf("Unrecognized argument: %s\n", argv[argi]);
+            nUnknown++;
+        }
+    }
+    return nUnknown;
+}
+
+/**************************************/
+
+//! Get the number of levels of the palette-count ladder
+static int GetLadderCount(int Ladder)
+{
+    int n = 0;
+    while((1 << n) < Ladder) n++;
+    return n+1;
+}
+
+//! Get the number of values of a swept option (1 = Not swept)
+static int GetSweepValueCount(const struct Options_t *Opt, int k)
+{
+    if(k == OPTIONS_SWEEP_PALETTES && Opt->Ladder > 0) return GetLadderCount(Opt->Ladder);
+    return Opt->Sweep[k] ? GetListCount(Opt->Sweep[k]) : 1;
+}
+
+/**************************************/
+
+//! Get the number of combinations of swept values
+int Options_GetSweepCount(const struct Options_t *Opt)
+{
+    int k, n = 1;
+    for(k=0; k<OPTIONS_SWEEP_COUNT; k++) n *= GetSweepValueCount(Opt, k);
+    return n;
+}
+
+//! Get the largest number of palettes of any combination
+int Options_GetMaxPalettes(const struct Options_t *Opt)
+{
+    int i, Len, Max;
+    const char *List = Opt->Sweep[OPTIONS_SWEEP_PALETTES];
+    if(Opt->Ladder > 0) return Opt->Ladder;
+    if(!List) return Opt->nPalettes;
+    for(Max=i=0; i<GetListCount(List); i++)
+    {
+        int n = atoi(GetListValue(List, i, &Len));
+        if(n > Max) Max = n;
+    }
+    return Max;
+}
+
+//! Select combination of swept values
+void Options_SetSweep(struct Options_t *Opt, int Idx, char *Name, int NameSize)
+{
+    int k;
+    int ValueIdx[OPTIONS_SWEEP_COUNT];
+    for(k=OPTIONS_SWEEP_COUNT-1; k>=0; k--)
+    {
+        int n = GetSweepValueCount(Opt, k);
+        ValueIdx[k] = Idx % n;
+        Idx /= n;
+    }
+
+    //! Parse the selected values, and build the name
+    int NameLen = 0;
+    *Name = '\0';
+    for(k=0; k<OPTIONS_SWEEP_COUNT; k++)
+    {
+        int  Len;
+        char Arg[64];
+        const char *ArgPtr = Arg;
+        const char *Value  = Arg;
+        if(k == OPTIONS_SWEEP_PALETTES && Opt->Ladder > 0)
+        {
+            //! Ladder levels are 1, 2, 4, ..., and then the top
+            int nPals = 1 << ValueIdx[k];
+            if(nPals > Opt->Ladder) nPals = Opt->Ladder;
+            Opt->nPalettes = nPals;
+            Len = snprintf(Arg, sizeof(Arg), "%d", nPals);
+        }
+        else if(Opt->Sweep[k])
+        {
+            Value = GetListValue(Opt->Sweep[k], ValueIdx[k], &Len);
+            snprintf(Arg, sizeof(Arg), "%s%.*s", SweepOption[k], Len, Value);
+            Options_Parse(Opt, 1, &ArgPtr);
+        }
+        else continue;
+        if(NameLen < NameSize)
+        {
+            NameLen += snprintf(Name + NameLen, NameSize - NameLen, "-%s%.*s", SweepPrefix[k], Len, Value);
+        }
+    }
+
+    //! Dither levels are separated by commas, which are awkward in filenames
+    for(k=0; Name[k]; k++) if(Name[k] == ',') Name[k] = '_';
+}
+
+/**************************************/
+
+//! Get the quantization control for the options
+struct QuantCtrl_t Options_GetCtrl(const struct Options_t *Opt)
+{
+    return (struct QuantCtrl_t)
+    {
+        .TargetPSNR       = Opt->TargetPSNR,
+        .CoarseToFine     = Opt->CoarseToFine,
+        .MiniBatch        = Opt->MiniBatch,
+        .Init             = Opt->Init,
+        .Split            = Opt->Split,
+        .Tolerance        = Opt->Tolerance,
+        .TileRefinePasses = Opt->TileRefine,
+        .nThreads         = Opt->nThreads,
+    };
+}
+
+/**************************************/
+//! EOF
+/**************************************/
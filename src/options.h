@@ -0,0 +1,82 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stdio.h>
+/**************************************/
+#include "colourspace.h"
+#include "quantize.h"
+/**************************************/
+
+//! Options that may be given as lists of values to sweep over
+//! (eg. -np:4/8/16), in order from slowest- to fastest-varying
+#define OPTIONS_SWEEP_BITRANGE  0
+#define OPTIONS_SWEEP_DITHER    1
+#define OPTIONS_SWEEP_PALETTES  2
+#define OPTIONS_SWEEP_COLOURS   3
+#define OPTIONS_SWEEP_COUNT     4
+
+/**************************************/
+
+//! Command-line options
+struct Options_t
+{
+    int     nPalettes;
+    int     nColoursPerPalette;
+    int     nUnusedColoursPerPalette;
+    int     nTileClusterPasses;
+    int     nColourClusterPasses;
+    int     TileW;
+    int     TileH;
+    struct BGRA8_t BitRange;
+    int     DitherMode;
+    float   DitherLevel;
+    const char *PaletteFile; //! Palettes to remap to (NULL = None)
+    int     ShowStats;
+    const char *TraceFile;   //! Trace-event JSON output (NULL = None)
+    const char *SimdName;    //! Instruction set (NULL = Not set)
+    int     TimeBudget;      //! Milliseconds (0 = Unlimited)
+    float   TargetPSNR;
+    int     CoarseToFine;
+    int     MiniBatch;
+    int     Init;
+    int     Split;
+    float   Tolerance;
+    int     TileRefine;
+    int     nThreads;        //! Threads for tile refinement (0 = One per processor)
+    const char *Sweep[OPTIONS_SWEEP_COUNT]; //! Lists of values to sweep over (NULL = Not swept)
+    int     Ladder;          //! Sweep over 1, 2, 4, ..., Ladder palettes (0 = None)
+    const char *CacheDir;    //! Result cache directory (NULL = None)
+};
+
+/**************************************/
+
+//! Print the list of options
+void Options_PrintUsage(FILE *File);
+
+//! Set default options
+void Options_SetDefaults(struct Options_t *Opt);
+
+//! Parse options from argv[0..argc-1]
+//! Problems are reported to stdout, and unrecognized options are skipped.
+//! Returns the number of options that were not recognized.
+//! NOTE: String options point into argv[], which must outlive Opt.
+int Options_Parse(struct Options_t *Opt, int argc, const char *const *argv);
+
+//! Get the number of combinations of swept values (1 = No sweep)
+int Options_GetSweepCount(const struct Options_t *Opt);
+
+//! Get the largest number of palettes of any combination
+int Options_GetMaxPalettes(const struct Options_t *Opt);
+
+//! Select combination Idx (0..Options_GetSweepCount()-1) of swept values
+//! The name of the combination (eg. "-np8-ps16") is stored to Name,
+//! which must hold NameSize bytes.
+void Options_SetSweep(struct Options_t *Opt, int Idx, char *Name, int NameSize);
+
+//! Get the quantization control for the options
+//! NOTE: Stats, progress and the time budget are left to the caller.
+struct QuantCtrl_t Options_GetCtrl(const struct Options_t *Opt);
+
+/**************************************/
+//! EOF
+/**************************************/
@@ -1,55 +1,46 @@
 /**************************************/
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 /**************************************/
 #include "bitmap.h"
 #include "colourspace.h"
 #include "dither.h"
 #include "qualetize.h"
+#include "quantize.h"
 #include "tiles.h"
 /**************************************/
 
-//! Handle conversion of image with given palette, return RMS error
-//! NOTE: Lots of pointer aliasing to avoid even more memory consumption
-struct BGRAf_t Qualetize(
+//! Perform final dithering
+//! NOTE: Palette must already be in BGRA mode with reduced range
+static struct BGRAf_t Qualetize_Dither(
     struct BmpCtx_t *Image,
     struct TilesData_t *TilesData,
     uint8_t *PxData,
-    struct BGRAf_t *Palette,
+    const struct BGRAf_t *Palette,
     int   MaxTilePals,
     int   MaxPalSize,
     int   PalUnused,
-    int   nTileClusterPasses,
-    int   nColourClusterPasses,
     const struct BGRA8_t *BitRange,
     int   DitherType,
     float DitherLevel,
-    int   ReplaceImage
+    struct QuantCtrl_t *Ctrl
 )
 {
-    int i;
-
-    //! Do palette allocation and colour clustering
-    TilesData_QuantizePalettes(
-        TilesData,
-        Palette,
-        MaxTilePals,
-        MaxPalSize,
-        PalUnused,
-        nTileClusterPasses,
-        nColourClusterPasses
-    );
-
-    //! Convert palette to BGRA and reduce range
-    for(i=0; i<MaxTilePals*MaxPalSize; i++)
+    //! Check for cancellation before starting
+    if(Ctrl) Ctrl->State.Pass = 0;
+    QuantCtrl_BeginStage(Ctrl, QUANTSTAGE_DITHER);
+    if(QuantCtrl_Update(Ctrl))
     {
-        struct BGRAf_t p = BGRAf_FromYUV(&Palette[i]);
-        struct BGRA8_t p2 = BGRA_FromBGRAf(&p, BitRange);
-        Palette[i] = BGRAf_FromBGRA(&p2, BitRange);
+        QuantCtrl_EndStage(Ctrl);
+        return (struct BGRAf_t){INFINITY,INFINITY,INFINITY,INFINITY};
     }
 
     //! Do final dithering+palette processing
     struct BGRAf_t RMSE = DitherImage(
                               Image,
+                              0,
+                              0,
                               BitRange,
                               NULL,
                               TilesData->TileW,
@@ -64,6 +55,19 @@ struct BGRAf_t Qualetize(
                               DitherLevel,
                               TilesData->PxTemp
                           );
+    QuantCtrl_EndStage(Ctrl);
+    return RMSE;
+}
+
+//! Store the final palette and image
+static void Qualetize_Store(
+    struct BmpCtx_t *Image,
+    uint8_t *PxData,
+    struct BGRAf_t *Palette,
+    int   ReplaceImage
+)
+{
+    int i;
 
     //! Store the final palette
     //! NOTE: This aliases over the original palette, but is
@@ -83,14 +87,314 @@ struct BGRAf_t Qualetize(
             free(Image->PxIdx);
         }
         else free(Image->PxBGR);
+        Image->Stride = 0;
+        Image->Layout = 0;
         Image->ColPal = PalBGR;
         Image->PxIdx  = PxData;
     }
+}
 
-    //! Return error
+/**************************************/
+
+//! Get the mean clustering error that should give the target PSNR
+//! The clustering error is the L1 distance in YUVA (see quantize.c),
+//! and measurements show that the RMS error of the worst of B,G,R
+//! after remapping is close to the mean clustering error. Rounding the
+//! palette to BitRange adds its own error on top of that, and dithering
+//! adds roughly another 1dB, so both are taken out of the target first.
+//! Returns 0 if the target cannot be reached at this bit depth.
+static float Qualetize_GetTargetError(float TargetPSNR, const struct BGRA8_t *BitRange, int DitherType)
+{
+    int Range = BitRange->b;
+    if(BitRange->g < Range) Range = BitRange->g;
+    if(BitRange->r < Range) Range = BitRange->r;
+    float TargetMSE = powf(10.0f, -0.1f*TargetPSNR);
+    float RoundMSE  = 1.0f / (12.0f * Range*Range);
+    if(TargetMSE <= RoundMSE) return 0.0f;
+    float TargetError = sqrtf(TargetMSE - RoundMSE);
+    if(DitherType != DITHER_NONE) TargetError *= 0.89f; //! <- -1dB
+    return TargetError;
+}
+
+//! Check whether the RMS error of each of B,G,R meets the target PSNR
+int Qualetize_MeetsTargetPSNR(const struct BGRAf_t *RMSE, float TargetPSNR)
+{
+    float TargetRMSE = powf(10.0f, -0.05f*TargetPSNR);
+    return RMSE->b <= TargetRMSE && RMSE->g <= TargetRMSE && RMSE->r <= TargetRMSE;
+}
+
+/**************************************/
+
+//! Handle conversion of image with given palette, return RMS error
+//! NOTE: Lots of pointer aliasing to avoid even more memory consumption
+struct BGRAf_t Qualetize(
+    struct BmpCtx_t *Image,
+    struct TilesData_t *TilesData,
+    uint8_t *PxData,
+    struct BGRAf_t *Palette,
+    int   MaxTilePals,
+    int   MaxPalSize,
+    int   PalUnused,
+    int   nTileClusterPasses,
+    int   nColourClusterPasses,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel,
+    int   ReplaceImage,
+    struct QuantCtrl_t *Ctrl
+)
+{
+    int i;
+    struct BGRAf_t RMSE;
+    struct BGRAf_t *PaletteYUV = NULL;
+
+    //! Get the error to stop refining at
+    if(Ctrl)
+    {
+        Ctrl->TargetError   = (Ctrl->TargetPSNR > 0.0f) ? Qualetize_GetTargetError(Ctrl->TargetPSNR, BitRange, DitherType) : 0.0f;
+        Ctrl->TargetReached = 0;
+    }
+
+    //! Do palette allocation and colour clustering
+    int Ok = TilesData_QuantizePalettes(
+        TilesData,
+        Palette,
+        MaxTilePals,
+        MaxPalSize,
+        PalUnused,
+        nTileClusterPasses,
+        nColourClusterPasses,
+        Ctrl
+    );
+    for(;;)
+    {
+        if(!Ok && Ctrl && Ctrl->Cancelled)
+        {
+            free(PaletteYUV);
+            return (struct BGRAf_t){INFINITY,INFINITY,INFINITY,INFINITY};
+        }
+
+        //! If refinement stopped at the estimated target, keep the
+        //! palette in YUVA mode in case it needs refining further
+        //! NOTE: Without the memory for this, the result is kept as is.
+        int nPalColours = MaxTilePals*MaxPalSize;
+        if(!PaletteYUV && Ctrl && Ctrl->TargetReached && Ctrl->TimeBudget <= 0.0)
+        {
+            PaletteYUV = malloc(nPalColours * sizeof(struct BGRAf_t));
+            if(PaletteYUV) memcpy(PaletteYUV, Palette, nPalColours * sizeof(struct BGRAf_t));
+        }
+
+        //! Convert palette to BGRA and reduce range
+        for(i=0; i<nPalColours; i++)
+        {
+            struct BGRAf_t p = BGRAf_FromYUV(&Palette[i]);
+            struct BGRA8_t p2 = BGRA_FromBGRAf(&p, BitRange);
+            Palette[i] = BGRAf_FromBGRA(&p2, BitRange);
+        }
+
+        //! Do final dithering
+        RMSE = Qualetize_Dither(
+            Image,
+            TilesData,
+            PxData,
+            Palette,
+            MaxTilePals,
+            MaxPalSize,
+            PalUnused,
+            BitRange,
+            DitherType,
+            DitherLevel,
+            Ctrl
+        );
+        if(Ctrl && Ctrl->Cancelled)
+        {
+            free(PaletteYUV);
+            return RMSE;
+        }
+
+        //! If the result falls short of the target, the estimate was
+        //! too optimistic, so continue refining the palettes that
+        //! stopped at it from where they stopped (this runs at most
+        //! once, as the target error is then cleared)
+        if(!PaletteYUV || Qualetize_MeetsTargetPSNR(&RMSE, Ctrl->TargetPSNR)) break;
+        memcpy(Palette, PaletteYUV, nPalColours * sizeof(struct BGRAf_t));
+        free(PaletteYUV), PaletteYUV = NULL;
+        Ctrl->TargetError   = 0.0f;
+        Ctrl->TargetReached = 0;
+        Ok = TilesData_RefinePalettes(
+            TilesData,
+            Palette,
+            MaxTilePals,
+            MaxPalSize,
+            PalUnused,
+            nColourClusterPasses,
+            Ctrl
+        );
+    }
+    free(PaletteYUV);
+
+    //! Store results
+    Qualetize_Store(Image, PxData, Palette, ReplaceImage);
+    return RMSE;
+}
+
+/**************************************/
+
+//! Handle conversion of image to existing palettes, return RMS error
+struct BGRAf_t QualetizeWithPalette(
+    struct BmpCtx_t *Image,
+    struct TilesData_t *TilesData,
+    uint8_t *PxData,
+    struct BGRAf_t *Palette,
+    const struct BGRA8_t *SrcPalette,
+    int   MaxTilePals,
+    int   MaxPalSize,
+    int   PalUnused,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel,
+    int   ReplaceImage,
+    struct QuantCtrl_t *Ctrl
+)
+{
+    int i;
+
+    //! Reduce range of the source palette, and get a YUVA copy
+    //! of it to compare tiles against
+    //! NOTE: TilesData->PxTemp is free until DitherImage(), but
+    //! may be smaller than the palette, so use the stack here.
+    struct BGRAf_t PalYUV[BMP_PALETTE_COLOURS];
+    for(i=0; i<MaxTilePals*MaxPalSize; i++)
+    {
+        struct BGRAf_t p = BGRAf_FromBGRA8(&SrcPalette[i]);
+        struct BGRA8_t p2 = BGRA_FromBGRAf(&p, BitRange);
+        Palette[i] = BGRAf_FromBGRA(&p2, BitRange);
+        PalYUV [i] = BGRAf_AsYUV(&Palette[i]);
+    }
+
+    //! Assign tiles to their best-matching palettes
+    QuantCtrl_BeginStage(Ctrl, QUANTSTAGE_TILES);
+    TilesData_AssignPalettes(
+        TilesData,
+        PalYUV,
+        MaxTilePals,
+        MaxPalSize,
+        PalUnused,
+        Ctrl
+    );
+    QuantCtrl_EndStage(Ctrl);
+
+    //! Do final dithering and store results
+    struct BGRAf_t RMSE = Qualetize_Dither(
+        Image,
+        TilesData,
+        PxData,
+        Palette,
+        MaxTilePals,
+        MaxPalSize,
+        PalUnused,
+        BitRange,
+        DitherType,
+        DitherLevel,
+        Ctrl
+    );
+    if(Ctrl && Ctrl->Cancelled) return RMSE;
+    Qualetize_Store(Image, PxData, Palette, ReplaceImage);
     return RMSE;
 }
 
+/**************************************/
+
+//! Update the conversion of an image after some of its tiles changed
+int QualetizeUpdate(
+    const struct BmpCtx_t *Image,
+    struct TilesData_t *TilesData,
+    uint8_t *PxData,
+    int   PxStride,
+    struct BGRAf_t *Palette,
+    int   MaxTilePals,
+    int   MaxPalSize,
+    int   PalUnused,
+    int   nColourClusterPasses,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel,
+    const uint8_t *TileDirty,
+    struct QuantCtrl_t *Ctrl
+)
+{
+    int i, y;
+    int TileW  = TilesData->TileW;
+    int TileH  = TilesData->TileH;
+    int nTiles = TilesData->TilesX * TilesData->TilesY;
+
+    //! Update palettes in YUVA mode
+    //! NOTE: TilesData->PxTemp may be smaller than the palette (as in
+    //! QualetizeWithPalette()), so use the stack here.
+    struct BGRAf_t PalYUV[BMP_PALETTE_COLOURS];
+    uint8_t PalDirty[TILESDATA_MAX_CLUSTERS];
+    for(i=0; i<MaxTilePals*MaxPalSize; i++) PalYUV[i] = BGRAf_AsYUV(&Palette[i]);
+    if(!TilesData_UpdatePalettes(
+        TilesData,
+        PalYUV,
+        MaxTilePals,
+        MaxPalSize,
+        PalUnused,
+        nColourClusterPasses,
+        TileDirty,
+        PalDirty,
+        Ctrl
+    )) return 0;
+
+    //! Convert the palettes that changed back to BGRA and reduce range
+    for(i=0; i<MaxTilePals*MaxPalSize; i++) if(PalDirty[i / MaxPalSize])
+        {
+            struct BGRAf_t p = BGRAf_FromYUV(&PalYUV[i]);
+            struct BGRA8_t p2 = BGRA_FromBGRAf(&p, BitRange);
+            Palette[i] = BGRAf_FromBGRA(&p2, BitRange);
+        }
+
+    //! Dither the tiles that changed, or whose palette changed
+    if(Ctrl) Ctrl->State.Pass = 0;
+    QuantCtrl_BeginStage(Ctrl, QUANTSTAGE_DITHER);
+    if(QuantCtrl_Update(Ctrl))
+    {
+        QuantCtrl_EndStage(Ctrl);
+        return 0;
+    }
+    uint8_t *TilePx = (uint8_t*)TilesData->PxTempIdx;
+    for(i=0; i<nTiles; i++) if(TileDirty[i] || PalDirty[TilesData->TilePalIdx[i]])
+        {
+            int x0 = (i % TilesData->TilesX) * TileW;
+            int y0 = (i / TilesData->TilesX) * TileH;
+            struct BmpCtx_t Rect = BmpCtx_GetRect(Image, x0, y0, TileW, TileH);
+            (void)DitherImage(
+                &Rect,
+                x0,
+                y0,
+                BitRange,
+                NULL,
+                TileW,
+                TileH,
+                MaxTilePals,
+                MaxPalSize,
+                PalUnused,
+                &TilesData->TilePalIdx[i],
+                Palette,
+                TilePx,
+                DitherType,
+                DitherLevel,
+                TilesData->PxTemp
+            );
+            for(y=0; y<TileH; y++)
+            {
+                memcpy(PxData + (intptr_t)(y0+y)*PxStride + x0, TilePx + y*TileW, TileW);
+            }
+        }
+    QuantCtrl_EndStage(Ctrl);
+    return 1;
+}
+
 /**************************************/
 //! EOF
 /**************************************/
@@ -3,6 +3,7 @@
 /**************************************/
 #include "bitmap.h"
 #include "colourspace.h"
+#include "quantize.h"
 #include "tiles.h"
 /**************************************/
 
@@ -21,6 +22,15 @@
 //! NOTE:
 //!  * With ReplaceImage != 0, {Image->ColMap,Image->PxIdx} (or
 //!    Image->PxBGR) will be free()'d and replaced with {PxData,Palette}.
+//!  * Ctrl may be NULL. If processing is cancelled, Ctrl->Cancelled is
+//!    set, nothing is output, the image is never replaced, and the
+//!    returned error is INFINITY.
+//!  * With Ctrl->TargetPSNR set, colour clustering stops refining once
+//!    its error estimate meets the target. If the dithered result then
+//!    misses the target, the palettes that stopped early are refined
+//!    further from where they stopped, and the image is dithered again
+//!    (except under a time budget). Ctrl->TargetReached is left set if
+//!    refinement stopped early in the final result.
 struct BGRAf_t Qualetize(
     struct BmpCtx_t *Image,
     struct TilesData_t *TilesData,
@@ -34,9 +44,69 @@ struct BGRAf_t Qualetize(
     const struct BGRA8_t *BitRange,
     int   DitherType,
     float DitherLevel,
-    int   ReplaceImage
+    int   ReplaceImage,
+    struct QuantCtrl_t *Ctrl
 );
 
+//! Handle conversion of image to existing palettes, return RMS error
+//! This skips clustering entirely: each tile is assigned to the palette
+//! that remaps it with the least error, and then the image is dithered.
+//! NOTE:
+//!  * SrcPalette[] holds MaxTilePals*MaxPalSize BGRA colours, and is
+//!    reduced to BitRange before use.
+//!  * Palette[], ReplaceImage and Ctrl have the same roles as in Qualetize().
+struct BGRAf_t QualetizeWithPalette(
+    struct BmpCtx_t *Image,
+    struct TilesData_t *TilesData,
+    uint8_t *PxData,
+    struct BGRAf_t *Palette,
+    const struct BGRA8_t *SrcPalette,
+    int   MaxTilePals,
+    int   MaxPalSize,
+    int   PalUnused,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel,
+    int   ReplaceImage,
+    struct QuantCtrl_t *Ctrl
+);
+
+//! Update the conversion of an image after some of its tiles changed
+//! This follows Qualetize() or QualetizeWithPalette() (or a previous
+//! update) on the same TilesData, once the tiles with TileDirty[i] != 0
+//! have been re-converted with TilesData_UpdateTiles(). Tiles are moved
+//! between the existing palettes, and only the palettes that need it are
+//! re-quantized; then only the tiles that changed, or whose palette
+//! changed, are dithered again.
+//! NOTE:
+//!  * PxData[] and Palette[] hold the previous results, and are updated
+//!    in place. Palette[] is in BGRA mode with reduced range (as left by
+//!    Qualetize() before storing). Rows of PxData[] are PxStride bytes
+//!    apart, counted from the bottom (PxStride may be negative).
+//!  * Error diffusion (DITHER_FLOYDSTEINBERG) is applied to each tile on
+//!    its own, so the result may differ slightly from a full conversion.
+//!  * Ctrl may be NULL. Returns 0 on cancellation, leaving the results
+//!    partially updated.
+int QualetizeUpdate(
+    const struct BmpCtx_t *Image,
+    struct TilesData_t *TilesData,
+    uint8_t *PxData,
+    int   PxStride,
+    struct BGRAf_t *Palette,
+    int   MaxTilePals,
+    int   MaxPalSize,
+    int   PalUnused,
+    int   nColourClusterPasses,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel,
+    const uint8_t *TileDirty,
+    struct QuantCtrl_t *Ctrl
+);
+
+//! Check whether the RMS error of each of B,G,R meets the target PSNR (in dB)
+int Qualetize_MeetsTargetPSNR(const struct BGRAf_t *RMSE, float TargetPSNR);
+
 /**************************************/
 //! EOF
 /**************************************/
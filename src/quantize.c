@@ -2,7 +2,36 @@
 #include <math.h>
 /**************************************/
 #include "colourspace.h"
+#include "kdtree.h"
 #include "quantize.h"
+#include "simd.h"
+/**************************************/
+
+//! Coarse-to-fine clustering (see QuantCtrl_t::CoarseToFine)
+//! The subsample holds about QUANT_COARSE_POINTS_PER_CLUSTER points for
+//! each cluster (but no fewer than QUANT_COARSE_MIN_POINTS), and is only
+//! used when the data has at least twice as many points as that.
+#define QUANT_COARSE_POINTS_PER_CLUSTER 64
+#define QUANT_COARSE_MIN_POINTS         4096
+#define QUANT_COARSE_POLISH_PASSES      4
+
+//! Mini-batch refinement (see QuantCtrl_t::MiniBatch)
+//! The seed is fixed so that results are reproducible
+#define QUANT_MINIBATCH_SEED 0x2545F491u
+
+//! Power iterations used to find the principal axis of a cluster
+#define QUANT_PRINCIPALAXIS_ITERATIONS 16
+
+//! Seeding initializers (see QuantCtrl_t::Init)
+//! Median cut splits up to QUANT_MEDIANCUT_BATCH boxes on each pass over
+//! the data, using histograms of QUANT_MEDIANCUT_BINS bins to find medians.
+#define QUANT_MEDIANCUT_BATCH 32
+#define QUANT_MEDIANCUT_BINS  64
+#define QUANT_KMEANSPP_SEED   0x6C078965u
+
+//! Number of incrementally-trained passes between full retraining
+#define QUANT_RETRAIN_INTERVAL 16
+
 /**************************************/
 
 //! Clear training data (NOTE: Do NOT destroy the centroid or linked list position)
@@ -11,12 +40,31 @@ static inline void QuantCluster_ClearTraining(struct QuantCluster_t *x)
     x->nPoints = 0;
     x->MaxDistIdx = -1;
     x->MaxDistVal = 0.0f;
-    x->Train = (struct BGRAf_t)
+    x->Train = x->TrainErr = (struct BGRAf_t)
     {
         0,0,0,0
     };
 }
 
+//! Add a point to the training sum
+//! NOTE: Uses compensated (Kahan) summation, as the sums can cover
+//! millions of points; TrainErr holds the rounding error carried over.
+static inline void QuantCluster_AddTraining(struct QuantCluster_t *Dst, const struct BGRAf_t *Data)
+{
+    struct BGRAf_t y = BGRAf_Sub(Data, &Dst->TrainErr);
+    struct BGRAf_t t = BGRAf_Add(&Dst->Train, &y);
+    struct BGRAf_t e = BGRAf_Sub(&t, &Dst->Train);
+    Dst->TrainErr = BGRAf_Sub(&e, &y);
+    Dst->Train    = t;
+}
+
+//! Remove a point from the training sum
+static inline void QuantCluster_SubTraining(struct QuantCluster_t *Dst, const struct BGRAf_t *Data)
+{
+    struct BGRAf_t Neg = BGRAf_Muli(Data, -1.0f);
+    QuantCluster_AddTraining(Dst, &Neg);
+}
+
 //! Get distortion between two points
 static float CalculateDataDistortion(const struct BGRAf_t *a, const struct BGRAf_t *b)
 {
@@ -30,15 +78,26 @@ static float CalculateDataDistortion(const struct BGRAf_t *a, const struct BGRAf
     return Dist;
 }
 
-//! Add data to training
-static inline void QuantCluster_Train(struct QuantCluster_t *Dst, const struct BGRAf_t *Data, int DataIdx)
+//! Update the distortion measures with data at distance Dist from the centroid
+static inline void QuantCluster_TrainDistortion(struct QuantCluster_t *Dst, int DataIdx, float Dist)
 {
-    float Dist = CalculateDataDistortion(Data, &Dst->Centroid);
     if(Dist > Dst->MaxDistVal) Dst->MaxDistIdx = DataIdx, Dst->MaxDistVal = Dist;
-    Dst->Train = BGRAf_Add(&Dst->Train, Data);
+}
+
+//! Add data at distance Dist from the centroid to training
+static inline void QuantCluster_TrainDist(struct QuantCluster_t *Dst, const struct BGRAf_t *Data, int DataIdx, float Dist)
+{
+    QuantCluster_TrainDistortion(Dst, DataIdx, Dist);
+    QuantCluster_AddTraining(Dst, Data);
     Dst->nPoints++;
 }
 
+//! Add data to training
+static inline void QuantCluster_Train(struct QuantCluster_t *Dst, const struct BGRAf_t *Data, int DataIdx)
+{
+    QuantCluster_TrainDist(Dst, Data, DataIdx, CalculateDataDistortion(Data, &Dst->Centroid));
+}
+
 //! Resolve the centroid from training data
 static inline int QuantCluster_Resolve(struct QuantCluster_t *x)
 {
@@ -46,12 +105,108 @@ static inline int QuantCluster_Resolve(struct QuantCluster_t *x)
     return x->nPoints;
 }
 
+//! Split a quantization cluster along its principal axis, at its mean
+//! The principal axis is found by power iteration on the covariance.
+//! Returns the number of data points that were re-assigned, or 0 if the
+//! cluster has no spread to split along (the cluster is then unchanged).
+//! NOTE: Data[] and DataClusters[] are accessed every Step elements
+static int QuantCluster_SplitPrincipalAxis(struct QuantCluster_t *Clusters, int SrcCluster, int DstCluster, const struct BGRAf_t *Data, int Step, int nData, int32_t *DataClusters)
+{
+    int n, j, k;
+    struct QuantCluster_t *Src = &Clusters[SrcCluster];
+    struct QuantCluster_t *Dst = &Clusters[DstCluster];
+
+    //! Accumulate the covariance, relative to the current centroid
+    //! NOTE: Accumulated in double, as the sums can cover many points
+    int    nPoints = 0;
+    double Sum[4] = {0}, Cov[4][4] = {{0}};
+    for(n=0; n<nData; n++) if(DataClusters[(size_t)n*Step] == SrcCluster)
+        {
+            struct BGRAf_t d = BGRAf_Sub(&Data[(size_t)n*Step], &Src->Centroid);
+            const float *v = (const float*)&d;
+            for(j=0; j<4; j++)
+            {
+                Sum[j] += v[j];
+                for(k=j; k<4; k++) Cov[j][k] += (double)v[j]*v[k];
+            }
+            nPoints++;
+        }
+    if(!nPoints) return 0;
+    for(j=0; j<4; j++) Sum[j] /= nPoints;
+    for(j=0; j<4; j++) for(k=j; k<4; k++)
+        {
+            Cov[j][k] = Cov[k][j] = Cov[j][k]/nPoints - Sum[j]*Sum[k];
+        }
+
+    //! Find the principal axis, starting from the axis of greatest variance
+    double Axis[4] = {0};
+    for(j=1, k=0; j<4; j++) if(Cov[j][j] > Cov[k][k]) k = j;
+    if(Cov[k][k] <= 0.0) return 0;
+    Axis[k] = 1.0;
+    for(n=0; n<QUANT_PRINCIPALAXIS_ITERATIONS; n++)
+    {
+        double Next[4], Len = 0.0;
+        for(j=0; j<4; j++)
+        {
+            Next[j] = Cov[j][0]*Axis[0] + Cov[j][1]*Axis[1] + Cov[j][2]*Axis[2] + Cov[j][3]*Axis[3];
+            Len += Next[j]*Next[j];
+        }
+        if(Len <= 0.0) return 0;
+        Len = 1.0 / sqrt(Len);
+        for(j=0; j<4; j++) Axis[j] = Next[j] * Len;
+    }
+
+    //! Split the points on either side of the mean
+    struct BGRAf_t Mean  = {(float)Sum[0], (float)Sum[1], (float)Sum[2], (float)Sum[3]};
+    struct BGRAf_t Normal = {(float)Axis[0], (float)Axis[1], (float)Axis[2], (float)Axis[3]};
+    Mean = BGRAf_Add(&Mean, &Src->Centroid);
+    QuantCluster_ClearTraining(Src);
+    QuantCluster_ClearTraining(Dst);
+    for(n=0; n<nData; n++)
+    {
+        int32_t *DataCluster = &DataClusters[(size_t)n*Step];
+        if(*DataCluster == SrcCluster)
+        {
+            const struct BGRAf_t *x = &Data[(size_t)n*Step];
+            struct BGRAf_t d = BGRAf_Sub(x, &Mean);
+            struct QuantCluster_t *Half = (BGRAf_Dot(&d, &Normal) > 0.0f) ? Dst : Src;
+            QuantCluster_AddTraining(Half, x);
+            Half->nPoints++;
+            if(Half == Dst) *DataCluster = DstCluster;
+        }
+    }
+    QuantCluster_Resolve(Src);
+    QuantCluster_Resolve(Dst);
+
+    //! Train the distortion measures from the new centroids
+    for(n=0; n<nData; n++)
+    {
+        int32_t DataCluster = DataClusters[(size_t)n*Step];
+        if(DataCluster == SrcCluster || DataCluster == DstCluster)
+        {
+            const struct BGRAf_t *x = &Data[(size_t)n*Step];
+            QuantCluster_TrainDistortion(&Clusters[DataCluster], n, CalculateDataDistortion(x, &Clusters[DataCluster].Centroid));
+        }
+    }
+    return nPoints;
+}
+
 //! Split a quantization cluster
-static inline void QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCluster, int DstCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int Recluster)
+//! Returns the number of data points that were re-assigned
+//! NOTE: Data[] and DataClusters[] are accessed every Step elements
+//! NOTE: PrincipalAxis selects QuantCluster_SplitPrincipalAxis() when
+//! re-assigning data (with fallback to splitting at MaxDistIdx)
+static inline int QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCluster, int DstCluster, const struct BGRAf_t *Data, int Step, int nData, int32_t *DataClusters, int Recluster, int PrincipalAxis)
 {
+    if(Recluster && PrincipalAxis)
+    {
+        int nReassigned = QuantCluster_SplitPrincipalAxis(Clusters, SrcCluster, DstCluster, Data, Step, nData, DataClusters);
+        if(nReassigned) return nReassigned;
+    }
+
     //! Create a new cluster from this "most-distorted" data - this helps
     //! us make it out of a local optimum into a better cluster fit
-    Clusters[DstCluster].Centroid = Data[Clusters[SrcCluster].MaxDistIdx];
+    Clusters[DstCluster].Centroid = Data[(size_t)Clusters[SrcCluster].MaxDistIdx*Step];
 #if 0 //! This hurts more than it helps
     //! ... and remove said cluster from the original centroid so we can
     //! correctly assign the new clusters. This can have some floating-point
@@ -61,92 +216,378 @@ static inline void QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCl
     Clusters[SrcCluster].Centroid = BGRAf_Divi(&Clusters[SrcCluster].Train, Clusters[SrcCluster].nPoints);
 #endif
     //! Re-assign clusters
+    int nReassigned = 0;
     if(Recluster)
     {
         int n;
         QuantCluster_ClearTraining(&Clusters[SrcCluster]);
         QuantCluster_ClearTraining(&Clusters[DstCluster]);
-        for(n=0; n<nData; n++) if(DataClusters[n] == SrcCluster)
+        for(n=0; n<nData; n++) if(DataClusters[(size_t)n*Step] == SrcCluster)
             {
-                float DistSrc = CalculateDataDistortion(&Data[n], &Clusters[SrcCluster].Centroid);
-                float DistDst = CalculateDataDistortion(&Data[n], &Clusters[DstCluster].Centroid);
+                const struct BGRAf_t *x = &Data[(size_t)n*Step];
+                nReassigned++;
+                float DistSrc = CalculateDataDistortion(x, &Clusters[SrcCluster].Centroid);
+                float DistDst = CalculateDataDistortion(x, &Clusters[DstCluster].Centroid);
                 if(DistSrc < DistDst)
                 {
-                    QuantCluster_Train(&Clusters[SrcCluster], &Data[n], n);
+                    QuantCluster_Train(&Clusters[SrcCluster], x, n);
                 }
                 else
                 {
-                    QuantCluster_Train(&Clusters[DstCluster], &Data[n], n);
-                    DataClusters[n] = DstCluster;
+                    QuantCluster_Train(&Clusters[DstCluster], x, n);
+                    DataClusters[(size_t)n*Step] = DstCluster;
                 }
             }
         QuantCluster_Resolve(&Clusters[SrcCluster]);
         QuantCluster_Resolve(&Clusters[DstCluster]);
     }
+    else
+    {
+        //! Without re-assigning, neither cluster knows its most distorted
+        //! point any more, so take both out of the running for splitting
+        //! until they are trained again (otherwise the same point would
+        //! seed every split of the source cluster)
+        Clusters[SrcCluster].MaxDistIdx = -1, Clusters[SrcCluster].MaxDistVal = 0.0f;
+        Clusters[DstCluster].MaxDistIdx = -1, Clusters[DstCluster].MaxDistVal = 0.0f;
+    }
+    return nReassigned;
 }
 
 /**************************************/
 
-//! Place a cluster in a distortion linked list (Head = Most distorted)
-static int QuantCluster_InsertToDistortionList(struct QuantCluster_t *Clusters, int Idx, int Head)
+//! Get a pseudo-random index in [0, n)
+static inline int QuantCluster_RandomIndex(uint32_t *Seed, int n)
 {
-    int Next = Head;
-    int Prev = -1;
-    float Dist = Clusters[Idx].MaxDistVal;
-    if(Dist != 0.0f)
+    //! xorshift32
+    uint32_t x = *Seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x <<  5;
+    *Seed = x;
+    return (int)(((uint64_t)x * (uint32_t)n) >> 32);
+}
+
+//! Perform a mini-batch refinement pass
+//! Each of nBatch randomly-drawn points moves its nearest centroid towards
+//! it by a learning rate of 1/(points seen by the cluster so far). The
+//! distortion measures are trained from the batch only, and DataClusters[]
+//! is not updated. Returns the total error over the batch.
+static double QuantCluster_MiniBatchPass(struct QuantCluster_t *Clusters, int nClusterCur, const struct BGRAf_t *Data, int Step, int nData, int nBatch, uint32_t *Seed)
+{
+    int i;
+    SimdNearest_t Nearest = Simd.NearestL1;
+    double TotalError = 0.0;
+    for(i=0; i<nClusterCur; i++) Clusters[i].MaxDistIdx = -1, Clusters[i].MaxDistVal = 0.0f;
+    for(i=0; i<nBatch; i++)
     {
-        while(Next != -1 && Dist < Clusters[Next].MaxDistVal)
+        int n = QuantCluster_RandomIndex(Seed, nData);
+        const struct BGRAf_t *x = &Data[(size_t)n*Step];
+
+        //! NOTE: NearestL1 matches CalculateDataDistortion()
+        float BestDist;
+        int   BestIdx = Nearest(x, &Clusters[0].Centroid, sizeof(struct QuantCluster_t), nClusterCur, &BestDist);
+        struct QuantCluster_t *Cluster = &Clusters[BestIdx];
+        TotalError += BestDist;
+        if(BestDist > Cluster->MaxDistVal) Cluster->MaxDistIdx = n, Cluster->MaxDistVal = BestDist;
+
+        //! Move centroid towards this point
+        struct BGRAf_t Delta = BGRAf_Sub(x, &Cluster->Centroid);
+        Delta = BGRAf_Muli(&Delta, 1.0f / ++Cluster->nPoints);
+        Cluster->Centroid = BGRAf_Add(&Cluster->Centroid, &Delta);
+    }
+    return TotalError;
+}
+
+/**************************************/
+
+//! Merge two distortion linked lists (Head = Most distorted)
+//! NOTE: On ties, clusters from List a come first
+static int QuantCluster_MergeDistortionLists(struct QuantCluster_t *Clusters, int a, int b)
+{
+    int  Head = -1;
+    int *Tail = &Head;
+    while(a != -1 && b != -1)
+    {
+        if(Clusters[b].MaxDistVal > Clusters[a].MaxDistVal)
+        {
+            *Tail = b, Tail = &Clusters[b].Next, b = Clusters[b].Next;
+        }
+        else
         {
-            Prev = Next;
-            Next = Clusters[Next].Next;
+            *Tail = a, Tail = &Clusters[a].Next, a = Clusters[a].Next;
         }
-        Clusters[Idx].Next = Next;
-        if(Prev != -1) Clusters[Prev].Next = Idx;
-        else Head = Idx;
     }
+    *Tail = (a != -1) ? a : b;
     return Head;
 }
 
+//! Sort a linked list of clusters into a distortion linked list
+//! This is a stable merge sort, so clusters of equal distortion keep their order.
+static int QuantCluster_SortDistortionList(struct QuantCluster_t *Clusters, int Head)
+{
+    if(Head == -1 || Clusters[Head].Next == -1) return Head;
+
+    //! Split the list in half
+    int Slow = Head, Fast = Clusters[Head].Next;
+    while(Fast != -1 && Clusters[Fast].Next != -1)
+    {
+        Slow = Clusters[Slow].Next;
+        Fast = Clusters[Clusters[Fast].Next].Next;
+    }
+    int Second = Clusters[Slow].Next;
+    Clusters[Slow].Next = -1;
+
+    //! Sort and merge the halves
+    int First = QuantCluster_SortDistortionList(Clusters, Head);
+    Second    = QuantCluster_SortDistortionList(Clusters, Second);
+    return QuantCluster_MergeDistortionLists(Clusters, First, Second);
+}
+
+//! Add a cluster to an unsorted distortion list
+//! Clusters of zero distortion are left out, as they can't be split.
+//! NOTE: Clusters must be added in increasing index order, so that once
+//! sorted, the most recently-added cluster wins ties.
+static inline int QuantCluster_AddToDistortionList(struct QuantCluster_t *Clusters, int Idx, int Head)
+{
+    if(Clusters[Idx].MaxDistVal == 0.0f) return Head;
+    Clusters[Idx].Next = Head;
+    return Idx;
+}
+
 /**************************************/
 
-//! Perform total vector quantization
-void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses)
+//! Report progress and check for cancellation
+int QuantCtrl_Update(struct QuantCtrl_t *Ctrl)
 {
-    int i, j;
-    if(!nData) return;
+    if(!Ctrl) return 0;
+    if(!Ctrl->Cancelled)
+    {
+        if(Ctrl->Cancel && atomic_load(Ctrl->Cancel) != Ctrl->CancelTicket) Ctrl->Cancelled = 1;
+        else if(Ctrl->Progress && Ctrl->Progress(Ctrl->ProgressUser, &Ctrl->State)) Ctrl->Cancelled = 1;
+    }
+    return Ctrl->Cancelled;
+}
+
+/**************************************/
+
+//! Set the time budget from a limit in milliseconds
+void QuantCtrl_SetTimeBudget(struct QuantCtrl_t *Ctrl, int Milliseconds, double StartTime)
+{
+    if(Milliseconds <= 0) return;
+    Ctrl->TimeBudget = Milliseconds*0.001 - (QuantStats_GetTime() - StartTime);
+    if(Ctrl->TimeBudget <= 0.0) Ctrl->TimeBudget = 1.0e-9; //! <- Already out of time; skip refinement (0 = Unlimited)
+}
+
+//! Check the refinement deadline
+int QuantCtrl_CheckDeadline(struct QuantCtrl_t *Ctrl)
+{
+    if(!Ctrl || Ctrl->Deadline == 0.0) return 0;
+    if(QuantStats_GetTime() < Ctrl->Deadline) return 0;
+    Ctrl->OutOfTime = 1;
+    return 1;
+}
+
+/**************************************/
+
+//! Begin a processing stage
+void QuantCtrl_BeginStage(struct QuantCtrl_t *Ctrl, int Stage)
+{
+    if(!Ctrl) return;
+    Ctrl->State.Stage = Stage;
+    QuantStats_BeginStage(Ctrl->Stats, Stage);
+}
+
+//! End a processing stage
+void QuantCtrl_EndStage(struct QuantCtrl_t *Ctrl)
+{
+    if(!Ctrl) return;
+    QuantStats_EndStage(Ctrl->Stats, Ctrl->State.Stage);
+}
+
+/**************************************/
+
+//! Add counters to the statistics of the current stage
+static void QuantCluster_AccumulateStats(struct QuantCtrl_t *Ctrl, const struct QuantStageStats_t *Counters)
+{
+    if(!Ctrl || !Ctrl->Stats) return;
+    struct QuantStageStats_t *Dst = &Ctrl->Stats->Stage[Ctrl->State.Stage];
+    Dst->nPasses       += Counters->nPasses;
+    Dst->nSplits       += Counters->nSplits;
+    Dst->nEmptyRepairs += Counters->nEmptyRepairs;
+    Dst->nDistEvals    += Counters->nDistEvals;
+}
 
-    //! Perform first pass from average of data
-    Clusters[0].Centroid = (struct BGRAf_t)
+/**************************************/
+
+//! Give clusters that were never reached a defined centroid
+//! This happens when the data has fewer distinct points than
+//! clusters, or when convergence stops splitting early.
+static void QuantCluster_FillUnused(struct QuantCluster_t *Clusters, int nUsed, int nCluster)
+{
+    int i;
+    for(i=nUsed; i<nCluster; i++)
     {
-        0,0,0,0
-    };
-    for(i=0; i<nData; i++)
+        QuantCluster_ClearTraining(&Clusters[i]);
+        Clusters[i].Centroid = Clusters[0].Centroid;
+    }
+}
+
+/**************************************/
+
+//! Assign every data point to its nearest cluster, and train the clusters
+//! (the centroids are not resolved). Returns the total error.
+//! NOTE: With many clusters, a k-d tree of the centroids is searched instead
+//! of every centroid; this gives identical results (see kdtree.h). If
+//! DataClusters[] already holds valid cluster indices (GuessOk != 0), these
+//! are used as a starting point for the search.
+//! NOTE: If the training data of the clusters already matches DataClusters[]
+//! (Incremental != 0), only points that change cluster update the training
+//! sums; the distortion measures are still rebuilt from every point.
+//! NOTE: The number of points that changed cluster is stored to *nChanged
+//! (all of them, if DataClusters[] did not hold valid indices) unless NULL.
+static double QuantCluster_Assign(struct QuantCluster_t *Clusters, int nClusterCur, const struct BGRAf_t *Data, int Step, int nData, int32_t *DataClusters, int GuessOk, int Incremental, int *nChanged, struct QuantStageStats_t *Counters)
+{
+    int i;
+    int nMoved = GuessOk ? 0 : nData;
+    const struct BGRAf_t *x;
+    const struct BGRAf_t *DataEnd = Data + (size_t)nData*Step;
+    double TotalError = 0.0;
+    struct KdTree_t Tree;
+    int UseTree = KdTree_Use(nClusterCur);
+    if(UseTree)
     {
-        DataClusters[i] = 0;
-        Clusters[0].Centroid = BGRAf_Add(&Clusters[0].Centroid, &Data[i]);
+        KdTree_Build(&Tree, &Clusters[0].Centroid, sizeof(struct QuantCluster_t), nClusterCur);
+        Tree.nDistEvals = 0;
     }
-    Clusters[0].Centroid = BGRAf_Divi(&Clusters[0].Centroid, nData);
+    else Counters->nDistEvals += (int64_t)nData * nClusterCur;
 
-    //! Second pass to properly train the distortion measures
-    QuantCluster_ClearTraining(&Clusters[0]);
-    for(i=0; i<nData; i++) QuantCluster_Train(&Clusters[0], &Data[i], i);
-    if(Clusters[0].MaxDistVal == 0.0f) return; //! Global convergence already reached (ie. single item)
-    Clusters[0].Next = -1;
+    SimdNearest_t Nearest = Simd.NearestL1;
+    if(Incremental) for(i=0; i<nClusterCur; i++) Clusters[i].MaxDistIdx = -1, Clusters[i].MaxDistVal = 0.0f;
+    else            for(i=0; i<nClusterCur; i++) QuantCluster_ClearTraining(&Clusters[i]);
+    for(x=Data, i=0; x<DataEnd; x+=Step, i++)
+    {
+        //! NOTE: NearestL1 matches CalculateDataDistortion(), so
+        //! BestDist is also the distortion for training
+        float BestDist;
+        int   BestIdx;
+        int32_t *DataCluster = &DataClusters[(size_t)i*Step];
+        if(UseTree) BestIdx = KdTree_NearestL1(&Tree, x, GuessOk ? *DataCluster : -1, &BestDist);
+        else BestIdx = Nearest(x, &Clusters[0].Centroid, sizeof(struct QuantCluster_t), nClusterCur, &BestDist);
+        TotalError += BestDist;
+        if(Incremental)
+        {
+            //! Move point between clusters
+            struct QuantCluster_t *Old = &Clusters[*DataCluster];
+            struct QuantCluster_t *New = &Clusters[BestIdx];
+            if(Old != New)
+            {
+                nMoved++;
+                QuantCluster_SubTraining(Old, x), Old->nPoints--;
+                QuantCluster_AddTraining(New, x), New->nPoints++;
+            }
+            QuantCluster_TrainDistortion(New, i, BestDist);
+        }
+        else
+        {
+            QuantCluster_TrainDist(&Clusters[BestIdx], x, i, BestDist);
+            if(GuessOk && *DataCluster != BestIdx) nMoved++;
+        }
+        *DataCluster = BestIdx;
+    }
+    if(UseTree) Counters->nDistEvals += Tree.nDistEvals;
+
+    //! Clear any rounding error left in clusters that were emptied
+    if(Incremental) for(i=0; i<nClusterCur; i++) if(!Clusters[i].nPoints)
+            {
+                QuantCluster_ClearTraining(&Clusters[i]);
+            }
+    if(nChanged) *nChanged = nMoved;
+    return TotalError;
+}
+
+/**************************************/
+
+//! Cluster the data points Data[0], Data[Step], .. Data[(nData-1)*Step]
+//! If nSeedClusters != 0, the clusters' centroids are taken as a starting
+//! point (eg. from a subsample), and refined before any further splitting.
+//! Returns 0 if cancelled
+static int QuantCluster_Run(
+    struct QuantCluster_t *Clusters,
+    int nCluster,
+    int nSeedClusters,
+    const struct BGRAf_t *Data,
+    int Step,
+    int nData,
+    int32_t *DataClusters,
+    int nPasses,
+    int *StopRefining,
+    struct QuantCtrl_t *Ctrl,
+    struct QuantStageStats_t *Counters
+)
+{
+    int i;
+    Simd_Init();
+    size_t Stride = (size_t)Step * sizeof(struct BGRAf_t);
+    const struct BGRAf_t *DataEnd = (const struct BGRAf_t*)((const uint8_t*)Data + nData*Stride);
+
+    int nClusterCur   = nSeedClusters;
+    int MaxDistCluster = -1;
+    int EmptyCluster   = -1;
+    int RefineFirst    = (nSeedClusters != 0);
+    int GuessOk        = (nSeedClusters == 0); //! <- DataClusters[] holds valid indices
+    int PrincipalAxis  = (Ctrl && Ctrl->Split == QUANTSPLIT_PRINCIPALAXIS);
+    int TrainOk        = (nSeedClusters == 0); //! <- Training data matches DataClusters[]
+    int nIncremental   = 0;
+
+    //! Use mini-batch refinement when the data is large enough for it
+    int nBatch = (Ctrl && Ctrl->MiniBatch > 0 && nData > 2*Ctrl->MiniBatch) ? Ctrl->MiniBatch : 0;
+    uint32_t Seed = QUANT_MINIBATCH_SEED;
+    if(!nSeedClusters)
+    {
+        //! Perform first pass from average of data
+        const struct BGRAf_t *x;
+        Clusters[0].Centroid = (struct BGRAf_t)
+        {
+            0,0,0,0
+        };
+        for(x=Data, i=0; x<DataEnd; x+=Step, i++)
+        {
+            DataClusters[(size_t)i*Step] = 0;
+            Clusters[0].Centroid = BGRAf_Add(&Clusters[0].Centroid, x);
+        }
+        Clusters[0].Centroid = BGRAf_Divi(&Clusters[0].Centroid, nData);
+
+        //! Second pass to properly train the distortion measures
+        QuantCluster_ClearTraining(&Clusters[0]);
+        for(x=Data, i=0; x<DataEnd; x+=Step, i++) QuantCluster_Train(&Clusters[0], x, i);
+        Counters->nDistEvals += nData;
+        if(Clusters[0].MaxDistVal == 0.0f) //! Global convergence already reached (ie. single item)
+        {
+            QuantCluster_FillUnused(Clusters, 1, nCluster);
+            return 1;
+        }
+        Clusters[0].Next = -1;
+        nClusterCur    = 1;
+        MaxDistCluster = 0;
+    }
 
     //! Begin splitting clusters to form the initial codebook
-    int nClusterCur = 1;
-    int MaxDistCluster = 0;
-    int EmptyCluster = -1;
-    float LastTotalError = INFINITY;
-    while(nClusterCur < nCluster)
+    double LastTotalError = INFINITY;
+    float  Tolerance      = Ctrl ? Ctrl->Tolerance : 0.0f;
+    for(;;)
     {
         //! Split the most distorted cluster into a new one
+        if(!RefineFirst)
         {
+            if(nClusterCur >= nCluster) break;
+
             //! Setting N=1 uses iterative splitting (slow)
             //! Setting N=nClusterCur uses binary splitting (faster)
             //! We use binary splitting, and just use more refinement passes,
             //! as this is much faster for the same convergence rate.
             int N = nClusterCur;
+            int Converged = 0;
+            int nLevelSplits = 0;
             do
             {
                 //! If we've run out of pre-determined clusters, brutefroce a search now
@@ -161,6 +602,15 @@ void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const
                             MaxDist = Clusters[i].MaxDistVal;
 			}
 		    }
+
+                    //! Nothing is left to split at this level. If nothing
+                    //! was split either, every cluster has fully converged
+                    //! NOTE: Clusters split without re-assigning data are
+                    //! not candidates again until they have been trained.
+                    if(SrcCluster == -1) {
+                        Converged = (nLevelSplits == 0);
+                        break;
+                    }
                 }
 
                 //! Find the target cluster index and update the EmptyCluster linked list
@@ -173,68 +623,381 @@ void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const
 		}
 
                 //! Split cluster
-                QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, nData, DataClusters, 1);
+                //! NOTE: Mini-batch passes do not keep DataClusters[] up to
+                //! date, so the data can't be re-assigned here
+                Counters->nDistEvals += 3 * QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, Step, nData, DataClusters, !nBatch, PrincipalAxis);
+                Counters->nSplits++;
+                nLevelSplits++;
             } while(N > 0);
+            if(Converged) break;
         }
 
         //! Perform refinement passes
         int Pass;
-        float ThisTotalError = 0.0f;
-        float ClusterLastError = INFINITY;
+        double ThisTotalError = 0.0;
+        double ClusterLastError = INFINITY;
         for(Pass=0; Pass<nPasses; Pass++)
         {
-            ThisTotalError = 0.0f;
-            for(i=0; i<nClusterCur; i++) QuantCluster_ClearTraining(&Clusters[i]);
-            for(i=0; i<nData; i++)
+            //! Check for cancellation before each pass
+            if(Ctrl)
             {
-                int   BestIdx  = -1;
-                float BestDist = INFINITY;
-                for(j=0; j<nClusterCur; j++)
+                Ctrl->State.nClusters = nClusterCur;
+                Ctrl->State.Pass      = Pass;
+                if(QuantCtrl_Update(Ctrl)) return 0;
+            }
+
+            //! Stop refining once out of time (but keep splitting, so
+            //! that every cluster is still used)
+            //! NOTE: Seeded clusters always get one pass, as the data
+            //! has not yet been assigned to them.
+            if(!RefineFirst && (*StopRefining || (*StopRefining = QuantCtrl_CheckDeadline(Ctrl)))) break;
+            RefineFirst = 0;
+            Counters->nPasses++;
+            int nChanged = -1; //! <- Unknown
+            if(nBatch)
+            {
+                //! Mini-batch pass, followed by splitting of the most
+                //! distorted clusters into any that were not reached
+                //! NOTE: Clusters count the points they have seen since
+                //! the start of each split level.
+                if(Pass == 0) for(i=0; i<nClusterCur; i++) QuantCluster_ClearTraining(&Clusters[i]);
+                Counters->nDistEvals += (int64_t)nBatch * nClusterCur;
+                ThisTotalError = QuantCluster_MiniBatchPass(Clusters, nClusterCur, Data, Step, nData, nBatch, &Seed);
+                MaxDistCluster = -1;
+                EmptyCluster   = -1;
+                for(i=0; i<nClusterCur; i++)
                 {
-                    float Dist = CalculateDataDistortion(&Data[i], &Clusters[j].Centroid);
-                    if(Dist < BestDist) BestIdx = j, BestDist = Dist;
+                    if(Clusters[i].nPoints) MaxDistCluster = QuantCluster_AddToDistortionList(Clusters, i, MaxDistCluster);
+                    else Clusters[i].Next = EmptyCluster, EmptyCluster = i;
+                }
+                MaxDistCluster = QuantCluster_SortDistortionList(Clusters, MaxDistCluster);
+                while(EmptyCluster != -1 && MaxDistCluster != -1)
+                {
+                    int SrcCluster = MaxDistCluster;
+                    int DstCluster = EmptyCluster;
+                    QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, Step, nData, DataClusters, 0, 0);
+                    Counters->nEmptyRepairs++;
+                    MaxDistCluster = Clusters[SrcCluster].Next;
+                    EmptyCluster   = Clusters[DstCluster].Next;
                 }
-                ThisTotalError += BestDist;
-                DataClusters[i] = BestIdx;
-                QuantCluster_Train(&Clusters[BestIdx], &Data[i], i);
             }
-
-            //! Resolve clusters
-            MaxDistCluster = -1;
-            EmptyCluster   = -1;
-            for(i=0; i<nClusterCur; i++)
+            else
             {
-                if(QuantCluster_Resolve(&Clusters[i]))
+                //! NOTE: Incremental training accumulates rounding error, so
+                //! the clusters are retrained from scratch every so often
+                int Incremental = TrainOk && (nIncremental++ < QUANT_RETRAIN_INTERVAL);
+                if(!Incremental) nIncremental = 0;
+                ThisTotalError = QuantCluster_Assign(Clusters, nClusterCur, Data, Step, nData, DataClusters, GuessOk, Incremental, &nChanged, Counters);
+                GuessOk = TrainOk = 1;
+
+                //! Resolve clusters
+                MaxDistCluster = -1;
+                EmptyCluster   = -1;
+                for(i=0; i<nClusterCur; i++)
                 {
-                    //! If the cluster resolves, update the distortion linked list
-                    MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, i, MaxDistCluster);
+                    if(QuantCluster_Resolve(&Clusters[i]))
+                    {
+                        //! If the cluster resolves, add it to the distortion linked list
+                        MaxDistCluster = QuantCluster_AddToDistortionList(Clusters, i, MaxDistCluster);
+                    }
+                    else
+                    {
+                        //! No resolve - append to empty-cluster linked list
+                        Clusters[i].Next = EmptyCluster, EmptyCluster = i;
+                    }
                 }
-                else
+                MaxDistCluster = QuantCluster_SortDistortionList(Clusters, MaxDistCluster);
+
+                //! Split the most distorted clusters into any empty ones
+                while(EmptyCluster != -1 && MaxDistCluster != -1)
                 {
-                    //! No resolve - append to empty-cluster linked list
-                    Clusters[i].Next = EmptyCluster, EmptyCluster = i;
+                    int SrcCluster = MaxDistCluster;
+                    int DstCluster = EmptyCluster;
+                    Counters->nDistEvals += 3 * QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, Step, nData, DataClusters, 1, PrincipalAxis);
+                    Counters->nEmptyRepairs++;
+                    nChanged = -1;
+                    MaxDistCluster = Clusters[SrcCluster].Next;
+                    EmptyCluster   = Clusters[DstCluster].Next;
                 }
             }
 
-            //! Split the most distorted clusters into any empty ones
-            while(EmptyCluster != -1 && MaxDistCluster != -1)
+            //! Stop refining once the target error is reached
+            if(Ctrl && Ctrl->TargetError > 0.0f && ThisTotalError <= Ctrl->TargetError*(nBatch ? nBatch : nData))
             {
-                int SrcCluster = MaxDistCluster;
-                int DstCluster = EmptyCluster;
-                QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, nData, DataClusters, 1);
-                MaxDistCluster = Clusters[SrcCluster].Next;
-                EmptyCluster   = Clusters[DstCluster].Next;
+                Ctrl->TargetReached = 1;
+                *StopRefining = 1;
             }
 
-            //! Stop when solution stops moving
-            if(ThisTotalError == 0.0f || ThisTotalError == ClusterLastError) break;
+            //! Stop when solution stops moving: either no point changed
+            //! cluster (so the centroids can't move any further), or the
+            //! error changed by no more than the tolerance
+            if(Ctrl) Ctrl->State.TotalError = (float)ThisTotalError;
+            if(*StopRefining || ThisTotalError == 0.0 || nChanged == 0) break;
+            if(ClusterLastError != INFINITY && fabs(ClusterLastError - ThisTotalError) <= Tolerance*ClusterLastError) break;
             ClusterLastError = ThisTotalError;
         }
 
+        //! Report the level
+        //! NOTE: Only levels over all the data are reported, as this is
+        //! the only time that DataClusters[] is complete. Nor are levels
+        //! reported with coarse-to-fine clustering, as the polishing run
+        //! starts from the coarse clusters, and the subsample depends on
+        //! the number of clusters, so a level would not match a separate
+        //! run with that many clusters.
+        if(Ctrl && Ctrl->Level && Step == 1 && !nBatch && !Ctrl->CoarseToFine) Ctrl->Level(Ctrl->LevelUser, nClusterCur, DataClusters, nData);
+
 	//! If we've stopped converging, early exit
-	if(ThisTotalError == 0.0f || ThisTotalError == LastTotalError) break;
+	if(*StopRefining) continue;
+	if(ThisTotalError == 0.0 || ThisTotalError == LastTotalError) break;
 	LastTotalError = ThisTotalError;
     }
+
+    //! Mini-batch passes never assign all of the data, so do that now
+    //! NOTE: The centroids are left as they are
+    if(nBatch) QuantCluster_Assign(Clusters, nClusterCur, Data, Step, nData, DataClusters, GuessOk, 0, NULL, Counters);
+    QuantCluster_FillUnused(Clusters, nClusterCur, nCluster);
+    return 1;
+}
+
+/**************************************/
+
+//! Get a pseudo-random number in [0, 1)
+static inline float QuantCluster_RandomUnit(uint32_t *Seed)
+{
+    return QuantCluster_RandomIndex(Seed, 1<<24) * (1.0f / (1<<24));
+}
+
+//! Get the bin of a coordinate in a median-cut histogram
+static inline int QuantCluster_MedianCutBin(float v, float Min, float Scale)
+{
+    int Bin = (int)((v - Min) * Scale);
+    return (Bin < QUANT_MEDIANCUT_BINS-1) ? Bin : (QUANT_MEDIANCUT_BINS-1);
+}
+
+//! Seed clusters by median cut
+//! Starting from a box around all the data, the boxes with the largest
+//! (points * extent) are repeatedly split at the median of their longest
+//! axis. The seeds are the means of the final boxes.
+//! NOTE: While cutting, DataClusters[] holds the box of each point, and
+//! Train and Centroid hold the minimum and maximum corners of each box.
+//! Returns the number of seeds (or 0 if cancelled)
+static int QuantCluster_SeedMedianCut(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int Step, int nData, int32_t *DataClusters, struct QuantCtrl_t *Ctrl)
+{
+    int i, j;
+    const struct BGRAf_t *x;
+    const struct BGRAf_t *DataEnd = Data + (size_t)nData*Step;
+
+    //! Start with one box around all the data
+    Clusters[0].Train = Clusters[0].Centroid = Data[0];
+    Clusters[0].nPoints = nData;
+    for(x=Data, i=0; x<DataEnd; x+=Step, i++)
+    {
+        DataClusters[(size_t)i*Step] = 0;
+        for(j=0; j<4; j++)
+        {
+            float v = ((const float*)x)[j];
+            if(v < ((float*)&Clusters[0].Train)[j])    ((float*)&Clusters[0].Train)[j]    = v;
+            if(v > ((float*)&Clusters[0].Centroid)[j]) ((float*)&Clusters[0].Centroid)[j] = v;
+        }
+    }
+
+    //! Cut boxes, several at a time
+    int nBoxes = 1;
+    while(nBoxes < nCluster)
+    {
+        if(QuantCtrl_Update(Ctrl)) return 0;
+
+        //! Pick the boxes to cut, and their axes
+        struct
+        {
+            int   Box, NewBox, Axis, Cut;
+            float Min, Scale;
+            int32_t Hist[QUANT_MEDIANCUT_BINS];
+        } Cuts[QUANT_MEDIANCUT_BATCH];
+        int nCuts = 0;
+        for(i=0; i<nBoxes; i++) Clusters[i].Next = -1;
+        while(nCuts < QUANT_MEDIANCUT_BATCH && nBoxes+nCuts < nCluster)
+        {
+            int   Best = -1, BestAxis = 0;
+            float BestPriority = 0.0f;
+            for(i=0; i<nBoxes; i++) if(Clusters[i].Next == -1)
+                {
+                    for(j=0; j<4; j++)
+                    {
+                        float Extent = ((float*)&Clusters[i].Centroid)[j] - ((float*)&Clusters[i].Train)[j];
+                        float Priority = Extent * Clusters[i].nPoints;
+                        if(Priority > BestPriority) Best = i, BestAxis = j, BestPriority = Priority;
+                    }
+                }
+            if(Best == -1) break;
+            float Min = ((float*)&Clusters[Best].Train)[BestAxis];
+            float Max = ((float*)&Clusters[Best].Centroid)[BestAxis];
+            Clusters[Best].Next = nCuts;
+            Cuts[nCuts].Box    = Best;
+            Cuts[nCuts].NewBox = nBoxes + nCuts;
+            Cuts[nCuts].Axis   = BestAxis;
+            Cuts[nCuts].Min    = Min;
+            Cuts[nCuts].Scale  = QUANT_MEDIANCUT_BINS / (Max - Min);
+            for(j=0; j<QUANT_MEDIANCUT_BINS; j++) Cuts[nCuts].Hist[j] = 0;
+            nCuts++;
+        }
+        if(!nCuts) break; //! <- Every box holds only one distinct point
+
+        //! Build histograms along the cut axes
+        for(x=Data, i=0; x<DataEnd; x+=Step, i++)
+        {
+            int CutIdx = Clusters[DataClusters[(size_t)i*Step]].Next;
+            if(CutIdx != -1)
+            {
+                float v = ((const float*)x)[Cuts[CutIdx].Axis];
+                Cuts[CutIdx].Hist[QuantCluster_MedianCutBin(v, Cuts[CutIdx].Min, Cuts[CutIdx].Scale)]++;
+            }
+        }
+
+        //! Find the median bins, and reset the bounds of the cut boxes
+        //! NOTE: The minimum and maximum always fall in the first and last
+        //! bins, so there is always a cut that leaves neither side empty.
+        for(i=0; i<nCuts; i++)
+        {
+            int Box = Cuts[i].Box, NewBox = Cuts[i].NewBox;
+            int32_t Sum = Cuts[i].Hist[0];
+            for(j=1; j<QUANT_MEDIANCUT_BINS-1 && 2*Sum < Clusters[Box].nPoints; j++) Sum += Cuts[i].Hist[j];
+            Cuts[i].Cut = j;
+            Clusters[NewBox].Next = -1;
+            Clusters[NewBox].nPoints = Clusters[Box].nPoints = 0;
+            Clusters[NewBox].Train = Clusters[Box].Train = (struct BGRAf_t){INFINITY, INFINITY, INFINITY, INFINITY};
+            Clusters[NewBox].Centroid = Clusters[Box].Centroid = (struct BGRAf_t){-INFINITY, -INFINITY, -INFINITY, -INFINITY};
+        }
+
+        //! Move the points below each cut to the new box, and rebuild the bounds
+        for(x=Data, i=0; x<DataEnd; x+=Step, i++)
+        {
+            int32_t *Box = &DataClusters[(size_t)i*Step];
+            int CutIdx = Clusters[*Box].Next;
+            if(CutIdx != -1)
+            {
+                float v = ((const float*)x)[Cuts[CutIdx].Axis];
+                if(QuantCluster_MedianCutBin(v, Cuts[CutIdx].Min, Cuts[CutIdx].Scale) < Cuts[CutIdx].Cut) *Box = Cuts[CutIdx].NewBox;
+                struct QuantCluster_t *Dst = &Clusters[*Box];
+                Dst->nPoints++;
+                for(j=0; j<4; j++)
+                {
+                    v = ((const float*)x)[j];
+                    if(v < ((float*)&Dst->Train)[j])    ((float*)&Dst->Train)[j]    = v;
+                    if(v > ((float*)&Dst->Centroid)[j]) ((float*)&Dst->Centroid)[j] = v;
+                }
+            }
+        }
+        nBoxes += nCuts;
+    }
+
+    //! Seed from the box means
+    for(i=0; i<nBoxes; i++) QuantCluster_ClearTraining(&Clusters[i]);
+    for(x=Data, i=0; x<DataEnd; x+=Step, i++)
+    {
+        struct QuantCluster_t *Dst = &Clusters[DataClusters[(size_t)i*Step]];
+        QuantCluster_AddTraining(Dst, x);
+        Dst->nPoints++;
+    }
+    for(i=0; i<nBoxes; i++) QuantCluster_Resolve(&Clusters[i]);
+    return nBoxes;
+}
+
+//! Seed clusters by k-means++
+//! Each seed is a data point, drawn with probability proportional to its
+//! squared distance from the nearest seed so far. The first is drawn
+//! uniformly. The draws are reproducible (see QUANT_KMEANSPP_SEED).
+//! NOTE: While seeding, DataClusters[] holds the nearest seed of each point.
+//! Returns the number of seeds (or 0 if cancelled)
+static int QuantCluster_SeedKMeansPP(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int Step, int nData, int32_t *DataClusters, struct QuantCtrl_t *Ctrl, struct QuantStageStats_t *Counters)
+{
+    int i;
+    const struct BGRAf_t *x;
+    const struct BGRAf_t *DataEnd = Data + (size_t)nData*Step;
+    uint32_t Seed = QUANT_KMEANSPP_SEED;
+
+    //! Draw the first seed
+    Clusters[0].Centroid = Data[(size_t)QuantCluster_RandomIndex(&Seed, nData)*Step];
+    for(i=0; i<nData; i++) DataClusters[(size_t)i*Step] = 0;
+
+    //! Draw the remaining seeds
+    //! NOTE: Each pass both updates the nearest seeds (with the last seed
+    //! drawn) and draws the next seed, by weighted reservoir sampling.
+    int nSeeds = 1;
+    while(nSeeds < nCluster)
+    {
+        if(QuantCtrl_Update(Ctrl)) return 0;
+        int    Pick = -1;
+        double TotalWeight = 0.0;
+        const struct BGRAf_t *Last = &Clusters[nSeeds-1].Centroid;
+        for(x=Data, i=0; x<DataEnd; x+=Step, i++)
+        {
+            int32_t *Nearest = &DataClusters[(size_t)i*Step];
+            float Dist = CalculateDataDistortion(x, &Clusters[*Nearest].Centroid);
+            if(nSeeds > 1)
+            {
+                float DistLast = CalculateDataDistortion(x, Last);
+                if(DistLast < Dist) Dist = DistLast, *Nearest = nSeeds-1;
+            }
+            float Weight = Dist*Dist;
+            if(Weight > 0.0f)
+            {
+                TotalWeight += Weight;
+                if(QuantCluster_RandomUnit(&Seed)*TotalWeight < Weight) Pick = i;
+            }
+        }
+        Counters->nDistEvals += (int64_t)nData * 2;
+        if(Pick == -1) break; //! <- Every point is already a seed
+        Clusters[nSeeds++].Centroid = Data[(size_t)Pick*Step];
+    }
+    return nSeeds;
+}
+
+/**************************************/
+
+//! Get the subsample step for coarse-to-fine clustering (1 = No subsampling)
+static int QuantCluster_GetCoarseStep(int nCluster, int nData)
+{
+    int nCoarse = QUANT_COARSE_POINTS_PER_CLUSTER * nCluster;
+    if(nCoarse < QUANT_COARSE_MIN_POINTS) nCoarse = QUANT_COARSE_MIN_POINTS;
+    return (nData >= 2*nCoarse) ? (nData / nCoarse) : 1;
+}
+
+//! Perform total vector quantization
+int QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses, struct QuantCtrl_t *Ctrl)
+{
+    int Ok = 1;
+    int StopRefining = 0;
+    struct QuantStageStats_t Counters = {0};
+    if(Ctrl) Ctrl->State.TotalError = 0.0f; //! <- Not known until the first pass completes
+    if(!nData) return 1;
+
+    //! With coarse-to-fine clustering, the codebook is first built from
+    //! a strided subsample of the data, and then polished on all of it
+    int Step = (Ctrl && Ctrl->CoarseToFine) ? QuantCluster_GetCoarseStep(nCluster, nData) : 1;
+    int nCoarse = nData / Step;
+
+    //! Seed all the clusters up front when using a seeding initializer
+    int nSeedClusters = 0;
+    int Init = Ctrl ? Ctrl->Init : QUANTINIT_SPLIT;
+    if(Init == QUANTINIT_MEDIANCUT) Ok = nSeedClusters = QuantCluster_SeedMedianCut(Clusters, nCluster, Data, Step, nCoarse, DataClusters, Ctrl);
+    if(Init == QUANTINIT_KMEANSPP)  Ok = nSeedClusters = QuantCluster_SeedKMeansPP (Clusters, nCluster, Data, Step, nCoarse, DataClusters, Ctrl, &Counters);
+    if(Init == QUANTINIT_CENTROIDS) nSeedClusters = nCluster;
+    if(Ok) Ok = QuantCluster_Run(Clusters, nCluster, nSeedClusters, Data, Step, nCoarse, DataClusters, nPasses, &StopRefining, Ctrl, &Counters);
+    if(Ok && Step > 1)
+    {
+        //! Find the clusters that were actually used, as unused
+        //! clusters all share a centroid and would fight for data
+        for(nSeedClusters=nCluster; nSeedClusters>1; nSeedClusters--)
+        {
+            if(Clusters[nSeedClusters-1].nPoints) break;
+        }
+        int nPolishPasses = (nPasses < QUANT_COARSE_POLISH_PASSES) ? nPasses : QUANT_COARSE_POLISH_PASSES;
+        if(nPolishPasses < 1) nPolishPasses = 1; //! <- Must assign all the data at least once
+        Ok = QuantCluster_Run(Clusters, nCluster, nSeedClusters, Data, 1, nData, DataClusters, nPolishPasses, &StopRefining, Ctrl, &Counters);
+    }
+    QuantCluster_AccumulateStats(Ctrl, &Counters);
+    return Ok;
 }
 
 /**************************************/
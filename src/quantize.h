@@ -1,7 +1,10 @@
 /**************************************/
 #pragma once
 /**************************************/
+#include <stdatomic.h>
+/**************************************/
 #include "colourspace.h"
+#include "stats.h"
 /**************************************/
 
 struct QuantCluster_t
@@ -11,13 +14,110 @@ struct QuantCluster_t
     int   MaxDistIdx;
     float MaxDistVal;
     struct BGRAf_t Train;
+    struct BGRAf_t TrainErr; //! Compensation for rounding error in Train
     struct BGRAf_t Centroid;
 };
 
 /**************************************/
 
+//! Cluster initializers
+#define QUANTINIT_SPLIT     0 //! Grow the clusters by repeated splitting from the mean (default)
+#define QUANTINIT_MEDIANCUT 1 //! Seed all clusters from a median cut of the data
+#define QUANTINIT_KMEANSPP  2 //! Seed all clusters by k-means++ sampling
+#define QUANTINIT_CENTROIDS 3 //! Seed all clusters from the centroids already in Clusters[] (eg. a previous result)
+
+//! Cluster split strategies
+#define QUANTSPLIT_MAXDIST       0 //! Seed the new cluster at the most distorted point (default)
+#define QUANTSPLIT_PRINCIPALAXIS 1 //! Split along the principal axis of the cluster, at its mean
+
+/**************************************/
+
+//! Progress state
+struct QuantProgress_t
+{
+    int   Stage;      //! QUANTSTAGE_*
+    int   Palette;    //! Palette being processed (QUANTSTAGE_COLOURS only)
+    int   nPalettes;  //! Number of palettes
+    int   nClusters;  //! Current number of clusters
+    int   Pass;       //! Current refinement pass
+    float TotalError; //! Total error of the current pass
+};
+
+//! Progress callback
+//! Return non-zero to cancel processing
+typedef int (*QuantProgressCallback_t)(void *User, const struct QuantProgress_t *Progress);
+
+//! Split level callback
+//! Called once the clusters of a level of binary splitting (1, 2, 4, ...)
+//! have been refined, with the cluster of each of the nData points.
+//! NOTE: Levels are not reported with mini-batch or coarse-to-fine
+//! clustering, as neither leaves them as a separate run would.
+typedef void (*QuantLevelCallback_t)(void *User, int nClusters, const int32_t *DataClusters, int nData);
+
+//! Quantization control
+//! NOTE: All fields may be left zeroed for default behaviour
+struct QuantCtrl_t
+{
+    QuantProgressCallback_t Progress; //! Progress callback (NULL = none)
+    void *ProgressUser;               //! User data passed to Progress
+    const atomic_uint *Cancel;        //! Cancels processing once *Cancel != CancelTicket (NULL = none)
+    unsigned int CancelTicket;        //! Value of *Cancel when processing started
+    int   Cancelled;                  //! Set to non-zero once processing has been cancelled
+    struct QuantStats_t *Stats;       //! Statistics to accumulate into (NULL = none)
+    double TimeBudget;                //! Time allowed for clustering and dithering, in seconds (0 = Unlimited)
+    double Deadline;                  //! Absolute time (see QuantStats_GetTime()) at which refinement stops (0 = None)
+    int    OutOfTime;                 //! Set to non-zero once refinement has been cut short by the deadline
+    float  TargetPSNR;                //! Target PSNR of each of the B,G,R channels, in dB (0 = None)
+    float  TargetError;               //! Mean error per point at which refinement stops (0 = None)
+    int    TargetReached;             //! Set to non-zero once refinement has stopped at TargetError
+    int    CoarseToFine;              //! Split clusters on a subsample of large data sets, then polish on all the data
+    int    MiniBatch;                 //! Points per mini-batch refinement pass (0 = Full passes over all the data)
+    int    Init;                      //! Cluster initializer (QUANTINIT_*)
+    int    Split;                     //! Cluster split strategy (QUANTSPLIT_*)
+    float  Tolerance;                 //! Relative change in error at which refinement passes stop (0 = Once no point changes cluster)
+    int    TileRefinePasses;          //! Passes reassigning tiles to the palettes produced, re-quantizing changed palettes (0 = None)
+    int    nThreads;                  //! Threads used to reassign tiles to palettes (0 = One per processor)
+    QuantLevelCallback_t Level;       //! Split level callback (NULL = none)
+    void *LevelUser;                  //! User data passed to Level
+    struct QuantProgress_t State;     //! Current progress state
+};
+
+/**************************************/
+
+//! Report progress and check for cancellation
+//! Returns non-zero when processing should stop
+int QuantCtrl_Update(struct QuantCtrl_t *Ctrl);
+
+//! Set the time budget from a limit in milliseconds (<= 0 = None)
+//! The limit counts from StartTime (see QuantStats_GetTime()), so that it
+//! also covers any work done before quantizing (eg. converting to tiles).
+void QuantCtrl_SetTimeBudget(struct QuantCtrl_t *Ctrl, int Milliseconds, double StartTime);
+
+//! Check the refinement deadline
+//! Returns non-zero (and sets OutOfTime) once Deadline has passed
+int QuantCtrl_CheckDeadline(struct QuantCtrl_t *Ctrl);
+
+//! Begin/end a processing stage (sets State.Stage and times the stage)
+//! NOTE: Ctrl may be NULL
+void QuantCtrl_BeginStage(struct QuantCtrl_t *Ctrl, int Stage);
+void QuantCtrl_EndStage(struct QuantCtrl_t *Ctrl);
+
 //! Perform total vector quantization
-void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses);
+//! Returns 0 if cancelled (the clusters are then left in an undefined state)
+//! NOTE: Once Ctrl->Deadline passes, or the mean error of a pass drops to
+//! Ctrl->TargetError, no further refinement passes are run, but clusters
+//! are still split until all nCluster clusters are in use.
+//! NOTE: With Ctrl->CoarseToFine set, large data sets are first clustered
+//! from every N-th point, and then given a few passes over all points.
+//! NOTE: With Ctrl->Init set to a seeding initializer, all clusters are
+//! seeded before refining, so only one set of refinement passes is needed.
+//! NOTE: With Ctrl->MiniBatch set, data sets of more than twice that many
+//! points are refined from random (but reproducible) batches, and are only
+//! assigned to their clusters in a final pass over all points.
+//! NOTE: Refinement passes stop once no point changes cluster, or once the
+//! total error changes by no more than Ctrl->Tolerance times its last value.
+//! NOTE: Ctrl may be NULL
+int QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses, struct QuantCtrl_t *Ctrl);
 
 /**************************************/
 //! EOF
@@ -0,0 +1,533 @@
+/**************************************/
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/**************************************/
+#include "serve.h"
+/**************************************/
+#ifdef __linux__
+/**************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+/**************************************/
+#include "bitmap.h"
+#include "colourspace.h"
+#include "options.h"
+#include "qualetize.h"
+#include "quantize.h"
+#include "simd.h"
+#include "stats.h"
+#include "tiles.h"
+/**************************************/
+
+//! Maximum number of worker threads
+#define SERVE_MAX_WORKERS 256
+
+//! Maximum number of pending connections
+#define SERVE_BACKLOG 64
+
+//! Maximum number of open connections
+#define SERVE_MAX_CONNECTIONS 1024
+
+/**************************************/
+
+//! Job queue
+//! The poller queues each connection that has a job waiting, and workers
+//! hand the connection back through ReturnPipe once the job is done, so
+//! that an idle connection never holds a worker.
+struct ServeQueue_t
+{
+    pthread_mutex_t Lock;
+    pthread_cond_t  Ready;
+    int Fds[SERVE_MAX_CONNECTIONS]; //! Connections with a job waiting (circular)
+    int Head;
+    int nFds;
+    int Stop;
+    int ReturnPipe[2];
+};
+
+//! Connection handed back to the poller
+struct ServeReturn_t
+{
+    int Fd;
+    int Keep; //! 0 = Close the connection
+};
+
+//! Connection waiting for a job
+struct ServeConn_t
+{
+    int    Fd;
+    double IdleSince;
+};
+
+//! Worker state
+struct ServeWorker_t
+{
+    pthread_t Thread;
+    struct ServeQueue_t *Queue;
+    void     *Arena;     //! Tile data (grown as needed, and kept between jobs)
+    size_t    ArenaSize;
+};
+
+/**************************************/
+
+//! Flip rows of data in place
+static void FlipRows(void *Data, int RowSize, int nRows)
+{
+    int i;
+    uint8_t *a = (uint8_t*)Data;
+    uint8_t *b = (uint8_t*)Data + (size_t)(nRows-1)*RowSize;
+    for(; a < b; a += RowSize, b -= RowSize)
+    {
+        for(i=0; i<RowSize; i++)
+        {
+            uint8_t t = a[i];
+            a[i] = b[i];
+            b[i] = t;
+        }
+    }
+}
+
+//! Check that Size bytes at Offset fit in the shared memory
+static int Serve_CheckRange(uint64_t Offset, uint64_t Size, uint64_t MemSize)
+{
+    return Offset <= MemSize && Size <= MemSize - Offset;
+}
+
+/**************************************/
+
+//! Run a job on the shared memory Mem
+//! Returns the job status
+static int Serve_RunJob(
+    struct ServeWorker_t *Worker,
+    const struct ServeRequest_t *Req,
+    int nArgs,
+    const char *const *Args,
+    uint8_t *Mem,
+    uint64_t MemSize,
+    struct ServeReply_t *Reply
+)
+{
+    //! Check the request
+    if(Req->Width <= 0 || Req->Height <= 0) return SERVE_STATUS_BADREQUEST;
+    uint64_t nPx = (uint64_t)Req->Width * Req->Height;
+    if(!Serve_CheckRange(Req->PxOffset,  nPx*sizeof(struct BGRA8_t), MemSize) ||
+       !Serve_CheckRange(Req->IdxOffset, nPx, MemSize) ||
+       !Serve_CheckRange(Req->PalOffset, BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t), MemSize))
+    {
+        return SERVE_STATUS_BADREQUEST;
+    }
+    if(Req->PxOffset % sizeof(struct BGRA8_t)) return SERVE_STATUS_BADREQUEST;
+
+    //! Parse options
+    //! NOTE: Options that refer to files, or to global state, are not
+    //! supported, as these belong to the server rather than the job.
+    //! Sweeps are not supported either, as a job has only one output.
+    struct Options_t Opt;
+    Options_SetDefaults(&Opt);
+    if(Options_Parse(&Opt, nArgs, Args)) return SERVE_STATUS_BADARGS;
+    if(Opt.PaletteFile || Opt.TraceFile || Opt.ShowStats || Opt.SimdName || Opt.CacheDir) return SERVE_STATUS_BADARGS;
+    if(Options_GetSweepCount(&Opt) != 1) return SERVE_STATUS_BADARGS;
+    if(Opt.TileW <= 0 || Opt.TileH <= 0 || Opt.nPalettes <= 0 || Opt.nColoursPerPalette <= 0) return SERVE_STATUS_BADARGS;
+    if(Opt.nPalettes > BMP_PALETTE_COLOURS || Opt.nColoursPerPalette > BMP_PALETTE_COLOURS) return SERVE_STATUS_BADIMAGE;
+    if(Opt.nPalettes*Opt.nColoursPerPalette > BMP_PALETTE_COLOURS) return SERVE_STATUS_BADIMAGE;
+    if(Req->Width%Opt.TileW || Req->Height%Opt.TileH) return SERVE_STATUS_BADIMAGE;
+
+    //! Create image context over the shared memory
+    struct BmpCtx_t Image;
+    Image.Width  = Req->Width;
+    Image.Height = Req->Height;
+    Image.Stride = 0;
+    Image.Layout = Req->Layout & (BMPCTX_ORDER_MASK | BMPCTX_TOPDOWN);
+    Image.ColPal = NULL;
+    Image.PxBGR  = (struct BGRA8_t*)(Mem + Req->PxOffset);
+
+    //! Grow the arena if needed
+    size_t ArenaSize = TilesData_GetAllocSize(Image.Width, Image.Height, Opt.TileW, Opt.TileH);
+    if(ArenaSize > Worker->ArenaSize)
+    {
+        void *Arena = realloc(Worker->Arena, ArenaSize);
+        if(!Arena) return SERVE_STATUS_NOMEMORY;
+        Worker->Arena     = Arena;
+        Worker->ArenaSize = ArenaSize;
+    }
+
+    //! Do processing
+    //! NOTE: The indices are written straight into the shared memory,
+    //! but the palette is built as BGRAf_t first, so is copied out.
+    struct BGRAf_t Palette[BMP_PALETTE_COLOURS] = {{0,0,0,0}};
+    //! NOTE: The workers already cover every processor, so each job
+    //! keeps to its own thread (whatever -threads the client asked for)
+    struct QuantCtrl_t Ctrl = Options_GetCtrl(&Opt);
+    Ctrl.nThreads = 1;
+    double StartTime = QuantStats_GetTime();
+    struct TilesData_t *TilesData = TilesData_FromBitmapIntoBuffer(Worker->Arena, &Image, Opt.TileW, Opt.TileH, &Opt.BitRange, Opt.DitherMode, Opt.DitherLevel);
+    QuantCtrl_SetTimeBudget(&Ctrl, Opt.TimeBudget, StartTime);
+    uint8_t *PxIdx = Mem + Req->IdxOffset;
+    struct BGRAf_t RMSE = Qualetize(
+        &Image,
+        TilesData,
+        PxIdx,
+        Palette,
+        Opt.nPalettes,
+        Opt.nColoursPerPalette,
+        Opt.nUnusedColoursPerPalette,
+        Opt.nTileClusterPasses,
+        Opt.nColourClusterPasses,
+        &Opt.BitRange,
+        Opt.DitherMode,
+        Opt.DitherLevel,
+        0,
+        &Ctrl
+    );
+    memcpy(Mem + Req->PalOffset, Palette, BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t));
+
+    //! Output is always processed bottom-up, so flip it to match the input
+    if(Image.Layout & BMPCTX_TOPDOWN) FlipRows(PxIdx, Image.Width, Image.Height);
+
+    //! Store results
+    Reply->RMSE[0] = RMSE.b;
+    Reply->RMSE[1] = RMSE.g;
+    Reply->RMSE[2] = RMSE.r;
+    Reply->RMSE[3] = RMSE.a;
+    Reply->OutOfTime     = Ctrl.OutOfTime;
+    Reply->TargetReached = Ctrl.TargetReached;
+    return SERVE_STATUS_OK;
+}
+
+/**************************************/
+
+//! Receive a job and run it
+//! Returns 0 once the connection has been closed (or fails)
+//! NOTE: This does not block waiting for a job; the poller only queues
+//! connections that are readable, and one that is not is just kept.
+static int Serve_HandleMessage(struct ServeWorker_t *Worker, int ConnFd)
+{
+    //! Receive the request and shared memory
+    struct
+    {
+        struct ServeRequest_t Req;
+        char Args[SERVE_MAX_ARGS_SIZE];
+    } Msg;
+    union
+    {
+        char Buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr Align;
+    } Control;
+    struct iovec  Iov = {.iov_base = &Msg, .iov_len = sizeof(Msg)};
+    struct msghdr Hdr = {.msg_iov = &Iov, .msg_iovlen = 1, .msg_control = Control.Buf, .msg_controllen = sizeof(Control.Buf)};
+    ssize_t MsgSize;
+    do MsgSize = recvmsg(ConnFd, &Hdr, MSG_CMSG_CLOEXEC | MSG_DONTWAIT); while(MsgSize < 0 && errno == EINTR);
+    if(MsgSize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+    if(MsgSize <= 0) return 0;
+    int MemFd = -1;
+    struct cmsghdr *Cmsg = CMSG_FIRSTHDR(&Hdr);
+    if(Cmsg && Cmsg->cmsg_level == SOL_SOCKET && Cmsg->cmsg_type == SCM_RIGHTS && Cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    {
+        memcpy(&MemFd, CMSG_DATA(Cmsg), sizeof(int));
+    }
+
+    //! Split the option strings
+    //! NOTE: Every string must be terminated within the message
+    int nArgs = 0;
+    const char *Args[SERVE_MAX_ARGS];
+    struct ServeReply_t Reply = {.Magic = SERVE_MAGIC, .Status = SERVE_STATUS_BADREQUEST};
+    int Ok = (MsgSize >= (ssize_t)sizeof(Msg.Req) && !(Hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) && MemFd >= 0);
+    Ok = Ok && Msg.Req.Magic == SERVE_MAGIC && Msg.Req.Version == SERVE_VERSION;
+    Ok = Ok && Msg.Req.nArgs >= 0 && Msg.Req.nArgs <= SERVE_MAX_ARGS;
+    if(Ok)
+    {
+        const char *Arg = Msg.Args;
+        const char *End = (const char*)&Msg + MsgSize;
+        for(nArgs=0; nArgs<Msg.Req.nArgs; nArgs++)
+        {
+            const char *Term = memchr(Arg, '\0', End - Arg);
+            if(!Term)
+            {
+                Ok = 0;
+                break;
+            }
+            Args[nArgs] = Arg, Arg = Term+1;
+        }
+    }
+
+    //! Map the shared memory and run the job
+    //! NOTE: The size must be sealed, as a client that shrinks the memory
+    //! while it is mapped would make the server fault on access (SIGBUS).
+    struct stat MemStat;
+    int Seals = Ok ? fcntl(MemFd, F_GET_SEALS) : -1;
+    Ok = Ok && Seals >= 0 && (Seals & (F_SEAL_SHRINK | F_SEAL_GROW)) == (F_SEAL_SHRINK | F_SEAL_GROW);
+    if(Ok && !fstat(MemFd, &MemStat) && MemStat.st_size > 0)
+    {
+        uint64_t MemSize = (uint64_t)MemStat.st_size;
+        void *Mem = mmap(NULL, MemSize, PROT_READ | PROT_WRITE, MAP_SHARED, MemFd, 0);
+        if(Mem != MAP_FAILED)
+        {
+            Reply.Status = Serve_RunJob(Worker, &Msg.Req, nArgs, Args, (uint8_t*)Mem, MemSize, &Reply);
+            munmap(Mem, MemSize);
+        }
+    }
+    if(MemFd >= 0) close(MemFd);
+
+    //! Reply
+    return send(ConnFd, &Reply, sizeof(Reply), MSG_NOSIGNAL) == (ssize_t)sizeof(Reply);
+}
+
+//! Queue a connection with a job waiting
+static void Serve_PushJob(struct ServeQueue_t *Queue, int Fd)
+{
+    pthread_mutex_lock(&Queue->Lock);
+    Queue->Fds[(Queue->Head + Queue->nFds) % SERVE_MAX_CONNECTIONS] = Fd;
+    Queue->nFds++;
+    pthread_cond_signal(&Queue->Ready);
+    pthread_mutex_unlock(&Queue->Lock);
+}
+
+//! Take a connection with a job waiting
+//! Returns -1 once the server is stopping
+static int Serve_PopJob(struct ServeQueue_t *Queue)
+{
+    int Fd = -1;
+    pthread_mutex_lock(&Queue->Lock);
+    while(!Queue->nFds && !Queue->Stop) pthread_cond_wait(&Queue->Ready, &Queue->Lock);
+    if(!Queue->Stop)
+    {
+        Fd = Queue->Fds[Queue->Head];
+        Queue->Head = (Queue->Head + 1) % SERVE_MAX_CONNECTIONS;
+        Queue->nFds--;
+    }
+    pthread_mutex_unlock(&Queue->Lock);
+    return Fd;
+}
+
+//! Worker thread
+//! Each worker runs one job at a time from the queue, and hands the
+//! connection back to the poller afterwards
+static void *Serve_WorkerMain(void *User)
+{
+    struct ServeWorker_t *Worker = (struct ServeWorker_t*)User;
+    int Fd;
+    while((Fd = Serve_PopJob(Worker->Queue)) >= 0)
+    {
+        //! NOTE: Records are smaller than PIPE_BUF, so each write is atomic
+        struct ServeReturn_t Ret = {.Fd = Fd, .Keep = Serve_HandleMessage(Worker, Fd)};
+        ssize_t Size;
+        do Size = write(Worker->Queue->ReturnPipe[1], &Ret, sizeof(Ret)); while(Size < 0 && errno == EINTR);
+        if(Size != (ssize_t)sizeof(Ret))
+        {
+            perror("write");
+            close(Fd);
+        }
+    }
+    return NULL;
+}
+
+/**************************************/
+
+//! Accept connections, and queue their jobs as they arrive
+//! Connections that stay idle for SERVE_IDLE_TIMEOUT seconds are closed.
+//! This only returns on failure.
+static void Serve_Poll(int ListenFd, struct ServeQueue_t *Queue, struct ServeConn_t *Conns, struct pollfd *PollFds)
+{
+    int i;
+    int nConns = 0; //! Connections waiting for a job (Conns[])
+    int nBusy  = 0; //! Connections queued or held by a worker
+    for(;;)
+    {
+        //! Wait for new connections, jobs, or connections handed back
+        //! NOTE: Stop accepting while at the connection limit
+        double Now = QuantStats_GetTime();
+        int Timeout = -1;
+        PollFds[0] = (struct pollfd)
+        {
+            .fd = Queue->ReturnPipe[0], .events = POLLIN
+        };
+        PollFds[1] = (struct pollfd)
+        {
+            .fd = (nConns + nBusy < SERVE_MAX_CONNECTIONS) ? ListenFd : -1, .events = POLLIN
+        };
+        for(i=0; i<nConns; i++)
+        {
+            PollFds[2+i] = (struct pollfd)
+            {
+                .fd = Conns[i].Fd, .events = POLLIN
+            };
+            int Left = (int)((Conns[i].IdleSince + SERVE_IDLE_TIMEOUT - Now) * 1000.0) + 1;
+            if(Left < 0) Left = 0;
+            if(Timeout < 0 || Left < Timeout) Timeout = Left;
+        }
+        if(poll(PollFds, 2 + nConns, Timeout) < 0)
+        {
+            if(errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        Now = QuantStats_GetTime();
+
+        //! Queue jobs, and close connections that have been idle too long
+        int nKept = 0;
+        for(i=0; i<nConns; i++)
+        {
+            if(PollFds[2+i].revents) Serve_PushJob(Queue, Conns[i].Fd), nBusy++;
+            else if(Now - Conns[i].IdleSince >= SERVE_IDLE_TIMEOUT) close(Conns[i].Fd);
+            else Conns[nKept++] = Conns[i];
+        }
+        nConns = nKept;
+
+        //! Take back connections from the workers
+        if(PollFds[0].revents)
+        {
+            struct ServeReturn_t Ret[64];
+            ssize_t Size = read(Queue->ReturnPipe[0], Ret, sizeof(Ret));
+            if(Size < 0 && errno != EINTR)
+            {
+                perror("read");
+                break;
+            }
+            for(i=0; i<Size/(ssize_t)sizeof(Ret[0]); i++)
+            {
+                nBusy--;
+                if(Ret[i].Keep) Conns[nConns++] = (struct ServeConn_t)
+                {
+                    .Fd = Ret[i].Fd, .IdleSince = Now
+                };
+                else close(Ret[i].Fd);
+            }
+        }
+
+        //! Accept a new connection
+        if(PollFds[1].revents)
+        {
+            int Fd = accept4(ListenFd, NULL, NULL, SOCK_CLOEXEC);
+            if(Fd >= 0) Conns[nConns++] = (struct ServeConn_t)
+            {
+                .Fd = Fd, .IdleSince = Now
+            };
+            else if(errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("accept");
+                break;
+            }
+        }
+    }
+    for(i=0; i<nConns; i++) close(Conns[i].Fd);
+}
+
+/**************************************/
+
+//! Serve jobs on a Unix domain socket
+int Serve_Run(const char *SocketPath, int nWorkers)
+{
+    int i;
+
+    //! Create socket
+    struct sockaddr_un Addr = {.sun_family = AF_UNIX};
+    if(strlen(SocketPath) >= sizeof(Addr.sun_path))
+    {
+        printf("Socket path too long\n");
+        return 0;
+    }
+    strcpy(Addr.sun_path, SocketPath);
+    int ListenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if(ListenFd < 0)
+    {
+        perror("socket");
+        return 0;
+    }
+    unlink(SocketPath); //! <- Left behind by a previous server
+    if(bind(ListenFd, (const struct sockaddr*)&Addr, sizeof(Addr)) < 0 || listen(ListenFd, SERVE_BACKLOG) < 0)
+    {
+        perror(SocketPath);
+        close(ListenFd);
+        return 0;
+    }
+
+    //! Detect the instruction set up front, so that it can be reported
+    Simd_Init();
+
+    //! Create the job queue
+    struct ServeQueue_t Queue = {.Stop = 0};
+    pthread_mutex_init(&Queue.Lock, NULL);
+    pthread_cond_init(&Queue.Ready, NULL);
+    if(pipe2(Queue.ReturnPipe, O_CLOEXEC) < 0)
+    {
+        perror("pipe");
+        close(ListenFd);
+        unlink(SocketPath);
+        return 0;
+    }
+
+    //! Start workers
+    if(nWorkers <= 0) nWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(nWorkers <= 0) nWorkers = 1;
+    if(nWorkers > SERVE_MAX_WORKERS) nWorkers = SERVE_MAX_WORKERS;
+    struct ServeWorker_t *Workers = calloc(nWorkers, sizeof(struct ServeWorker_t));
+    struct ServeConn_t   *Conns   = malloc(SERVE_MAX_CONNECTIONS * sizeof(struct ServeConn_t));
+    struct pollfd        *PollFds = malloc((2 + SERVE_MAX_CONNECTIONS) * sizeof(struct pollfd));
+    int nStarted = 0;
+    if(!Workers || !Conns || !PollFds) printf("Out of memory\n");
+    else
+    {
+        signal(SIGPIPE, SIG_IGN);
+        for(nStarted=0; nStarted<nWorkers; nStarted++)
+        {
+            Workers[nStarted].Queue = &Queue;
+            if(pthread_create(&Workers[nStarted].Thread, NULL, Serve_WorkerMain, &Workers[nStarted])) break;
+        }
+        if(nStarted) printf("Serving on %s with %d workers (%s)\n", SocketPath, nStarted, Simd_GetLevelName(Simd.Level));
+        else printf("Unable to start workers\n");
+        fflush(stdout);
+    }
+
+    //! Poll for jobs until failure, then stop the workers
+    if(nStarted) Serve_Poll(ListenFd, &Queue, Conns, PollFds);
+    pthread_mutex_lock(&Queue.Lock);
+    Queue.Stop = 1;
+    pthread_cond_broadcast(&Queue.Ready);
+    pthread_mutex_unlock(&Queue.Lock);
+    for(i=0; i<nStarted; i++)
+    {
+        pthread_join(Workers[i].Thread, NULL);
+        free(Workers[i].Arena);
+    }
+    free(PollFds);
+    free(Conns);
+    free(Workers);
+    close(Queue.ReturnPipe[0]);
+    close(Queue.ReturnPipe[1]);
+    close(ListenFd);
+    unlink(SocketPath);
+    return 0;
+}
+
+/**************************************/
+#else
+/**************************************/
+
+//! Serve jobs on a Unix domain socket
+int Serve_Run(const char *SocketPath, int nWorkers)
+{
+    (void)SocketPath;
+    (void)nWorkers;
+    printf("Server mode is not supported on this platform\n");
+    return 0;
+}
+
+/**************************************/
+#endif
+/**************************************/
+//! EOF
+/**************************************/
@@ -0,0 +1,79 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stdint.h>
+/**************************************/
+
+//! Server protocol
+//! Clients connect to a Unix domain socket (SOCK_SEQPACKET), and send
+//! each job as one message: a ServeRequest_t followed by nArgs
+//! NUL-terminated option strings (as on the command line), with a
+//! shared-memory file descriptor (eg. from memfd_create()) attached as
+//! SCM_RIGHTS. The image is read from, and the results written to, the
+//! shared memory in place; the server then replies with a ServeReply_t.
+//! The shared memory must be sealed against resizing (F_SEAL_SHRINK and
+//! F_SEAL_GROW; see memfd_create(MFD_ALLOW_SEALING)), as the server maps
+//! it for the length of the job.
+//! Jobs on one connection are run in order; use several connections to
+//! run jobs in parallel. Connections only hold a worker while a job is
+//! running, and are closed after SERVE_IDLE_TIMEOUT seconds without one.
+#define SERVE_MAGIC   0x51544C54 //! "TLTQ"
+#define SERVE_VERSION 2
+
+//! Seconds that a connection may stay idle before it is closed
+#define SERVE_IDLE_TIMEOUT 60
+
+//! Maximum size of the option strings of a job
+#define SERVE_MAX_ARGS_SIZE 4096
+
+//! Maximum number of option strings of a job
+#define SERVE_MAX_ARGS 64
+
+//! Job status
+#define SERVE_STATUS_OK         0
+#define SERVE_STATUS_BADREQUEST 1 //! Malformed request, or shared memory missing, too small or not sealed
+#define SERVE_STATUS_BADARGS    2 //! Unrecognized or unsupported options
+#define SERVE_STATUS_BADIMAGE   3 //! Image not a multiple of tile size, or too many colours
+#define SERVE_STATUS_NOMEMORY   4
+
+/**************************************/
+
+//! Job request
+//! The input pixels are BGRA8 (in the order given by Layout), tightly
+//! packed. The output indices are written in the same row order as the
+//! input, and the output palette is BMP_PALETTE_COLOURS BGRA8 colours.
+struct ServeRequest_t
+{
+    uint32_t Magic;     //! SERVE_MAGIC
+    uint32_t Version;   //! SERVE_VERSION
+    int32_t  Width;
+    int32_t  Height;
+    int32_t  Layout;    //! Pixel layout flags (BMPCTX_x)
+    int32_t  nArgs;     //! Number of option strings following the request
+    uint64_t PxOffset;  //! Offset of the input pixels in the shared memory
+    uint64_t IdxOffset; //! Offset of the output indices in the shared memory
+    uint64_t PalOffset; //! Offset of the output palette in the shared memory
+};
+
+//! Job reply
+struct ServeReply_t
+{
+    uint32_t Magic;         //! SERVE_MAGIC
+    int32_t  Status;        //! SERVE_STATUS_x
+    float    RMSE[4];       //! RMS error of each of B,G,R,A (relative to a peak of 1.0)
+    int32_t  OutOfTime;     //! Refinement was cut short by -timebudget
+    int32_t  TargetReached; //! Refinement was stopped early at -targetpsnr
+};
+
+/**************************************/
+
+//! Serve jobs on a Unix domain socket
+//! Jobs from all connections are queued to nWorkers worker threads
+//! (0 = One per CPU).
+//! This only returns on failure to set up the socket or workers (returning
+//! 0), or on platforms without support for the server (returning 0).
+int Serve_Run(const char *SocketPath, int nWorkers);
+
+/**************************************/
+//! EOF
+/**************************************/
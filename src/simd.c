@@ -0,0 +1,472 @@
+/**************************************/
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+/**************************************/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define SIMD_X86 1
+# include <cpuid.h>
+# include <immintrin.h>
+# define SIMD_TARGET(x) __attribute__((target(x)))
+#else
+# define SIMD_X86 0
+# define SIMD_TARGET(x)
+#endif
+#ifdef __GNUC__
+# define SIMD_INLINE static inline __attribute__((always_inline))
+#else
+# define SIMD_INLINE static inline
+#endif
+/**************************************/
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+#endif
+/**************************************/
+#include "colourspace.h"
+#include "simd.h"
+/**************************************/
+
+//! Level names, in SIMD_LEVEL_x order
+static const char *const LevelNames[SIMD_LEVEL_COUNT] =
+{
+    "scalar",
+    "sse2",
+    "avx2",
+    "avx512",
+};
+
+//! Get pointer to point i
+#define SIMD_POINT(Points, i) ((const float*)((const char*)(Points) + (size_t)(i)*Stride))
+
+/**************************************/
+
+//! Distance functions
+//! NOTE: The SIMD kernels must sum the components in the same
+//! order as these, so that every level gives identical results.
+static inline float Simd_DistL1(const struct BGRAf_t *x, const struct BGRAf_t *p)
+{
+    struct BGRAf_t d = BGRAf_Sub(x, p);
+    d = BGRAf_Abs(&d);
+    return BGRAf_Sum(&d);
+}
+static inline float Simd_DistL2(const struct BGRAf_t *x, const struct BGRAf_t *p)
+{
+    return BGRAf_ColDistance(x, p);
+}
+
+//! Reduce the per-lane results of a SIMD kernel, and process any
+//! remaining points that did not fill a whole vector
+SIMD_INLINE int Simd_Finish(
+    const float   *LaneDist,
+    const int32_t *LaneIdx,
+    int nLanes,
+    const struct BGRAf_t *x,
+    const struct BGRAf_t *Points,
+    size_t Stride,
+    int i,
+    int nPoints,
+    float *Dist,
+    int L2
+)
+{
+    int n;
+    int   BestIdx  = -1;
+    float BestDist = INFINITY;
+
+    //! Lanes hold interleaved indices, so on ties the
+    //! lowest index wins to match a sequential search
+    for(n=0; n<nLanes; n++) if(LaneIdx[n] != -1)
+        {
+            if(LaneDist[n] < BestDist || (LaneDist[n] == BestDist && LaneIdx[n] < BestIdx))
+            {
+                BestIdx  = LaneIdx[n];
+                BestDist = LaneDist[n];
+            }
+        }
+    for(; i<nPoints; i++)
+    {
+        const struct BGRAf_t *p = (const struct BGRAf_t*)SIMD_POINT(Points, i);
+        float d = L2 ? Simd_DistL2(x, p) : Simd_DistL1(x, p);
+        if(d < BestDist) BestIdx = i, BestDist = d;
+    }
+    *Dist = BestDist;
+    return BestIdx;
+}
+
+/**************************************/
+
+//! Instantiate the kernels of an instruction set from its
+//! Simd_Nearest_x() body. The fixed-size versions pass constant
+//! sizes so the compiler can fully unroll them.
+#define SIMD_DEFINE_KERNELS(Isa, Target) \
+	Target static int Simd_NearestL1_##Isa(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist) { \
+		return Simd_Nearest_##Isa(x, Points, Stride, nPoints, Dist, 0); \
+	} \
+	Target static int Simd_NearestL2_##Isa(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist) { \
+		return Simd_Nearest_##Isa(x, Points, Stride, nPoints, Dist, 1); \
+	} \
+	Target static int Simd_NearestL2_16_##Isa(const struct BGRAf_t *x, const struct BGRAf_t *Points, float *Dist) { \
+		return Simd_Nearest_##Isa(x, Points, sizeof(struct BGRAf_t), 16, Dist, 1); \
+	} \
+	Target static int Simd_NearestL2_256_##Isa(const struct BGRAf_t *x, const struct BGRAf_t *Points, float *Dist) { \
+		return Simd_Nearest_##Isa(x, Points, sizeof(struct BGRAf_t), 256, Dist, 1); \
+	}
+#define SIMD_KERNELS(Level, Isa) \
+	{Level, Simd_NearestL1_##Isa, Simd_NearestL2_##Isa, Simd_NearestL2_16_##Isa, Simd_NearestL2_256_##Isa}
+
+/**************************************/
+
+//! Scalar kernel
+SIMD_INLINE int Simd_Nearest_Scalar(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist, int L2)
+{
+    return Simd_Finish(NULL, NULL, 0, x, Points, Stride, 0, nPoints, Dist, L2);
+}
+SIMD_DEFINE_KERNELS(Scalar, )
+
+/**************************************/
+#if SIMD_X86
+/**************************************/
+
+//! SSE2 kernel (4 points per iteration)
+//! Four points are loaded and transposed into B,G,R,A vectors,
+//! so that the distance sums keep their scalar order.
+SIMD_TARGET("sse2") SIMD_INLINE int Simd_Nearest_SSE2(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist, int L2)
+{
+    int i;
+    const __m128  Xb   = _mm_set1_ps(x->b);
+    const __m128  Xg   = _mm_set1_ps(x->g);
+    const __m128  Xr   = _mm_set1_ps(x->r);
+    const __m128  Xa   = _mm_set1_ps(x->a);
+    const __m128  Sign = _mm_set1_ps(-0.0f);
+    const __m128i Step = _mm_set1_epi32(4);
+    __m128  BestDist = _mm_set1_ps(INFINITY);
+    __m128i BestIdx  = _mm_set1_epi32(-1);
+    __m128i Idx      = _mm_setr_epi32(0, 1, 2, 3);
+    for(i=0; i+4<=nPoints; i+=4)
+    {
+        __m128 b = _mm_loadu_ps(SIMD_POINT(Points, i+0));
+        __m128 g = _mm_loadu_ps(SIMD_POINT(Points, i+1));
+        __m128 r = _mm_loadu_ps(SIMD_POINT(Points, i+2));
+        __m128 a = _mm_loadu_ps(SIMD_POINT(Points, i+3));
+        _MM_TRANSPOSE4_PS(b, g, r, a);
+        b = _mm_sub_ps(Xb, b);
+        g = _mm_sub_ps(Xg, g);
+        r = _mm_sub_ps(Xr, r);
+        a = _mm_sub_ps(Xa, a);
+        __m128 d;
+        if(L2)
+        {
+            d = _mm_add_ps(_mm_mul_ps(b, b), _mm_mul_ps(g, g));
+            d = _mm_add_ps(d, _mm_mul_ps(r, r));
+            d = _mm_add_ps(d, _mm_mul_ps(a, a));
+        }
+        else
+        {
+            d = _mm_add_ps(_mm_andnot_ps(Sign, b), _mm_andnot_ps(Sign, g));
+            d = _mm_add_ps(d, _mm_andnot_ps(Sign, r));
+            d = _mm_add_ps(d, _mm_andnot_ps(Sign, a));
+        }
+        __m128  Lt  = _mm_cmplt_ps(d, BestDist);
+        __m128i LtI = _mm_castps_si128(Lt);
+        BestDist = _mm_or_ps(_mm_and_ps(Lt, d), _mm_andnot_ps(Lt, BestDist));
+        BestIdx  = _mm_or_si128(_mm_and_si128(LtI, Idx), _mm_andnot_si128(LtI, BestIdx));
+        Idx = _mm_add_epi32(Idx, Step);
+    }
+    float   LaneDist[4];
+    int32_t LaneIdx [4];
+    _mm_storeu_ps(LaneDist, BestDist);
+    _mm_storeu_si128((__m128i*)LaneIdx, BestIdx);
+    return Simd_Finish(LaneDist, LaneIdx, 4, x, Points, Stride, i, nPoints, Dist, L2);
+}
+SIMD_DEFINE_KERNELS(SSE2, SIMD_TARGET("sse2"))
+
+/**************************************/
+
+//! AVX2 kernel (8 points per iteration)
+//! Points i..i+3 go in the low lane and i+4..i+7 in the high lane,
+//! so that transposing within lanes keeps the points in order.
+SIMD_TARGET("avx2") SIMD_INLINE int Simd_Nearest_AVX2(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist, int L2)
+{
+    int i;
+    const __m256  Xb   = _mm256_set1_ps(x->b);
+    const __m256  Xg   = _mm256_set1_ps(x->g);
+    const __m256  Xr   = _mm256_set1_ps(x->r);
+    const __m256  Xa   = _mm256_set1_ps(x->a);
+    const __m256  Sign = _mm256_set1_ps(-0.0f);
+    const __m256i Step = _mm256_set1_epi32(8);
+    __m256  BestDist = _mm256_set1_ps(INFINITY);
+    __m256i BestIdx  = _mm256_set1_epi32(-1);
+    __m256i Idx      = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for(i=0; i+8<=nPoints; i+=8)
+    {
+#define LOAD_PAIR(n) _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(SIMD_POINT(Points, i+n))), _mm_loadu_ps(SIMD_POINT(Points, i+n+4)), 1)
+        __m256 p0 = LOAD_PAIR(0);
+        __m256 p1 = LOAD_PAIR(1);
+        __m256 p2 = LOAD_PAIR(2);
+        __m256 p3 = LOAD_PAIR(3);
+#undef LOAD_PAIR
+        __m256 t0 = _mm256_unpacklo_ps(p0, p1);
+        __m256 t1 = _mm256_unpackhi_ps(p0, p1);
+        __m256 t2 = _mm256_unpacklo_ps(p2, p3);
+        __m256 t3 = _mm256_unpackhi_ps(p2, p3);
+        __m256 b = _mm256_sub_ps(Xb, _mm256_shuffle_ps(t0, t2, 0x44));
+        __m256 g = _mm256_sub_ps(Xg, _mm256_shuffle_ps(t0, t2, 0xEE));
+        __m256 r = _mm256_sub_ps(Xr, _mm256_shuffle_ps(t1, t3, 0x44));
+        __m256 a = _mm256_sub_ps(Xa, _mm256_shuffle_ps(t1, t3, 0xEE));
+        __m256 d;
+        if(L2)
+        {
+            d = _mm256_add_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(g, g));
+            d = _mm256_add_ps(d, _mm256_mul_ps(r, r));
+            d = _mm256_add_ps(d, _mm256_mul_ps(a, a));
+        }
+        else
+        {
+            d = _mm256_add_ps(_mm256_andnot_ps(Sign, b), _mm256_andnot_ps(Sign, g));
+            d = _mm256_add_ps(d, _mm256_andnot_ps(Sign, r));
+            d = _mm256_add_ps(d, _mm256_andnot_ps(Sign, a));
+        }
+        __m256 Lt = _mm256_cmp_ps(d, BestDist, _CMP_LT_OQ);
+        BestDist = _mm256_blendv_ps(BestDist, d, Lt);
+        BestIdx  = _mm256_blendv_epi8(BestIdx, Idx, _mm256_castps_si256(Lt));
+        Idx = _mm256_add_epi32(Idx, Step);
+    }
+    float   LaneDist[8];
+    int32_t LaneIdx [8];
+    _mm256_storeu_ps(LaneDist, BestDist);
+    _mm256_storeu_si256((__m256i*)LaneIdx, BestIdx);
+    _mm256_zeroupper(); //! <- Avoid AVX/SSE transition penalties in the scalar code
+    return Simd_Finish(LaneDist, LaneIdx, 8, x, Points, Stride, i, nPoints, Dist, L2);
+}
+SIMD_DEFINE_KERNELS(AVX2, SIMD_TARGET("avx2"))
+
+/**************************************/
+
+//! AVX-512 kernel (16 points per iteration)
+//! Same layout as the AVX2 kernel, with points i+4*k in lane k.
+SIMD_TARGET("avx512f") SIMD_INLINE int Simd_Nearest_AVX512(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist, int L2)
+{
+    int i;
+    const __m512  Xb   = _mm512_set1_ps(x->b);
+    const __m512  Xg   = _mm512_set1_ps(x->g);
+    const __m512  Xr   = _mm512_set1_ps(x->r);
+    const __m512  Xa   = _mm512_set1_ps(x->a);
+    const __m512i Abs  = _mm512_set1_epi32(0x7FFFFFFF);
+    const __m512i Step = _mm512_set1_epi32(16);
+    __m512  BestDist = _mm512_set1_ps(INFINITY);
+    __m512i BestIdx  = _mm512_set1_epi32(-1);
+    __m512i Idx      = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for(i=0; i+16<=nPoints; i+=16)
+    {
+#define LOAD_QUAD(n) \
+	_mm512_insertf32x4(_mm512_insertf32x4(_mm512_insertf32x4(_mm512_castps128_ps512( \
+		_mm_loadu_ps(SIMD_POINT(Points, i+n+ 0))), \
+		_mm_loadu_ps(SIMD_POINT(Points, i+n+ 4)), 1), \
+		_mm_loadu_ps(SIMD_POINT(Points, i+n+ 8)), 2), \
+		_mm_loadu_ps(SIMD_POINT(Points, i+n+12)), 3)
+        __m512 p0 = LOAD_QUAD(0);
+        __m512 p1 = LOAD_QUAD(1);
+        __m512 p2 = LOAD_QUAD(2);
+        __m512 p3 = LOAD_QUAD(3);
+#undef LOAD_QUAD
+        __m512 t0 = _mm512_unpacklo_ps(p0, p1);
+        __m512 t1 = _mm512_unpackhi_ps(p0, p1);
+        __m512 t2 = _mm512_unpacklo_ps(p2, p3);
+        __m512 t3 = _mm512_unpackhi_ps(p2, p3);
+        __m512 b = _mm512_sub_ps(Xb, _mm512_shuffle_ps(t0, t2, 0x44));
+        __m512 g = _mm512_sub_ps(Xg, _mm512_shuffle_ps(t0, t2, 0xEE));
+        __m512 r = _mm512_sub_ps(Xr, _mm512_shuffle_ps(t1, t3, 0x44));
+        __m512 a = _mm512_sub_ps(Xa, _mm512_shuffle_ps(t1, t3, 0xEE));
+        __m512 d;
+        if(L2)
+        {
+            d = _mm512_add_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(g, g));
+            d = _mm512_add_ps(d, _mm512_mul_ps(r, r));
+            d = _mm512_add_ps(d, _mm512_mul_ps(a, a));
+        }
+        else
+        {
+#define ABS(x) _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(x), Abs))
+            d = _mm512_add_ps(ABS(b), ABS(g));
+            d = _mm512_add_ps(d, ABS(r));
+            d = _mm512_add_ps(d, ABS(a));
+#undef ABS
+        }
+        __mmask16 Lt = _mm512_cmp_ps_mask(d, BestDist, _CMP_LT_OQ);
+        BestDist = _mm512_mask_mov_ps   (BestDist, Lt, d);
+        BestIdx  = _mm512_mask_mov_epi32(BestIdx,  Lt, Idx);
+        Idx = _mm512_add_epi32(Idx, Step);
+    }
+    float   LaneDist[16];
+    int32_t LaneIdx [16];
+    _mm512_storeu_ps(LaneDist, BestDist);
+    _mm512_storeu_si512(LaneIdx, BestIdx);
+    _mm256_zeroupper();
+    return Simd_Finish(LaneDist, LaneIdx, 16, x, Points, Stride, i, nPoints, Dist, L2);
+}
+SIMD_DEFINE_KERNELS(AVX512, SIMD_TARGET("avx512f"))
+
+/**************************************/
+#endif
+/**************************************/
+
+//! Kernels for each level, in SIMD_LEVEL_x order
+static const struct SimdKernels_t LevelKernels[SIMD_LEVEL_COUNT] =
+{
+    SIMD_KERNELS(SIMD_LEVEL_SCALAR, Scalar),
+#if SIMD_X86
+    SIMD_KERNELS(SIMD_LEVEL_SSE2,   SSE2),
+    SIMD_KERNELS(SIMD_LEVEL_AVX2,   AVX2),
+    SIMD_KERNELS(SIMD_LEVEL_AVX512, AVX512),
+#endif
+};
+
+/**************************************/
+
+//! Select the automatic level on first use
+static int Simd_NearestL1_Init(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist)
+{
+    Simd_Init();
+    return Simd.NearestL1(x, Points, Stride, nPoints, Dist);
+}
+static int Simd_NearestL2_Init(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist)
+{
+    Simd_Init();
+    return Simd.NearestL2(x, Points, Stride, nPoints, Dist);
+}
+
+static int Simd_NearestL2_16_Init(const struct BGRAf_t *x, const struct BGRAf_t *Points, float *Dist)
+{
+    Simd_Init();
+    return Simd.NearestL2_16(x, Points, Dist);
+}
+static int Simd_NearestL2_256_Init(const struct BGRAf_t *x, const struct BGRAf_t *Points, float *Dist)
+{
+    Simd_Init();
+    return Simd.NearestL2_256(x, Points, Dist);
+}
+
+struct SimdKernels_t Simd =
+{
+    SIMD_LEVEL_AUTO,
+    Simd_NearestL1_Init,
+    Simd_NearestL2_Init,
+    Simd_NearestL2_16_Init,
+    Simd_NearestL2_256_Init,
+};
+
+/**************************************/
+
+//! Best level supported by the CPU (set by Simd_InitOnce())
+static int SupportedLevel = SIMD_LEVEL_SCALAR;
+
+//! Query the CPU (and operating system) for the best supported level
+static int Simd_DetectLevel(void)
+{
+#if SIMD_X86
+    unsigned int a, b, c, d;
+    if(!__get_cpuid(1, &a, &b, &c, &d) || !(d & bit_SSE2)) return SIMD_LEVEL_SCALAR;
+
+    //! AVX state must also be saved by the OS (XCR0 bits 1,2)
+    if(!(c & bit_OSXSAVE) || !(c & bit_AVX)) return SIMD_LEVEL_SSE2;
+    unsigned int XCR0Lo, XCR0Hi;
+    __asm__ __volatile__("xgetbv" : "=a"(XCR0Lo), "=d"(XCR0Hi) : "c"(0));
+    if((XCR0Lo & 0x06) != 0x06) return SIMD_LEVEL_SSE2;
+    if(!__get_cpuid_count(7, 0, &a, &b, &c, &d) || !(b & bit_AVX2)) return SIMD_LEVEL_SSE2;
+
+    //! AVX-512 state (XCR0 bits 5,6,7: opmask, ZMM0-15 upper, ZMM16-31)
+    if(!(b & bit_AVX512F) || (XCR0Lo & 0xE6) != 0xE6) return SIMD_LEVEL_AVX2;
+    return SIMD_LEVEL_AVX512;
+#else
+    return SIMD_LEVEL_SCALAR;
+#endif
+}
+
+//! Resolve a level to one that can be selected
+static int Simd_ResolveLevel(int Level)
+{
+    if(Level == SIMD_LEVEL_AUTO)
+    {
+        const char *Env = getenv(SIMD_LEVEL_ENV);
+        if(Env) Level = Simd_LevelFromName(Env);
+        if(Level < SIMD_LEVEL_SCALAR) Level = SIMD_LEVEL_COUNT-1;
+    }
+    if(Level < SIMD_LEVEL_SCALAR) Level = SIMD_LEVEL_SCALAR;
+    if(Level > SupportedLevel) Level = SupportedLevel;
+    return Level;
+}
+
+//! Detect the CPU and select the automatic level
+//! NOTE: cpuid can be very slow under virtualization,
+//! so this must only ever run once.
+static void Simd_InitOnce(void)
+{
+    SupportedLevel = Simd_DetectLevel();
+    Simd = LevelKernels[Simd_ResolveLevel(SIMD_LEVEL_AUTO)];
+}
+
+#ifdef _WIN32
+static INIT_ONCE SimdOnce = INIT_ONCE_STATIC_INIT;
+static BOOL CALLBACK Simd_InitOnceCallback(PINIT_ONCE Once, PVOID Param, PVOID *Context)
+{
+    (void)Once;
+    (void)Param;
+    (void)Context;
+    Simd_InitOnce();
+    return TRUE;
+}
+void Simd_Init(void)
+{
+    InitOnceExecuteOnce(&SimdOnce, Simd_InitOnceCallback, NULL, NULL);
+}
+#else
+static pthread_once_t SimdOnce = PTHREAD_ONCE_INIT;
+void Simd_Init(void)
+{
+    pthread_once(&SimdOnce, Simd_InitOnce);
+}
+#endif
+
+/**************************************/
+
+//! Get the best level supported by the CPU (and operating system)
+int Simd_GetSupportedLevel(void)
+{
+    Simd_Init();
+    return SupportedLevel;
+}
+
+/**************************************/
+
+//! Select kernels for the given level
+int Simd_SetLevel(int Level)
+{
+    Simd_Init();
+    Level = Simd_ResolveLevel(Level);
+    Simd = LevelKernels[Level];
+    return Level;
+}
+
+/**************************************/
+
+//! Convert between levels and names
+const char *Simd_GetLevelName(int Level)
+{
+    if(Level == SIMD_LEVEL_AUTO) return "auto";
+    if(Level < SIMD_LEVEL_SCALAR || Level >= SIMD_LEVEL_COUNT) return NULL;
+    return LevelNames[Level];
+}
+int Simd_LevelFromName(const char *Name)
+{
+    int i;
+    if(!strcmp(Name, "auto")) return SIMD_LEVEL_AUTO;
+    for(i=0; i<SIMD_LEVEL_COUNT; i++) if(!strcmp(Name, LevelNames[i])) return i;
+    return -2;
+}
+
+/**************************************/
+//! EOF
+/**************************************/
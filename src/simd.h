@@ -0,0 +1,83 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stddef.h>
+/**************************************/
+#include "colourspace.h"
+/**************************************/
+
+//! Instruction set levels
+//! NOTE: Every level gives bit-identical results to SIMD_LEVEL_SCALAR
+#define SIMD_LEVEL_AUTO   (-1) //! Best level supported by the CPU
+#define SIMD_LEVEL_SCALAR ( 0) //! Plain C
+#define SIMD_LEVEL_SSE2   ( 1) //! x86 SSE2
+#define SIMD_LEVEL_AVX2   ( 2) //! x86 AVX2
+#define SIMD_LEVEL_AVX512 ( 3) //! x86 AVX-512F
+#define SIMD_LEVEL_COUNT  ( 4)
+
+//! Environment variable that overrides SIMD_LEVEL_AUTO (eg. "sse2")
+#define SIMD_LEVEL_ENV "TILEQUANT_SIMD"
+
+/**************************************/
+
+//! Nearest-point search
+//! Points[] holds nPoints points spaced Stride bytes apart (Stride must
+//! be a multiple of 4). Returns the index of the first point with the
+//! smallest distance to x (or -1 if no distance is less than INFINITY),
+//! and stores that distance to *Dist.
+typedef int (*SimdNearest_t)(const struct BGRAf_t *x, const struct BGRAf_t *Points, size_t Stride, int nPoints, float *Dist);
+
+//! Nearest-point search over a fixed number of contiguous points
+typedef int (*SimdNearestFixed_t)(const struct BGRAf_t *x, const struct BGRAf_t *Points, float *Dist);
+
+//! Kernels for the selected instruction set
+struct SimdKernels_t
+{
+    int Level;
+    SimdNearest_t NearestL1; //! Sum of absolute differences (clustering)
+    SimdNearest_t NearestL2; //! Sum of squared differences (palette search; see BGRAf_ColDistance())
+    SimdNearestFixed_t NearestL2_16;  //! NearestL2 over 16 points
+    SimdNearestFixed_t NearestL2_256; //! NearestL2 over 256 points
+};
+
+//! Currently selected kernels
+//! NOTE: These select SIMD_LEVEL_AUTO on first use, but code that may
+//! run on several threads must call Simd_Init() before reading them.
+extern struct SimdKernels_t Simd;
+
+/**************************************/
+
+//! Search a contiguous palette, using the fixed-size
+//! kernels for the common palette sizes
+static inline int Simd_NearestPaletteL2(const struct BGRAf_t *x, const struct BGRAf_t *Pal, int nEntries, float *Dist)
+{
+    if(nEntries ==  16) return Simd.NearestL2_16 (x, Pal, Dist);
+    if(nEntries == 256) return Simd.NearestL2_256(x, Pal, Dist);
+    return Simd.NearestL2(x, Pal, sizeof(struct BGRAf_t), nEntries, Dist);
+}
+
+/**************************************/
+
+//! Detect the CPU and select SIMD_LEVEL_AUTO
+//! Detection runs exactly once, however many threads call this; later
+//! calls return immediately (and keep any level set with Simd_SetLevel()).
+void Simd_Init(void);
+
+//! Get the best level supported by the CPU (and operating system)
+int Simd_GetSupportedLevel(void);
+
+//! Select kernels for the given level
+//! Levels above the supported level are reduced to it. SIMD_LEVEL_AUTO
+//! uses the level named in SIMD_LEVEL_ENV if set, else the best level.
+//! Returns the level actually selected.
+//! NOTE: This must not be called while other threads are quantizing.
+int Simd_SetLevel(int Level);
+
+//! Convert between levels and names ("auto", "scalar", "sse2", "avx2", "avx512")
+//! Simd_LevelFromName() returns -2 if the name is not recognized.
+const char *Simd_GetLevelName(int Level);
+int Simd_LevelFromName(const char *Name);
+
+/**************************************/
+//! EOF
+/**************************************/
@@ -0,0 +1,154 @@
+/**************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+/**************************************/
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+/**************************************/
+#include "stats.h"
+/**************************************/
+
+//! Stage names, in QUANTSTAGE_x order
+static const char *const StageNames[QUANTSTAGE_COUNT] =
+{
+    "TileClustering",
+    "ColourClustering",
+    "Dither",
+    "TileConversion",
+    "TileRefinement",
+};
+
+//! Stages in order of execution
+static const int StageOrder[QUANTSTAGE_COUNT] =
+{
+    QUANTSTAGE_CONVERT,
+    QUANTSTAGE_TILES,
+    QUANTSTAGE_COLOURS,
+    QUANTSTAGE_REFINE,
+    QUANTSTAGE_DITHER,
+};
+
+/**************************************/
+
+//! Get the current time (in seconds) from a monotonic clock
+double QuantStats_GetTime(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER Freq, Count;
+    QueryPerformanceFrequency(&Freq);
+    QueryPerformanceCounter(&Count);
+    return (double)Count.QuadPart / (double)Freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1.0e-9;
+#endif
+}
+
+/**************************************/
+
+//! Clear statistics
+void QuantStats_Clear(struct QuantStats_t *Stats)
+{
+    memset(Stats, 0, sizeof(*Stats));
+}
+
+/**************************************/
+
+//! Begin timing of a stage
+void QuantStats_BeginStage(struct QuantStats_t *Stats, int Stage)
+{
+    if(!Stats) return;
+    double Now = QuantStats_GetTime();
+    if(Stats->BaseTime == 0.0) Stats->BaseTime = Now;
+    if(!Stats->Stage[Stage].nRuns++) Stats->Stage[Stage].StartTime = Now - Stats->BaseTime;
+    Stats->RunTime = Now;
+}
+
+//! End timing of a stage
+void QuantStats_EndStage(struct QuantStats_t *Stats, int Stage)
+{
+    if(!Stats) return;
+    Stats->Stage[Stage].Time += QuantStats_GetTime() - Stats->RunTime;
+}
+
+/**************************************/
+
+//! Print statistics in human-readable form
+void QuantStats_Print(const struct QuantStats_t *Stats, FILE *File)
+{
+    int i;
+    double TotalTime = 0.0;
+    fprintf(File, "%-16s %10s %6s %8s %8s %8s %8s %14s\n", "Stage", "Time(ms)", "Runs", "Passes", "Pass/Run", "Splits", "Repairs", "DistEvals");
+    for(i=0; i<QUANTSTAGE_COUNT; i++)
+    {
+        const struct QuantStageStats_t *s = &Stats->Stage[StageOrder[i]];
+        fprintf(File, "%-16s %10.3f %6d %8d %8.1f %8d %8d %14lld\n",
+            StageNames[StageOrder[i]],
+            s->Time*1000.0,
+            s->nRuns,
+            s->nPasses,
+            s->nRuns ? (double)s->nPasses / s->nRuns : 0.0,
+            s->nSplits,
+            s->nEmptyRepairs,
+            (long long)s->nDistEvals
+        );
+        TotalTime += s->Time;
+    }
+    fprintf(File, "%-16s %10.3f\n", "Total", TotalTime*1000.0);
+}
+
+/**************************************/
+
+//! Write statistics as Chrome trace-event JSON
+int QuantStats_WriteTrace(const struct QuantStats_t *Stats, const char *Filename)
+{
+    int i;
+    FILE *File = fopen(Filename, "w");
+    if(!File) return 0;
+
+    //! Each stage is written as a complete ('X') event, with its
+    //! counters attached as arguments and also as a counter ('C') event
+    fprintf(File, "{\"traceEvents\":[\n");
+    for(i=0; i<QUANTSTAGE_COUNT; i++)
+    {
+        const struct QuantStageStats_t *s = &Stats->Stage[StageOrder[i]];
+        if(!s->nRuns) continue;
+        fprintf(File,
+            "{\"name\":\"%s\",\"cat\":\"tilequant\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"runs\":%d,\"passes\":%d,\"splits\":%d,\"emptyRepairs\":%d,\"distEvals\":%lld}},\n",
+            StageNames[StageOrder[i]],
+            s->StartTime*1.0e6,
+            s->Time*1.0e6,
+            s->nRuns,
+            s->nPasses,
+            s->nSplits,
+            s->nEmptyRepairs,
+            (long long)s->nDistEvals
+        );
+        fprintf(File,
+            "{\"name\":\"%sCounters\",\"cat\":\"tilequant\",\"ph\":\"C\",\"pid\":1,\"tid\":1,\"ts\":%.3f,"
+            "\"args\":{\"passes\":%d,\"splits\":%d,\"emptyRepairs\":%d}},\n",
+            StageNames[StageOrder[i]],
+            s->StartTime*1.0e6,
+            s->nPasses,
+            s->nSplits,
+            s->nEmptyRepairs
+        );
+    }
+    fprintf(File, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"tilequant\"}}\n");
+    fprintf(File, "],\"displayTimeUnit\":\"ms\"}\n");
+
+    //! Done
+    int Ok = !ferror(File);
+    if(fclose(File) != 0) Ok = 0;
+    return Ok;
+}
+
+/**************************************/
+//! EOF
+/**************************************/
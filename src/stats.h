@@ -0,0 +1,60 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stdint.h>
+#include <stdio.h>
+/**************************************/
+
+//! Processing stages
+#define QUANTSTAGE_TILES   0 //! Clustering tiles into palettes
+#define QUANTSTAGE_COLOURS 1 //! Clustering colours of each palette
+#define QUANTSTAGE_DITHER  2 //! Final dithering/remapping
+#define QUANTSTAGE_CONVERT 3 //! Conversion of the image to tiles
+#define QUANTSTAGE_REFINE  4 //! Reassignment of tiles to the palettes produced
+#define QUANTSTAGE_COUNT   5
+
+/**************************************/
+
+//! Per-stage statistics
+struct QuantStageStats_t
+{
+    double  StartTime;     //! Time the stage was first started (seconds, relative to QuantStats_t::BaseTime)
+    double  Time;          //! Total time spent in the stage (seconds)
+    int32_t nRuns;         //! Number of times the stage was run (eg. once per palette)
+    int32_t nPasses;       //! Refinement passes performed
+    int32_t nSplits;       //! Cluster splits performed
+    int32_t nEmptyRepairs; //! Empty clusters repaired by splitting
+    int64_t nDistEvals;    //! Distance evaluations
+};
+
+//! Processing statistics
+struct QuantStats_t
+{
+    double BaseTime; //! Absolute time of the first stage start (0 = Not yet started)
+    double RunTime;  //! Absolute start time of the stage currently running
+    struct QuantStageStats_t Stage[QUANTSTAGE_COUNT];
+};
+
+/**************************************/
+
+//! Get the current time (in seconds) from a monotonic clock
+double QuantStats_GetTime(void);
+
+//! Clear statistics
+void QuantStats_Clear(struct QuantStats_t *Stats);
+
+//! Begin/end timing of a stage
+//! NOTE: Stats may be NULL
+void QuantStats_BeginStage(struct QuantStats_t *Stats, int Stage);
+void QuantStats_EndStage(struct QuantStats_t *Stats, int Stage);
+
+//! Print statistics in human-readable form
+void QuantStats_Print(const struct QuantStats_t *Stats, FILE *File);
+
+//! Write statistics as Chrome trace-event JSON (chrome://tracing, Perfetto)
+//! Returns 0 on failure
+int QuantStats_WriteTrace(const struct QuantStats_t *Stats, const char *Filename);
+
+/**************************************/
+//! EOF
+/**************************************/
@@ -4,29 +4,158 @@
 #include <stdlib.h>
 #include <string.h>
 /**************************************/
+#ifdef _WIN32
+# include <fcntl.h>
+# include <io.h>
+# define dup    _dup
+# define dup2   _dup2
+# define fileno _fileno
+# define fdopen _fdopen
+#else
+# include <unistd.h>
+#endif
+/**************************************/
 #include "bitmap.h"
+#include "cache.h"
 #include "colourspace.h"
+#include "options.h"
 #include "qualetize.h"
+#include "quantize.h"
+#include "serve.h"
+#include "simd.h"
+#include "stats.h"
 #include "tiles.h"
 /**************************************/
 
 //! When not zero, the PSNR for each channel will be displayed
 #define MEASURE_PSNR 1
 
+//! Filename that stands for stdin (as input) or stdout (as output)
+#define STDIO_FILENAME "-"
+
+/**************************************/
+
+//! Load palettes from file
+//! This accepts either a palettized BMP, or raw little-endian
+//! BGR555 colours (eg. as stored in GBA/NDS palette RAM).
+//! Returns the number of colours read, or -1 on error.
+static int LoadPalette(struct BGRA8_t *Palette, int MaxColours, const char *Filename)
+{
+    int i;
+    FILE *File = fopen(Filename, "rb");
+    if(!File) return -1;
+
+    //! Palettized BMP?
+    uint16_t Magic = 0;
+    if(fread(&Magic, 1, sizeof(Magic), File) == sizeof(Magic) && Magic == ('B'|'M'<<8))
+    {
+        fclose(File);
+        struct BmpCtx_t Ctx;
+        if(!BmpCtx_FromFile(&Ctx, Filename)) return -1;
+        if(!Ctx.ColPal)
+        {
+            BmpCtx_Destroy(&Ctx);
+            return -1;
+        }
+        if(MaxColours > BMP_PALETTE_COLOURS) MaxColours = BMP_PALETTE_COLOURS;
+        for(i=0; i<MaxColours; i++) Palette[i] = Ctx.ColPal[i];
+        BmpCtx_Destroy(&Ctx);
+        return MaxColours;
+    }
+
+    //! Raw BGR555
+    rewind(File);
+    for(i=0; i<MaxColours; i++)
+    {
+        uint8_t v[2];
+        if(fread(v, 1, 2, File) != 2) break;
+        int c = v[0] | v[1]<<8;
+        int r = (c >>  0) & 0x1F;
+        int g = (c >>  5) & 0x1F;
+        int b = (c >> 10) & 0x1F;
+        Palette[i] = (struct BGRA8_t){.b = b<<3 | b>>2, .g = g<<3 | g>>2, .r = r<<3 | r>>2, .a = 0xFF};
+    }
+    fclose(File);
+    return i;
+}
+
 /**************************************/
 
-//! strcmp() implementation that ACTUALLY returns the difference between
-//! characters instead of just the signs. Blame the C standard -_-
-static int mystrcmp(const char *s1, const char *s2)
+//! Select an instruction set by name (NULL = Leave as is)
+//! Returns 0 if it was not recognized
+static int ApplySimdLevel(const char *Name)
 {
-    while(*s1 && *s1 == *s2) s1++, s2++;
-    return *s1 - *s2;
+    if(!Name) return 1;
+    int Level = Simd_LevelFromName(Name);
+    if(Level < SIMD_LEVEL_AUTO)
+    {
+        printf("Unrecognized instruction set: %s\n", Name);
+        return 0;
+    }
+    if(Simd_SetLevel(Level) < Level) printf("Instruction set not supported: %s\n", Name);
+    return 1;
+}
+
+/**************************************/
+
+//! Read the input image from stdin
+static int ReadStdinImage(struct BmpCtx_t *Image)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    return BmpCtx_FromStream(Image, stdin);
+}
+
+//! Get a stream for writing images to stdout
+//! So that only images are written to stdout, the stream writes to a
+//! duplicate of stdout's descriptor, and stdout's descriptor is then
+//! pointed at stderr, moving all messages there.
+//! Returns NULL on failure.
+static FILE *TakeStdoutForImages(void)
+{
+    fflush(stdout);
+    int Fd = dup(fileno(stdout));
+    if(Fd < 0) return NULL;
+    if(dup2(fileno(stderr), fileno(stdout)) < 0) return NULL;
+#ifdef _WIN32
+    _setmode(Fd, _O_BINARY);
+#endif
+    return fdopen(Fd, "wb");
+}
+
+/**************************************/
+
+//! Get the output filename for a combination of swept settings
+//! The name of the combination is inserted before the extension.
+static void GetSweepFilename(char *Dst, int DstSize, const char *Filename, const char *SweepName)
+{
+    const char *Ext  = strrchr(Filename, '.');
+    const char *Base = strrchr(Filename, '/');
+    if(!Ext || (Base && Ext < Base)) Ext = Filename + strlen(Filename);
+    snprintf(Dst, DstSize, "%.*s%s%s", (int)(Ext - Filename), Filename, SweepName, Ext);
 }
 
 /**************************************/
 
 int main(int argc, const char *argv[])
 {
+    //! Serve jobs?
+    if(argc >= 3 && !strcmp(argv[1], "--serve"))
+    {
+        int argi;
+        int nWorkers = 0;
+        const char *SimdName = NULL;
+        for(argi=3; argi<argc; argi++)
+        {
+            if     (!memcmp(argv[argi], "-workers:", 9)) nWorkers = atoi(argv[argi] + 9);
+            else if(!memcmp(argv[argi], "-simd:",    6)) SimdName = argv[argi] + 6;
+            else printf("Unrecognized argument: %s\n", argv[argi]);
+        }
+        if(!ApplySimdLevel(SimdName)) return -1;
+        return Serve_Run(argv[2], nWorkers) ? 0 : -1;
+    }
+
     //! Check arguments
     if(argc < 3)
     {
@@ -34,183 +163,323 @@ int main(int argc, const char *argv[])
             "tilequant - Tiled colour-quantization tool\n"
             "Usage:\n"
             " tilequant Input.bmp Output.bmp [options]\n"
-            "Options:\n"
-            " -np:16            - Set number of palettes available\n"
-            " -ps:16            - Set number of colours per palette\n"
-            " -tw:8             - Set tile width\n"
-            " -th:8             - Set tile height\n"
-            " -bgra:5551        - Set BGRA bit depth\n"
-            " -dither:floyd,1.0 - Set dither mode, level\n"
-            " -tilepasses:0     - Set tile cluster passes (0 = default)\n"
-            " -colourpasses:0   - Set colour cluster passes (0 = default)\n"
-            "Dither modes available (and default level):\n"
-            " -dither:none       - No dithering\n"
-            " -dither:floyd,1.0  - Floyd-Steinberg\n"
-            " -dither:ord2,0.5   - 2x2 ordered dithering\n"
-            " -dither:ord4,0.5   - 4x4 ordered dithering\n"
-            " -dither:ord8,0.5   - 8x8 ordered dithering\n"
-            " -dither:ord16,0.5  - 16x16 ordered dithering\n"
-            " -dither:ord32,0.5  - 32x32 ordered dithering\n"
-            " -dither:ord64,0.5  - 64x64 ordered dithering\n"
+            " tilequant --serve Socket [-workers:N] [-simd:auto]\n"
+            "Input.bmp may be - to read from stdin, and Output.bmp may be - to\n"
+            "write to stdout (when sweeping, every image is written in turn, and\n"
+            "messages go to stderr instead).\n"
+        );
+        Options_PrintUsage(stdout);
+        printf(
+            "Server mode:\n"
+            " Jobs are accepted on the Unix socket until killed, and run by N\n"
+            " workers (0 = one per CPU). See tilequantclient for a client.\n"
         );
         return 1;
     }
 
-    //! Parse arguments
-    int     nPalettes = 16;
-    int     nColoursPerPalette = 16;
-    int     nUnusedColoursPerPalette = 1;
-    int     nTileClusterPasses   = 0;
-    int     nColourClusterPasses = 0;
-    int     TileW = 8;
-    int     TileH = 8;
-    struct BGRA8_t BitRange = {.b = 0x1F, .g = 0x1F, .r = 0x1F, .a = 0x01};
-    int     DitherMode  = DITHER_FLOYDSTEINBERG;
-    float   DitherLevel = 1.0f;
+    //! When writing to stdout, move messages out of the way first
+    FILE *ImageOut = NULL;
+    if(!strcmp(argv[2], STDIO_FILENAME))
     {
-        int argi;
-        for(argi=3; argi<argc; argi++)
+        ImageOut = TakeStdoutForImages();
+        if(!ImageOut)
         {
-            int ArgOk = 0;
-
-            const char *ArgStr;
-#define ARGMATCH(Input, Target) \
-	ArgStr = Input + strlen(Target); \
-	if(!memcmp(Input, Target, strlen(Target)))
-            //! nPalettes
-            ARGMATCH(argv[argi], "-np:") ArgOk = 1, nPalettes = atoi(ArgStr);
-
-            //! nColoursPerPalette
-            ARGMATCH(argv[argi], "-ps:") ArgOk = 1, nColoursPerPalette = atoi(ArgStr);
-
-            //! nUnusedColoursPerPalette
-
-            //! TileW
-            ARGMATCH(argv[argi], "-tw:") ArgOk = 1, TileW = atoi(ArgStr);
-
-            //! TileH
-            ARGMATCH(argv[argi], "-th:") ArgOk = 1, TileH = atoi(ArgStr);
-
-            //! BitRange
-            ARGMATCH(argv[argi], "-bgra:")
-            {
-                ArgOk = 1;
-                BitRange.b = (1 << (*ArgStr++ - '0')) - 1;
-                BitRange.g = (1 << (*ArgStr++ - '0')) - 1;
-                BitRange.r = (1 << (*ArgStr++ - '0')) - 1;
-                BitRange.a = (1 << (*ArgStr++ - '0')) - 1;
-            }
-
-            //! DitherMode,DitherLevel
-            ARGMATCH(argv[argi], "-dither:")
-            {
-                int d;
-#define DITHERMODE_MATCH(Input, Target, ModeValue, DefaultLevel) \
-	d = mystrcmp(Input, Target); \
-	if(!d || d == ',') { \
-		ArgOk = 1; \
-		DitherMode  = ModeValue; \
-		DitherLevel = !d ? DefaultLevel : atof(strchr(Input, ',')+1); \
-	}
-                DITHERMODE_MATCH(ArgStr, "none",  DITHER_NONE,           0.0f);
-                DITHERMODE_MATCH(ArgStr, "floyd", DITHER_FLOYDSTEINBERG, 1.0f);
-                DITHERMODE_MATCH(ArgStr, "ord2",  DITHER_ORDERED(1),     0.5f);
-                DITHERMODE_MATCH(ArgStr, "ord4",  DITHER_ORDERED(2),     0.5f);
-                DITHERMODE_MATCH(ArgStr, "ord8",  DITHER_ORDERED(3),     0.5f);
-                DITHERMODE_MATCH(ArgStr, "ord16", DITHER_ORDERED(4),     0.5f);
-                DITHERMODE_MATCH(ArgStr, "ord32", DITHER_ORDERED(5),     0.5f);
-                DITHERMODE_MATCH(ArgStr, "ord64", DITHER_ORDERED(6),     0.5f);
-#undef DITHERMODE_MATCH
-                if(!ArgOk) printf("Unrecognized dither mode: %s\n", ArgStr);
-                ArgOk = 1;
-            }
-
-            //! nTileClusterPasses
-            ARGMATCH(argv[argi], "-tilepasses:")
-            {
-                ArgOk = 1;
-                nTileClusterPasses = atoi(ArgStr);
-            }
-
-            //! nColourClusterPasses
-            ARGMATCH(argv[argi], "-colourpasses:")
-            {
-                ArgOk = 1;
-                nColourClusterPasses = atoi(ArgStr);
-            }
-#undef ARGMATCH
-            //! Unrecognized?
-            if(!ArgOk) printf("Unrecognized argument: %s\n", ArgStr);
+            printf("Unable to write to stdout\n");
+            return -1;
         }
     }
 
+    //! Parse arguments
+    struct Options_t Opt;
+    Options_SetDefaults(&Opt);
+    Options_Parse(&Opt, argc-3, &argv[3]);
+    ApplySimdLevel(Opt.SimdName);
+    int nSweep = Options_GetSweepCount(&Opt);
+
     //! Get input image
+    //! NOTE: When sweeping, this is shared by all combinations
     struct BmpCtx_t Image;
-    if(!BmpCtx_FromFile(&Image, argv[1]))
+    int ImageOk;
+    if(!strcmp(argv[1], STDIO_FILENAME)) ImageOk = ReadStdinImage(&Image);
+    else ImageOk = BmpCtx_FromFile(&Image, argv[1]);
+    if(!ImageOk)
     {
         printf("Unable to read input file\n");
         return -1;
     }
-    if(Image.Width%TileW || Image.Height%TileH)
+    if(Image.Width%Opt.TileW || Image.Height%Opt.TileH)
     {
-        printf("Image not a multiple of tile size (%dx%d)\n", TileW, TileH);
+        printf("Image not a multiple of tile size (%dx%d)\n", Opt.TileW, Opt.TileH);
         BmpCtx_Destroy(&Image);
         return -1;
     }
 
-    //! Perform processing
-    //! NOTE: PxData and Palette will be assigned to image; do NOT destroy
-    struct TilesData_t *TilesData = TilesData_FromBitmap(&Image, TileW, TileH, &BitRange, DitherMode, DitherLevel);
-    uint8_t     *PxData    = malloc(Image.Width * Image.Height * sizeof(uint8_t));
-    struct BGRAf_t     *Palette   = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRAf_t));
-    if(!TilesData || !PxData || !Palette)
+    //! Get the key of the image for the result cache
+    //! NOTE: Results under a time budget are not cached (see cache.h)
+    int UseCache = Opt.CacheDir && !Opt.TimeBudget;
+    struct CacheKey_t ImageKey = {{0,0}};
+    if(UseCache)
+    {
+        ImageKey = Cache_GetImageKey(&Image);
+        Cache_RemoveStaleTemps(Opt.CacheDir);
+    }
+
+    //! When sweeping over the number of palettes, cluster the tiles
+    //! for the largest number, keeping the result at each level along
+    //! the way (see TilesData_ClusterTileLadder())
+    //! NOTE: Under a time budget, tiles are clustered for each combination
+    //! instead, so that each gets its share of the budget.
+    int nTiles    = (Image.Width / Opt.TileW) * (Image.Height / Opt.TileH);
+    int LadderTop = 0;
+    if(nSweep > 1 && (Opt.Ladder || Opt.Sweep[OPTIONS_SWEEP_PALETTES]) && !Opt.TimeBudget)
+    {
+        LadderTop = Options_GetMaxPalettes(&Opt);
+    }
+
+    //! Allocate processing buffers
+    void           *TilesBuffer = malloc(TilesData_GetAllocSize(Image.Width, Image.Height, Opt.TileW, Opt.TileH));
+    uint8_t        *PxData      = malloc(Image.Width * Image.Height * sizeof(uint8_t));
+    struct BGRAf_t *Palette     = malloc(BMP_PALETTE_COLOURS * sizeof(struct BGRAf_t));
+    int32_t        *LadderIdx   = LadderTop ? malloc(TILESDATA_MAX_LADDER * nTiles * sizeof(int32_t)) : NULL;
+    if(!TilesBuffer || !PxData || !Palette || (LadderTop && !LadderIdx))
     {
         printf("Out of memory; image not processed\n");
+        free(LadderIdx);
         free(Palette);
         free(PxData);
-        free(TilesData);
+        free(TilesBuffer);
         BmpCtx_Destroy(&Image);
         return -1;
     }
-    struct BGRAf_t RMSE = Qualetize(
-                              &Image,
-                              TilesData,
-                              PxData,
-                              Palette,
-                              nPalettes,
-                              nColoursPerPalette,
-                              nUnusedColoursPerPalette,
-                              nTileClusterPasses,
-                              nColourClusterPasses,
-                              &BitRange,
-                              DitherMode,
-                              DitherLevel,
-                              1
-                          );
-    free(TilesData);
-
-    //! Output PSNR
+
+    //! Process each combination of settings
+    //! NOTE: Tile data is only converted again when the bit depth or
+    //! dithering changes, and this also keeps its tile clustering for
+    //! re-use with other palette sizes (see TilesData_t).
+    int SweepIdx, Result = 0;
+    int nLadderLevels = 0;
+    int LadderPals[TILESDATA_MAX_LADDER];
+    struct TilesData_t *TilesData = NULL;
+    struct BGRA8_t TilesBitRange = {0,0,0,0};
+    int            TilesDitherMode  = 0;
+    float          TilesDitherLevel = 0.0f;
+    struct QuantStats_t Stats;
+    QuantStats_Clear(&Stats);
+    for(SweepIdx=0; SweepIdx<nSweep; SweepIdx++)
+    {
+        //! Select settings
+        char SweepName[256];
+        char OutName[FILENAME_MAX];
+        const char *OutFile = argv[2];
+        if(nSweep > 1)
+        {
+            Options_SetSweep(&Opt, SweepIdx, SweepName, sizeof(SweepName));
+            if(!ImageOut)
+            {
+                GetSweepFilename(OutName, sizeof(OutName), argv[2], SweepName);
+                OutFile = OutName;
+            }
+            else OutFile = SweepName;
+            printf("%s:\n", OutFile);
+        }
+
+        //! Check palette will fit into the output
+        if(Opt.nPalettes*Opt.nColoursPerPalette > BMP_PALETTE_COLOURS)
+        {
+            printf("Too many colours (%d palettes of %d colours; maximum is %d total)\n", Opt.nPalettes, Opt.nColoursPerPalette, BMP_PALETTE_COLOURS);
+            Result = -1;
+            continue;
+        }
+
+        //! Get palettes to remap to
+        struct BGRA8_t SrcPalette[BMP_PALETTE_COLOURS] = {{0,0,0,0}};
+        if(Opt.PaletteFile && LoadPalette(SrcPalette, Opt.nPalettes*Opt.nColoursPerPalette, Opt.PaletteFile) < 0)
+        {
+            printf("Unable to read palette file\n");
+            Result = -1;
+            continue;
+        }
+
+        //! Look up the result cache
+        //! NOTE: Palette entries past the output colours are left clear
+        struct QuantCtrl_t Ctrl = Options_GetCtrl(&Opt);
+        Ctrl.Stats = &Stats;
+        struct BGRAf_t RMSE;
+        struct CacheKey_t Key;
+        struct CacheEntry_t Entry =
+        {
+            .Width    = Image.Width,
+            .Height   = Image.Height,
+            .nTiles   = nTiles,
+            .nColours = Opt.nPalettes*Opt.nColoursPerPalette,
+            .PxIdx    = PxData,
+            .Palette  = (struct BGRA8_t*)Palette,
+        };
+        int Cached = 0;
+        memset(Palette, 0, BMP_PALETTE_COLOURS * sizeof(struct BGRAf_t));
+        if(UseCache)
+        {
+            struct CacheParams_t Params =
+            {
+                .nPalettes          = Opt.nPalettes,
+                .nColoursPerPalette = Opt.nColoursPerPalette,
+                .nUnusedColoursPerPalette = Opt.nUnusedColoursPerPalette,
+                .TileW              = Opt.TileW,
+                .TileH              = Opt.TileH,
+                .nTileClusterPasses   = Opt.nTileClusterPasses,
+                .nColourClusterPasses = Opt.nColourClusterPasses,
+                .BitRange           = Opt.BitRange,
+                .DitherMode         = Opt.DitherMode,
+                .DitherLevel        = Opt.DitherLevel,
+            };
+            Key = Cache_GetKey(&ImageKey, &Params, &Ctrl, Opt.PaletteFile ? SrcPalette : NULL);
+            Cached = Cache_Load(Opt.CacheDir, &Key, &Entry);
+        }
+        if(Cached)
+        {
+            RMSE = Entry.RMSE;
+            Ctrl.TargetReached = Entry.TargetReached;
+            printf("Result taken from cache\n");
+        }
+        else
+        {
+            //! Convert to tiles as needed
+            double StartTime = QuantStats_GetTime();
+            if(!TilesData ||
+               memcmp(&TilesBitRange, &Opt.BitRange, sizeof(struct BGRA8_t)) ||
+               TilesDitherMode != Opt.DitherMode || TilesDitherLevel != Opt.DitherLevel)
+            {
+                QuantCtrl_BeginStage(&Ctrl, QUANTSTAGE_CONVERT);
+                TilesData = TilesData_FromBitmapIntoBuffer(TilesBuffer, &Image, Opt.TileW, Opt.TileH, &Opt.BitRange, Opt.DitherMode, Opt.DitherLevel);
+                QuantCtrl_EndStage(&Ctrl);
+                TilesBitRange    = Opt.BitRange;
+                TilesDitherMode  = Opt.DitherMode;
+                TilesDitherLevel = Opt.DitherLevel;
+                if(LadderTop)
+                {
+                    nLadderLevels = TilesData_ClusterTileLadder(TilesData, LadderIdx, LadderPals, LadderTop, Opt.nTileClusterPasses, &Ctrl);
+                }
+            }
+
+            //! Take the tile clustering from the ladder if possible
+            int Level;
+            for(Level=0; Level<nLadderLevels; Level++) if(LadderPals[Level] == Opt.nPalettes)
+                {
+                    TilesData_SetTileClusters(TilesData, LadderIdx + Level*nTiles, Opt.nPalettes, Opt.nTileClusterPasses);
+                }
+            QuantCtrl_SetTimeBudget(&Ctrl, Opt.TimeBudget, StartTime);
+
+            //! Perform processing
+            //! NOTE: The image is not replaced, so that it can be re-used
+            memset(Palette, 0, BMP_PALETTE_COLOURS * sizeof(struct BGRAf_t));
+            if(Opt.PaletteFile) RMSE = QualetizeWithPalette(
+                                           &Image,
+                                           TilesData,
+                                           PxData,
+                                           Palette,
+                                           SrcPalette,
+                                           Opt.nPalettes,
+                                           Opt.nColoursPerPalette,
+                                           Opt.nUnusedColoursPerPalette,
+                                           &Opt.BitRange,
+                                           Opt.DitherMode,
+                                           Opt.DitherLevel,
+                                           0,
+                                           &Ctrl
+                                       );
+            else RMSE = Qualetize(
+                                &Image,
+                                TilesData,
+                                PxData,
+                                Palette,
+                                Opt.nPalettes,
+                                Opt.nColoursPerPalette,
+                                Opt.nUnusedColoursPerPalette,
+                                Opt.nTileClusterPasses,
+                                Opt.nColourClusterPasses,
+                                &Opt.BitRange,
+                                Opt.DitherMode,
+                                Opt.DitherLevel,
+                                0,
+                                &Ctrl
+                            );
+
+            //! Store the result to the cache
+            if(UseCache)
+            {
+                Entry.RMSE          = RMSE;
+                Entry.TargetReached = Ctrl.TargetReached;
+                Entry.TilePalIdx    = TilesData->TilePalIdx;
+                if(!Cache_Store(Opt.CacheDir, &Key, &Entry)) printf("Unable to write cache entry\n");
+            }
+        }
+
+        //! Output PSNR
 #if MEASURE_PSNR
-    RMSE.b = -8.68588963f*logf(RMSE.b / 255.0f); //! -20*Log10[RMSE/255] == -20/Log[10] * Log[RMSE/255]
-    RMSE.g = -8.68588963f*logf(RMSE.g / 255.0f);
-    RMSE.r = -8.68588963f*logf(RMSE.r / 255.0f);
-    RMSE.a = -8.68588963f*logf(RMSE.a / 255.0f);
-    printf("PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}\n", RMSE.b, RMSE.g, RMSE.r, RMSE.a);
+        //! NOTE: RMSE is relative to a peak value of 1.0
+        int TargetMet = Qualetize_MeetsTargetPSNR(&RMSE, Opt.TargetPSNR);
+        RMSE.b = -8.68588963f*logf(RMSE.b); //! -20*Log10[RMSE] == -20/Log[10] * Log[RMSE]
+        RMSE.g = -8.68588963f*logf(RMSE.g);
+        RMSE.r = -8.68588963f*logf(RMSE.r);
+        RMSE.a = -8.68588963f*logf(RMSE.a);
+        printf("PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}\n", RMSE.b, RMSE.g, RMSE.r, RMSE.a);
+        if(Opt.TargetPSNR > 0.0f)
+        {
+            if(!TargetMet) printf("Target PSNR of %.3fdB not reached\n", Opt.TargetPSNR);
+            else if(Ctrl.TargetReached) printf("Target PSNR reached; refinement was stopped early\n");
+        }
 #else
-    (void)RMSE;
+        (void)RMSE;
 #endif
-    //! Output image
-    if(!BmpCtx_ToFile(&Image, argv[2]))
+        if(Ctrl.OutOfTime) printf("Time budget reached; refinement was stopped early\n");
+
+        //! Output image
+        //! NOTE: The output is always bottom-up
+        struct BmpCtx_t Output =
+        {
+            .Width  = Image.Width,
+            .Height = Image.Height,
+            .Stride = 0,
+            .Layout = 0,
+            .ColPal = (struct BGRA8_t*)Palette,
+            .PxIdx  = PxData,
+        };
+        int OutputOk;
+        if(ImageOut) OutputOk = BmpCtx_ToStream(&Output, ImageOut);
+        else OutputOk = BmpCtx_ToFile(&Output, OutFile);
+        if(!OutputOk)
+        {
+            printf("Unable to write output file\n");
+            Result = -1;
+        }
+    }
+    free(LadderIdx);
+    free(Palette);
+    free(PxData);
+    free(TilesBuffer);
+    BmpCtx_Destroy(&Image);
+
+    //! Output statistics
+    if(Opt.ShowStats)
+    {
+        printf("Instruction set: %s\n", Simd_GetLevelName(Simd.Level));
+        QuantStats_Print(&Stats, stdout);
+    }
+    if(Opt.TraceFile && !QuantStats_WriteTrace(&Stats, Opt.TraceFile))
+    {
+        printf("Unable to write trace file\n");
+    }
+
+    //! Finish writing to stdout
+    if(ImageOut && fclose(ImageOut) != 0)
     {
         printf("Unable to write output file\n");
-        BmpCtx_Destroy(&Image);
-        return -1;
+        Result = -1;
     }
 
-    //! Success
-    BmpCtx_Destroy(&Image);
-    printf("Ok\n");
-    return 0;
+    //! Success?
+    if(Result == 0) printf("Ok\n");
+    return Result;
 }
 
 /**************************************/
@@ -1,13 +1,631 @@
 /**************************************/
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 /**************************************/
 #include "bitmap.h"
+#include "cache.h"
 #include "qualetize.h"
+#include "quantize.h"
+#include "stats.h"
 #include "tiles.h"
 /**************************************/
 
+//! Quantizer context
+//! This owns an arena for the tile data which is sized for the
+//! largest image seen so far, so that repeated calls (eg. from
+//! an editor) do not need to allocate memory on every call.
+struct QualetizeCtx_t
+{
+    void  *Arena;
+    size_t ArenaSize;
+    QuantProgressCallback_t Progress;
+    void *ProgressUser;
+    atomic_uint CancelCount; //! Number of QualetizeCtx_Cancel() calls so far
+    int InputStride;
+    int InputLayout;
+    int TimeBudget;
+    int OutOfTime;
+    float TargetPSNR;
+    int CoarseToFine;
+    int MiniBatch;
+    int Init;
+    int Split;
+    float Tolerance;
+    int TileRefinePasses;
+    int nThreads;
+    char *CacheDir;
+    struct QuantStats_t Stats;
+
+    //! Settings and results of the last QualetizeCtx_Quantize() call,
+    //! for QualetizeCtx_UpdateTiles() (TilesData = NULL if none)
+    struct
+    {
+        struct TilesData_t *TilesData;
+        int   Width;
+        int   Height;
+        int   nPalettes;
+        int   nColoursPerPalette;
+        int   nUnusedColoursPerPalette;
+        int   nColourClusterPasses;
+        int   OutputPaletteIs24bitRGB;
+        struct BGRA8_t BitRange;
+        int   DitherMode;
+        float DitherLevel;
+        struct BGRAf_t Palette[BMP_PALETTE_COLOURS]; //! BGRA, reduced range
+    } Session;
+};
+
+/**************************************/
+
+//! Create quantizer context
+//! Returns NULL on failure
+DECLSPEC struct QualetizeCtx_t *QualetizeCtx_Create(void)
+{
+    struct QualetizeCtx_t *Ctx = malloc(sizeof(struct QualetizeCtx_t));
+    if(!Ctx) return NULL;
+    Ctx->Arena        = NULL;
+    Ctx->ArenaSize    = 0;
+    Ctx->Progress     = NULL;
+    Ctx->ProgressUser = NULL;
+    atomic_init(&Ctx->CancelCount, 0);
+    Ctx->InputStride  = 0;
+    Ctx->InputLayout  = 0;
+    Ctx->TimeBudget   = 0;
+    Ctx->OutOfTime    = 0;
+    Ctx->TargetPSNR   = 0.0f;
+    Ctx->CoarseToFine = 0;
+    Ctx->MiniBatch    = 0;
+    Ctx->Init         = 0;
+    Ctx->Split        = 0;
+    Ctx->Tolerance    = 0.0f;
+    Ctx->TileRefinePasses = 0;
+    Ctx->nThreads = 0;
+    Ctx->CacheDir     = NULL;
+    QuantStats_Clear(&Ctx->Stats);
+    Ctx->Session.TilesData = NULL;
+    return Ctx;
+}
+
+/**************************************/
+
+//! Destroy quantizer context
+DECLSPEC void QualetizeCtx_Destroy(struct QualetizeCtx_t *Ctx)
+{
+    if(!Ctx) return;
+    free(Ctx->CacheDir);
+    free(Ctx->Arena);
+    free(Ctx);
+}
+
+/**************************************/
+
+//! Set progress callback
+//! The callback is given a pointer to the following structure:
+//!  struct {
+//!   int   Stage;      //! 0 = Tile clustering, 1 = Colour clustering, 2 = Dithering, 4 = Tile refinement
+//!   int   Palette;    //! Palette being clustered (Stage 1 only)
+//!   int   nPalettes;  //! Number of palettes
+//!   int   nClusters;  //! Current number of clusters
+//!   int   Pass;       //! Current refinement pass
+//!   float TotalError; //! Total error of the last completed pass
+//!  }
+//! and should return non-zero to cancel processing.
+//! Pass Callback = NULL to disable progress reporting.
+DECLSPEC void QualetizeCtx_SetProgressCallback(struct QualetizeCtx_t *Ctx, QuantProgressCallback_t Callback, void *User)
+{
+    Ctx->Progress     = Callback;
+    Ctx->ProgressUser = User;
+}
+
+/**************************************/
+
+//! Cancel processing
+//! This may be called from any thread. The call in progress stops as
+//! soon as possible and returns -1; if no call is in progress, this has
+//! no effect.
+//! NOTE: Each call takes a ticket (the number of cancellations so far)
+//! as it starts, and is cancelled once the count moves past it, so no
+//! flag needs clearing afterwards (which could lose a cancellation).
+DECLSPEC void QualetizeCtx_Cancel(struct QualetizeCtx_t *Ctx)
+{
+    atomic_fetch_add(&Ctx->CancelCount, 1);
+}
+
+/**************************************/
+
+//! Set input image layout
+//! This allows reading the caller's pixel buffers in place, without
+//! needing to copy/swizzle them first.
+//!  RowStride = Bytes from one row to the next (0 = Tightly packed)
+//!  Layout    = Channel order, plus optional top-down flag:
+//!   0 = BGRA (byte order: {BB, GG, RR, AA})
+//!   1 = RGBA (byte order: {RR, GG, BB, AA})
+//!   2 = ARGB (byte order: {AA, RR, GG, BB})
+//!   3 = ABGR (byte order: {AA, BB, GG, RR})
+//!   +4 = Rows are stored top-to-bottom (default is bottom-to-top)
+//! The channel order also applies to the palette of paletted images.
+//! With top-down rows, DstPxIdx and TilePalIdx are also output top-down.
+DECLSPEC void QualetizeCtx_SetInputLayout(struct QualetizeCtx_t *Ctx, int RowStride, int Layout)
+{
+    Ctx->InputStride = RowStride;
+    Ctx->InputLayout = Layout;
+}
+
+/**************************************/
+
+//! Set time budget
+//! Milliseconds is the time allowed for each call (0 = Unlimited).
+//! Once clustering runs out of its share of the budget, refinement
+//! stops and the best solution so far is used; the final remap
+//! always completes, so a call may slightly overrun the budget.
+DECLSPEC void QualetizeCtx_SetTimeBudget(struct QualetizeCtx_t *Ctx, int Milliseconds)
+{
+    Ctx->TimeBudget = Milliseconds;
+}
+
+//! Check whether the last call ran out of time
+//! Returns non-zero if refinement was stopped early by the time budget
+DECLSPEC int QualetizeCtx_WasOutOfTime(const struct QualetizeCtx_t *Ctx)
+{
+    return Ctx->OutOfTime;
+}
+
+/**************************************/
+
+//! Set target quality
+//! Colour clustering stops refining once the PSNR (in dB) of each of
+//! the B,G,R channels is estimated to reach TargetPSNR (0 = Disabled).
+//! The result is checked after the final remap; if the estimate turned
+//! out too optimistic, clustering is redone with full refinement.
+DECLSPEC void QualetizeCtx_SetTargetPSNR(struct QualetizeCtx_t *Ctx, float TargetPSNR)
+{
+    Ctx->TargetPSNR = TargetPSNR;
+}
+
+/**************************************/
+
+//! Enable coarse-to-fine clustering (0 = Disabled)
+//! Large palette groups are first clustered from a subsample of their
+//! pixels, and then given a few refinement passes over all of them.
+//! This is much faster on large images, at a small cost in quality.
+DECLSPEC void QualetizeCtx_SetCoarseToFine(struct QualetizeCtx_t *Ctx, int Enable)
+{
+    Ctx->CoarseToFine = Enable;
+}
+
+//! Set mini-batch size (0 = Disabled)
+//! Palette groups of more than twice this many pixels are refined from
+//! random batches of this many pixels rather than from all of them. The
+//! batches are reproducible, so the same input gives the same output.
+//! This trades a little quality for throughput on very large images.
+DECLSPEC void QualetizeCtx_SetMiniBatch(struct QualetizeCtx_t *Ctx, int BatchSize)
+{
+    Ctx->MiniBatch = BatchSize;
+}
+
+//! Set cluster initializer
+//!  0 = Grow clusters by repeated splitting (default)
+//!  1 = Seed all clusters from a median cut
+//!  2 = Seed all clusters by k-means++ sampling (reproducible)
+//! Seeding initializers only need one set of refinement passes, rather
+//! than one for every round of splitting, so are much faster with large
+//! palettes.
+DECLSPEC void QualetizeCtx_SetInit(struct QualetizeCtx_t *Ctx, int Init)
+{
+    Ctx->Init = Init;
+}
+
+//! Set cluster split strategy
+//!  0 = Seed new clusters at the most distorted pixel (default)
+//!  1 = Split clusters along their principal axis, at their mean
+//! Principal-axis splits give better-placed clusters, which need fewer
+//! refinement passes to converge.
+DECLSPEC void QualetizeCtx_SetSplit(struct QualetizeCtx_t *Ctx, int Split)
+{
+    Ctx->Split = Split;
+}
+
+//! Set convergence tolerance
+//! Refinement passes stop once the total error changes by no more than
+//! this fraction of its last value (eg. 0.0001), or once no pixel changes
+//! cluster (0 = Only the latter; default).
+DECLSPEC void QualetizeCtx_SetTolerance(struct QualetizeCtx_t *Ctx, float Tolerance)
+{
+    Ctx->Tolerance = Tolerance;
+}
+
+//! Set tile refinement passes
+//! After the palettes are produced, each pass moves every tile to the
+//! palette that remaps it with least error, and re-quantizes only the
+//! palettes that gained or lost tiles (0 = Disabled; default).
+DECLSPEC void QualetizeCtx_SetTileRefinePasses(struct QualetizeCtx_t *Ctx, int nPasses)
+{
+    Ctx->TileRefinePasses = nPasses;
+}
+
+//! Set threads used to reassign tiles to palettes
+//! This covers tile refinement (see QualetizeCtx_SetTileRefinePasses()),
+//! remapping, and tile updates; results do not depend on it. Callers
+//! that already run a context on each processor may want 1 here
+//! (0 = One thread per processor; default).
+DECLSPEC void QualetizeCtx_SetThreads(struct QualetizeCtx_t *Ctx, int nThreads)
+{
+    Ctx->nThreads = nThreads;
+}
+
+/**************************************/
+
+//! Set result cache directory (NULL = Disabled; default)
+//! Results of QualetizeCtx_Quantize(), QualetizeCtx_Remap() and
+//! QualetizeCtx_Sweep() are stored in this directory, keyed by a hash of
+//! the image and of every setting that affects them. When the same image
+//! is processed again with the same settings, the stored result is
+//! returned without any processing. Several processes may share one
+//! directory. Results under a time budget are not cached. Temporary files
+//! left behind by writers that died are cleared out here.
+//! NOTE: After a result is taken from the cache, there is nothing for
+//! QualetizeCtx_UpdateTiles() to update, so it fails.
+//! Returns 0 on failure (out of memory).
+DECLSPEC int QualetizeCtx_SetCacheDir(struct QualetizeCtx_t *Ctx, const char *Dir)
+{
+    char *Copy = NULL;
+    if(Dir)
+    {
+        Copy = malloc(strlen(Dir) + 1);
+        if(!Copy) return 0;
+        strcpy(Copy, Dir);
+    }
+    free(Ctx->CacheDir);
+    Ctx->CacheDir = Copy;
+    if(Dir) Cache_RemoveStaleTemps(Dir);
+    return 1;
+}
+
+/**************************************/
+
+//! Get statistics of the last call
+//! The returned structure (owned by the context) is laid out as:
+//!  struct {
+//!   double BaseTime, RunTime; //! Internal
+//!   struct {
+//!    double  StartTime;     //! Start time of the stage (seconds from start of processing)
+//!    double  Time;          //! Total time spent in the stage (seconds)
+//!    int32_t nRuns;         //! Number of times the stage was run
+//!    int32_t nPasses;       //! Refinement passes performed
+//!    int32_t nSplits;       //! Cluster splits performed
+//!    int32_t nEmptyRepairs; //! Empty clusters repaired by splitting
+//!    int64_t nDistEvals;    //! Distance evaluations
+//!   } Stage[5]; //! Tile clustering, Colour clustering, Dithering, Tile conversion, Tile refinement
+//!  }
+DECLSPEC const struct QuantStats_t *QualetizeCtx_GetStats(const struct QualetizeCtx_t *Ctx)
+{
+    return &Ctx->Stats;
+}
+
+/**************************************/
+
+//! Write statistics of the last call as Chrome trace-event JSON
+//! Returns 0 on failure
+DECLSPEC int QualetizeCtx_WriteTrace(const struct QualetizeCtx_t *Ctx, const char *Filename)
+{
+    return QuantStats_WriteTrace(&Ctx->Stats, Filename);
+}
+
+/**************************************/
+
+//! Flip rows of data in place
+static void FlipRows(void *Data, int RowSize, int nRows)
+{
+    int i;
+    uint8_t *a = (uint8_t*)Data;
+    uint8_t *b = (uint8_t*)Data + (nRows-1)*RowSize;
+    for(; a < b; a += RowSize, b -= RowSize)
+    {
+        for(i=0; i<RowSize; i++)
+        {
+            uint8_t t = a[i];
+            a[i] = b[i];
+            b[i] = t;
+        }
+    }
+}
+
+/**************************************/
+
+//! Get the cancellation ticket of a call
+//! NOTE: This must be taken once, as the call starts (see QualetizeCtx_Cancel())
+static unsigned int QualetizeCtx_GetCancelTicket(struct QualetizeCtx_t *QCtx)
+{
+    return atomic_load(&QCtx->CancelCount);
+}
+
+//! Get the quantization control for the context
+static struct QuantCtrl_t QualetizeCtx_GetCtrl(struct QualetizeCtx_t *QCtx, unsigned int CancelTicket)
+{
+    return (struct QuantCtrl_t)
+    {
+        .Progress     = QCtx->Progress,
+        .ProgressUser = QCtx->ProgressUser,
+        .Cancel       = &QCtx->CancelCount,
+        .CancelTicket = CancelTicket,
+        .Stats        = &QCtx->Stats,
+        .TargetPSNR   = QCtx->TargetPSNR,
+        .CoarseToFine = QCtx->CoarseToFine,
+        .MiniBatch    = QCtx->MiniBatch,
+        .Init         = QCtx->Init,
+        .Split        = QCtx->Split,
+        .Tolerance    = QCtx->Tolerance,
+        .TileRefinePasses = QCtx->TileRefinePasses,
+        .nThreads     = QCtx->nThreads,
+    };
+}
+
+//! Store outputs in the caller's layout
+//! NOTE: DstPal must already hold the BGRA8 palette, and SrcTilePalIdx
+//! may already be TilePalIdx (when taken from the cache)
+static void QualetizeCtx_StoreOutput(
+    const struct BmpCtx_t *Ctx,
+    const int32_t *SrcTilePalIdx,
+    int      nTilesX,
+    int      nTilesY,
+    uint8_t *DstPxIdx,
+    uint8_t *DstPal,
+    int32_t *TilePalIdx,
+    int      nColours,
+    int      OutputPaletteIs24bitRGB
+)
+{
+    //! Store tile palette indices
+    if(TilePalIdx && TilePalIdx != SrcTilePalIdx)
+    {
+        int i;
+        int32_t *Dst = TilePalIdx;
+        const int32_t *Src = SrcTilePalIdx;
+        for(i=0; i<nTilesX*nTilesY; i++) *Dst++ = *Src++;
+    }
+
+    //! Output is always processed bottom-up, so flip it to match the input
+    if(Ctx->Layout & BMPCTX_TOPDOWN)
+    {
+        FlipRows(DstPxIdx, Ctx->Width, Ctx->Height);
+        if(TilePalIdx) FlipRows(TilePalIdx, nTilesX*sizeof(int32_t), nTilesY);
+    }
+
+    //! Convert palette to RRGGBB if needed
+    //! NOTE: Pointer aliasing, but target format is smaller than the source
+    if(OutputPaletteIs24bitRGB)
+    {
+        uint8_t *Dst = DstPal;
+        const struct BGRA8_t *Src = (const struct BGRA8_t*)DstPal;
+        if(nColours) do
+            {
+                struct BGRA8_t x = *Src++;
+                *Dst++ = x.r;
+                *Dst++ = x.g;
+                *Dst++ = x.b;
+            }
+            while(--nColours);
+    }
+}
+
+//! Get the cache key of a result
+static struct CacheKey_t QualetizeCtx_GetCacheKey(
+    const struct CacheKey_t *ImageKey,
+    const struct QuantCtrl_t *Ctrl,
+    const uint8_t *SrcTilePal,
+    int      nUnusedColoursPerPalette,
+    int      nPalettes,
+    int      nColoursPerPalette,
+    int      TileW,
+    int      TileH,
+    int      nTileClusterPasses,
+    int      nColourClusterPasses,
+    const uint8_t BitRange[4],
+    int           DitherMode,
+    float         DitherLevel
+)
+{
+    struct CacheParams_t Params =
+    {
+        .nPalettes          = nPalettes,
+        .nColoursPerPalette = nColoursPerPalette,
+        .nUnusedColoursPerPalette = nUnusedColoursPerPalette,
+        .TileW              = TileW,
+        .TileH              = TileH,
+        .nTileClusterPasses   = nTileClusterPasses,
+        .nColourClusterPasses = nColourClusterPasses,
+        .BitRange           = *(const struct BGRA8_t*)BitRange,
+        .DitherMode         = DitherMode,
+        .DitherLevel        = DitherLevel,
+    };
+    return Cache_GetKey(ImageKey, &Params, Ctrl, (const struct BGRA8_t*)SrcTilePal);
+}
+
+/**************************************/
+
+//! Process an image into the context's arena
+//! Passing SrcTilePal != NULL remaps to those palettes instead of quantizing
+static int QualetizeCtx_Process(
+    struct QualetizeCtx_t *QCtx,
+
+    //! Image specification
+    int ImgWidth,
+    int ImgHeight,
+    const uint8_t *SrcPxData,
+    const uint8_t *SrcPxPal,
+    uint8_t *DstPxIdx,
+    uint8_t *DstPal,
+    const uint8_t *SrcTilePal,
+    int      nUnusedColoursPerPalette,
+    int      OutputPaletteIs24bitRGB,
+
+    //! Quantization control
+    int      nPalettes,
+    int      nColoursPerPalette,
+    int      TileW,
+    int      TileH,
+    int32_t *TilePalIdx,
+    int      nTileClusterPasses,
+    int      nColourClusterPasses,
+    const uint8_t BitRange[4],
+    int           DitherMode,
+    float         DitherLevel
+)
+{
+    unsigned int CancelTicket = QualetizeCtx_GetCancelTicket(QCtx);
+
+    //! Check palette will fit into the output, and that the
+    //! image is made of whole tiles
+    QCtx->Session.TilesData = NULL;
+    if(nPalettes*nColoursPerPalette > BMP_PALETTE_COLOURS) return 0;
+    if(TileW <= 0 || TileH <= 0 || ImgWidth%TileW || ImgHeight%TileH) return 0;
+
+    //! Create image context
+    //! NOTE: 'const' violations in image data, but not modified so this is safe
+    struct BmpCtx_t Ctx;
+    Ctx.Width  = ImgWidth;
+    Ctx.Height = ImgHeight;
+    Ctx.Stride = QCtx->InputStride;
+    Ctx.Layout = QCtx->InputLayout;
+    Ctx.ColPal = (struct BGRA8_t*)SrcPxPal;
+    if(SrcPxPal) Ctx.PxIdx = (       uint8_t*)SrcPxData;
+    else         Ctx.PxBGR = (struct BGRA8_t*)SrcPxData;
+
+    //! Setup progress reporting and cancellation
+    struct QuantCtrl_t Ctrl = QualetizeCtx_GetCtrl(QCtx, CancelTicket);
+    double StartTime = QuantStats_GetTime();
+    QuantStats_Clear(&QCtx->Stats);
+
+    //! Take the result from the cache if possible
+    //! NOTE: Results under a time budget are not cached (see cache.h)
+    int nTilesX  = ImgWidth  / TileW;
+    int nTilesY  = ImgHeight / TileH;
+    int UseCache = QCtx->CacheDir && !QCtx->TimeBudget;
+    struct CacheKey_t Key = {{0,0}};
+    struct CacheEntry_t Entry =
+    {
+        .Width      = ImgWidth,
+        .Height     = ImgHeight,
+        .nTiles     = nTilesX*nTilesY,
+        .nColours   = nPalettes*nColoursPerPalette,
+        .PxIdx      = DstPxIdx,
+        .Palette    = (struct BGRA8_t*)DstPal,
+        .TilePalIdx = TilePalIdx,
+    };
+    if(UseCache)
+    {
+        struct CacheKey_t ImageKey = Cache_GetImageKey(&Ctx);
+        Key = QualetizeCtx_GetCacheKey(
+            &ImageKey, &Ctrl, SrcTilePal, nUnusedColoursPerPalette,
+            nPalettes, nColoursPerPalette, TileW, TileH, nTileClusterPasses, nColourClusterPasses,
+            BitRange, DitherMode, DitherLevel
+        );
+        if(Cache_Load(QCtx->CacheDir, &Key, &Entry))
+        {
+            QCtx->OutOfTime  = 0;
+            QualetizeCtx_StoreOutput(&Ctx, TilePalIdx, nTilesX, nTilesY, DstPxIdx, DstPal, TilePalIdx, nPalettes*nColoursPerPalette, OutputPaletteIs24bitRGB);
+            return 1;
+        }
+    }
+
+    //! Grow the arena if needed
+    size_t ArenaSize = TilesData_GetAllocSize(ImgWidth, ImgHeight, TileW, TileH);
+    if(ArenaSize > QCtx->ArenaSize)
+    {
+        void *Arena = realloc(QCtx->Arena, ArenaSize);
+        if(!Arena) return 0;
+        QCtx->Arena     = Arena;
+        QCtx->ArenaSize = ArenaSize;
+    }
+
+    //! Do processing
+    //! NOTE: Do NOT allow image replacing, or things will go
+    //! very wrong when Qualetize() tries to free the pointers.
+    QuantCtrl_BeginStage(&Ctrl, QUANTSTAGE_CONVERT);
+    struct TilesData_t *TilesData = TilesData_FromBitmapIntoBuffer(QCtx->Arena, &Ctx, TileW, TileH, (const struct BGRA8_t*)BitRange, DitherMode, DitherLevel);
+    QuantCtrl_EndStage(&Ctrl);
+    QuantCtrl_SetTimeBudget(&Ctrl, QCtx->TimeBudget, StartTime);
+    struct BGRAf_t RMSE;
+    if(SrcTilePal) RMSE = QualetizeWithPalette(
+            &Ctx, TilesData,
+            DstPxIdx,
+            (struct BGRAf_t*)DstPal,
+            (const struct BGRA8_t*)SrcTilePal,
+            nPalettes,
+            nColoursPerPalette,
+            nUnusedColoursPerPalette,
+            (const struct BGRA8_t*)BitRange,
+            DitherMode,
+            DitherLevel,
+            0,
+            &Ctrl
+        );
+    else RMSE = Qualetize(
+            &Ctx, TilesData,
+            DstPxIdx,
+            (struct BGRAf_t*)DstPal,
+            nPalettes,
+            nColoursPerPalette,
+            nUnusedColoursPerPalette,
+            nTileClusterPasses,
+            nColourClusterPasses,
+            (const struct BGRA8_t*)BitRange,
+            DitherMode,
+            DitherLevel,
+            0,
+            &Ctrl
+        );
+    QCtx->OutOfTime = Ctrl.OutOfTime;
+    if(Ctrl.Cancelled) return -1;
+
+    //! Keep the results of quantizing for QualetizeCtx_UpdateTiles()
+    //! NOTE: The stored BGRA8 palette is already range-reduced, so
+    //! reducing it again recovers the palette exactly.
+    if(!SrcTilePal)
+    {
+        int i;
+        const struct BGRA8_t *Pal = (const struct BGRA8_t*)DstPal;
+        for(i=0; i<nPalettes*nColoursPerPalette; i++)
+        {
+            struct BGRAf_t p = BGRAf_FromBGRA8(&Pal[i]);
+            struct BGRA8_t p2 = BGRA_FromBGRAf(&p, (const struct BGRA8_t*)BitRange);
+            QCtx->Session.Palette[i] = BGRAf_FromBGRA(&p2, (const struct BGRA8_t*)BitRange);
+        }
+        QCtx->Session.TilesData          = TilesData;
+        QCtx->Session.Width              = ImgWidth;
+        QCtx->Session.Height             = ImgHeight;
+        QCtx->Session.nPalettes          = nPalettes;
+        QCtx->Session.nColoursPerPalette = nColoursPerPalette;
+        QCtx->Session.nUnusedColoursPerPalette = nUnusedColoursPerPalette;
+        QCtx->Session.nColourClusterPasses     = nColourClusterPasses;
+        QCtx->Session.OutputPaletteIs24bitRGB  = OutputPaletteIs24bitRGB;
+        QCtx->Session.BitRange           = *(const struct BGRA8_t*)BitRange;
+        QCtx->Session.DitherMode         = DitherMode;
+        QCtx->Session.DitherLevel        = DitherLevel;
+    }
+
+    //! Store the result to the cache
+    //! NOTE: Failing to store only loses the speedup next time
+    if(UseCache)
+    {
+        Entry.RMSE          = RMSE;
+        Entry.TargetReached = Ctrl.TargetReached;
+        Entry.TilePalIdx    = TilesData->TilePalIdx;
+        (void)Cache_Store(QCtx->CacheDir, &Key, &Entry);
+    }
+
+    //! Store outputs
+    QualetizeCtx_StoreOutput(&Ctx, TilesData->TilePalIdx, nTilesX, nTilesY, DstPxIdx, DstPal, TilePalIdx, nPalettes*nColoursPerPalette, OutputPaletteIs24bitRGB);
+
+    //! All done
+    return 1;
+}
+
+/**************************************/
+
 //! Pointer arguments:
 //!  For BGRA images:
 //!   SrcPxData = (struct BGRA8_t)[Width*Height]
@@ -26,7 +644,13 @@
 //! OutputPaletteIs24bitRGB outputs RGB (byte order: {RR, GG, BB})
 //! colours without an alpha channel; the default is to output to
 //! BGRA (byte order: {BB, GG, RR, AA}).
-DECLSPEC int QualetizeFromRawImage(
+//! Returns 1 on success, 0 on failure, or -1 when cancelled.
+//! NOTE: Width and Height must be multiples of TileW and TileH.
+//! NOTE: The context's arena is only re-allocated when the image
+//! needs more memory than any image previously processed with it.
+DECLSPEC int QualetizeCtx_Quantize(
+    struct QualetizeCtx_t *QCtx,
+
     //! Image specification
     int ImgWidth,
     int ImgHeight,
@@ -50,64 +674,597 @@ DECLSPEC int QualetizeFromRawImage(
     float         DitherLevel
 )
 {
+    return QualetizeCtx_Process(
+        QCtx,
+        ImgWidth,
+        ImgHeight,
+        SrcPxData,
+        SrcPxPal,
+        DstPxIdx,
+        DstPal,
+        NULL,
+        nUnusedColoursPerPalette,
+        OutputPaletteIs24bitRGB,
+        nPalettes,
+        nColoursPerPalette,
+        TileW,
+        TileH,
+        TilePalIdx,
+        nTileClusterPasses,
+        nColourClusterPasses,
+        BitRange,
+        DitherMode,
+        DitherLevel
+    );
+}
+
+/**************************************/
+
+//! Remap an image onto existing palettes, without any clustering
+//! Arguments are the same as QualetizeCtx_Quantize(), except:
+//!   SrcTilePal = (struct BGRA8_t)[nPalettes * nColoursPerPalette]
+//!    NOTE: SrcTilePal must not overlap DstPal.
+//! Each tile is assigned to the palette that remaps it with the least
+//! error, and the (range-reduced) palettes are returned in DstPal.
+DECLSPEC int QualetizeCtx_Remap(
+    struct QualetizeCtx_t *QCtx,
+
+    //! Image specification
+    int ImgWidth,
+    int ImgHeight,
+    const uint8_t *SrcPxData,
+    const uint8_t *SrcPxPal,
+    uint8_t *DstPxIdx,
+    uint8_t *DstPal,
+    const uint8_t *SrcTilePal,
+    int      nUnusedColoursPerPalette,
+    int      OutputPaletteIs24bitRGB,
+
+    //! Quantization control
+    int      nPalettes,
+    int      nColoursPerPalette,
+    int      TileW,
+    int      TileH,
+    int32_t *TilePalIdx,
+    const uint8_t BitRange[4],
+    int           DitherMode,
+    float         DitherLevel
+)
+{
+    return QualetizeCtx_Process(
+        QCtx,
+        ImgWidth,
+        ImgHeight,
+        SrcPxData,
+        SrcPxPal,
+        DstPxIdx,
+        DstPal,
+        SrcTilePal,
+        nUnusedColoursPerPalette,
+        OutputPaletteIs24bitRGB,
+        nPalettes,
+        nColoursPerPalette,
+        TileW,
+        TileH,
+        TilePalIdx,
+        0,
+        0,
+        BitRange,
+        DitherMode,
+        DitherLevel
+    );
+}
+
+/**************************************/
+
+//! Quantize an image with every combination of lists of settings
+//! Arguments are the same as QualetizeCtx_Quantize(), except:
+//!   nPalettes          = int[nPalettesCount]
+//!   nColoursPerPalette = int[nColoursCount]
+//!   BitRange           = uint8_t[nBitRangeCount][4]
+//!   DitherMode         = int[nDitherCount]
+//!   DitherLevel        = float[nDitherCount]
+//! and the outputs hold one entry for each combination:
+//!   DstPxIdx   = uint8_t[nCombinations][Width*Height]
+//!   DstPal     = (struct BGRA8_t)[nCombinations][256]
+//!   TilePalIdx = NULL or int32_t[nCombinations][(Width*Height) / (TileW*TileH)]
+//!   RMSE       = NULL or float[nCombinations][4] (B,G,R,A; relative to a peak of 1.0)
+//! nCombinations is the product of the counts, and combinations are
+//! ordered by BitRange, then dither, then nPalettes, then (varying
+//! fastest) nColoursPerPalette. Each combination gives the same output
+//! as QualetizeCtx_Quantize() would, but the image is only converted
+//! to tiles once for each BitRange and dither setting, and the tiles
+//! are only clustered once for each number of palettes. Numbers of
+//! palettes that are powers of two (eg. {1,2,4,8,16}) share a single
+//! tile clustering, as splitting passes through each of them.
+//! The time budget applies to each combination, and statistics cover
+//! the whole call. With a cache directory set, each combination is
+//! looked up and stored on its own (see QualetizeCtx_SetCacheDir()).
+//! Returns 1 on success, 0 on failure, or -1 when cancelled.
+DECLSPEC int QualetizeCtx_Sweep(
+    struct QualetizeCtx_t *QCtx,
+
+    //! Image specification
+    int ImgWidth,
+    int ImgHeight,
+    const uint8_t *SrcPxData,
+    const uint8_t *SrcPxPal,
+    uint8_t *DstPxIdx,
+    uint8_t *DstPal,
+    float   *RMSE,
+    int      nUnusedColoursPerPalette,
+    int      OutputPaletteIs24bitRGB,
+
+    //! Quantization control
+    int        nPalettesCount,
+    const int *nPalettes,
+    int        nColoursCount,
+    const int *nColoursPerPalette,
+    int      TileW,
+    int      TileH,
+    int32_t *TilePalIdx,
+    int      nTileClusterPasses,
+    int      nColourClusterPasses,
+    int           nBitRangeCount,
+    const uint8_t (*BitRange)[4],
+    int           nDitherCount,
+    const int    *DitherMode,
+    const float  *DitherLevel
+)
+{
+    int i, j, k, l;
+    unsigned int CancelTicket = QualetizeCtx_GetCancelTicket(QCtx);
+
+    //! Check palettes will fit into the output, and that the
+    //! image is made of whole tiles
+    QCtx->Session.TilesData = NULL;
+    if(TileW <= 0 || TileH <= 0 || ImgWidth%TileW || ImgHeight%TileH) return 0;
+    for(i=0; i<nPalettesCount; i++) for(j=0; j<nColoursCount; j++)
+        {
+            if(nPalettes[i]*nColoursPerPalette[j] > BMP_PALETTE_COLOURS) return 0;
+        }
+
     //! Create image context
     //! NOTE: 'const' violations in image data, but not modified so this is safe
     struct BmpCtx_t Ctx;
     Ctx.Width  = ImgWidth;
     Ctx.Height = ImgHeight;
+    Ctx.Stride = QCtx->InputStride;
+    Ctx.Layout = QCtx->InputLayout;
     Ctx.ColPal = (struct BGRA8_t*)SrcPxPal;
     if(SrcPxPal) Ctx.PxIdx = (       uint8_t*)SrcPxData;
     else         Ctx.PxBGR = (struct BGRA8_t*)SrcPxData;
 
-    //! Do processing
-    //! NOTE: Do NOT allow image replacing, or things will go
-    //! very wrong when Qualetize() tries to free the pointers.
-    struct TilesData_t *TilesData = TilesData_FromBitmap(&Ctx, TileW, TileH, (const struct BGRA8_t*)BitRange, DitherMode, DitherLevel);
+    //! Grow the arena if needed
+    size_t ArenaSize = TilesData_GetAllocSize(ImgWidth, ImgHeight, TileW, TileH);
+    if(ArenaSize > QCtx->ArenaSize)
+    {
+        void *Arena = realloc(QCtx->Arena, ArenaSize);
+        if(!Arena) return 0;
+        QCtx->Arena     = Arena;
+        QCtx->ArenaSize = ArenaSize;
+    }
+
+    //! With several numbers of palettes, tiles are clustered for the
+    //! largest number, keeping the result at each level along the way
+    //! (see TilesData_ClusterTileLadder()), except under a time budget
+    //! NOTE: Failing to allocate memory for this only loses the speedup.
+    int nTiles = (ImgWidth/TileW) * (ImgHeight/TileH);
+    int LadderTop = 0;
+    int nLadderLevels = 0;
+    int LadderPals[TILESDATA_MAX_LADDER];
+    int32_t *LadderIdx = NULL;
+    if(nPalettesCount > 1 && !QCtx->TimeBudget)
+    {
+        for(k=0; k<nPalettesCount; k++) if(nPalettes[k] > LadderTop) LadderTop = nPalettes[k];
+        LadderIdx = malloc(TILESDATA_MAX_LADDER * nTiles * sizeof(int32_t));
+    }
+
+    //! Get the key of the image for the result cache
+    //! NOTE: Results under a time budget are not cached (see cache.h)
+    int UseCache = QCtx->CacheDir && !QCtx->TimeBudget;
+    struct CacheKey_t ImageKey = {{0,0}};
+    if(UseCache) ImageKey = Cache_GetImageKey(&Ctx);
+
+    //! Process all combinations
+    //! NOTE: The tile data keeps its tile clustering for re-use
+    //! with the other palette sizes (see TilesData_t). It is only
+    //! converted once a combination is not found in the cache.
+    size_t Combination = 0;
+    QuantStats_Clear(&QCtx->Stats);
+    QCtx->OutOfTime = 0;
+    for(i=0; i<nBitRangeCount; i++) for(j=0; j<nDitherCount; j++)
+        {
+            struct TilesData_t *TilesData = NULL;
+            for(k=0; k<nPalettesCount; k++) for(l=0; l<nColoursCount; l++)
+                {
+                    uint8_t *PxIdx   = DstPxIdx + Combination*ImgWidth*ImgHeight;
+                    uint8_t *Pal     = DstPal   + Combination*BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t);
+                    int32_t *TileIdx = TilePalIdx ? (TilePalIdx + Combination*nTiles) : NULL;
+                    struct QuantCtrl_t Ctrl = QualetizeCtx_GetCtrl(QCtx, CancelTicket);
+                    struct BGRAf_t Error;
+
+                    //! Take the result from the cache if possible
+                    //! NOTE: Palette entries past the output colours are left clear
+                    struct CacheKey_t Key = {{0,0}};
+                    struct CacheEntry_t Entry =
+                    {
+                        .Width      = ImgWidth,
+                        .Height     = ImgHeight,
+                        .nTiles     = nTiles,
+                        .nColours   = nPalettes[k]*nColoursPerPalette[l],
+                        .PxIdx      = PxIdx,
+                        .Palette    = (struct BGRA8_t*)Pal,
+                        .TilePalIdx = TileIdx,
+                    };
+                    int Cached = 0;
+                    if(UseCache)
+                    {
+                        Key = QualetizeCtx_GetCacheKey(
+                            &ImageKey, &Ctrl, NULL, nUnusedColoursPerPalette,
+                            nPalettes[k], nColoursPerPalette[l], TileW, TileH, nTileClusterPasses, nColourClusterPasses,
+                            BitRange[i], DitherMode[j], DitherLevel[j]
+                        );
+                        memset(Pal, 0, BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t));
+                        Cached = Cache_Load(QCtx->CacheDir, &Key, &Entry);
+                    }
+                    if(Cached) Error = Entry.RMSE;
+                    else
+                    {
+                        //! Convert to tiles if not yet done
+                        if(!TilesData)
+                        {
+                            QuantCtrl_BeginStage(&Ctrl, QUANTSTAGE_CONVERT);
+                            TilesData = TilesData_FromBitmapIntoBuffer(QCtx->Arena, &Ctx, TileW, TileH, (const struct BGRA8_t*)BitRange[i], DitherMode[j], DitherLevel[j]);
+                            QuantCtrl_EndStage(&Ctrl);
+                            nLadderLevels = 0;
+                            if(LadderIdx)
+                            {
+                                nLadderLevels = TilesData_ClusterTileLadder(TilesData, LadderIdx, LadderPals, LadderTop, nTileClusterPasses, &Ctrl);
+                                if(Ctrl.Cancelled)
+                                {
+                                    free(LadderIdx);
+                                    return -1;
+                                }
+                            }
+                        }
+
+                        //! Take the tile clustering from the ladder if possible
+                        int Level;
+                        for(Level=0; Level<nLadderLevels; Level++) if(LadderPals[Level] == nPalettes[k])
+                            {
+                                TilesData_SetTileClusters(TilesData, LadderIdx + Level*nTiles, nPalettes[k], nTileClusterPasses);
+                            }
+
+                        //! Quantize into a palette of the largest size, as this
+                        //! is needed by Qualetize() before storing as BGRA8
+                        struct BGRAf_t Palette[BMP_PALETTE_COLOURS] = {{0,0,0,0}};
+                        Ctrl = QualetizeCtx_GetCtrl(QCtx, CancelTicket);
+                        QuantCtrl_SetTimeBudget(&Ctrl, QCtx->TimeBudget, QuantStats_GetTime());
+                        Error = Qualetize(
+                            &Ctx, TilesData,
+                            PxIdx,
+                            Palette,
+                            nPalettes[k],
+                            nColoursPerPalette[l],
+                            nUnusedColoursPerPalette,
+                            nTileClusterPasses,
+                            nColourClusterPasses,
+                            (const struct BGRA8_t*)BitRange[i],
+                            DitherMode[j],
+                            DitherLevel[j],
+                            0,
+                            &Ctrl
+                        );
+                        if(Ctrl.OutOfTime) QCtx->OutOfTime = 1;
+                        if(Ctrl.Cancelled)
+                        {
+                            free(LadderIdx);
+                            return -1;
+                        }
+                        memcpy(Pal, Palette, BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t));
+
+                        //! Store the result to the cache
+                        if(UseCache)
+                        {
+                            Entry.RMSE          = Error;
+                            Entry.TargetReached = Ctrl.TargetReached;
+                            Entry.TilePalIdx    = TilesData->TilePalIdx;
+                            (void)Cache_Store(QCtx->CacheDir, &Key, &Entry);
+                        }
+                    }
+
+                    //! Store outputs
+                    QualetizeCtx_StoreOutput(
+                        &Ctx,
+                        Cached ? TileIdx : TilesData->TilePalIdx,
+                        ImgWidth/TileW,
+                        ImgHeight/TileH,
+                        PxIdx,
+                        Pal,
+                        TileIdx,
+                        nPalettes[k]*nColoursPerPalette[l],
+                        OutputPaletteIs24bitRGB
+                    );
+                    if(RMSE)
+                    {
+                        float *Dst = RMSE + Combination*4;
+                        Dst[0] = Error.b, Dst[1] = Error.g, Dst[2] = Error.r, Dst[3] = Error.a;
+                    }
+                    Combination++;
+                }
+        }
+
+    //! All done
+    free(LadderIdx);
+    return 1;
+}
+
+/**************************************/
+
+//! Update the last quantized image after some of its pixels changed
+//! This follows a successful QualetizeCtx_Quantize() call (with the same
+//! context and input layout), and re-uses all of its settings:
+//!   SrcPxData, SrcPxPal = The whole changed image
+//!   DstPxIdx, DstPal    = The outputs of the last call (or of the last
+//!                         update), which are updated in place
+//!   TilePalIdx          = NULL or int32_t[(Width*Height) / (TileW*TileH)]
+//!   Rects               = int32_t[nRects][4] rectangles of changed pixels,
+//!                         as {x, y, Width, Height} in the input's row order
+//! Only the changed tiles are converted again and moved between the
+//! existing palettes; only the palettes that gained or lost tiles, or
+//! that no longer suit their changed tiles, are re-quantized (starting
+//! from their current colours); and only the tiles that changed, or
+//! whose palette changed, are remapped. This keeps edits in an editor
+//! interactive, at the cost of drifting from what a full call would
+//! give; call QualetizeCtx_Quantize() again to start afresh.
+//! NOTE: Floyd-Steinberg dithering is applied to each remapped tile on
+//! its own, so it may show seams against the tiles around it.
+//! Returns 1 on success, 0 on failure (eg. no previous call, or a
+//! rectangle with a negative size), or -1 when cancelled (after which
+//! the outputs must be produced afresh).
+DECLSPEC int QualetizeCtx_UpdateTiles(
+    struct QualetizeCtx_t *QCtx,
+    const uint8_t *SrcPxData,
+    const uint8_t *SrcPxPal,
+    uint8_t *DstPxIdx,
+    uint8_t *DstPal,
+    int32_t *TilePalIdx,
+    int      nRects,
+    const int32_t *Rects
+)
+{
+    int i, tx, ty;
+    unsigned int CancelTicket = QualetizeCtx_GetCancelTicket(QCtx);
+    struct TilesData_t *TilesData = QCtx->Session.TilesData;
     if(!TilesData) return 0;
-    (void)Qualetize(
+
+    //! Create image context
+    //! NOTE: 'const' violations in image data, but not modified so this is safe
+    struct BmpCtx_t Ctx;
+    Ctx.Width  = QCtx->Session.Width;
+    Ctx.Height = QCtx->Session.Height;
+    Ctx.Stride = QCtx->InputStride;
+    Ctx.Layout = QCtx->InputLayout;
+    Ctx.ColPal = (struct BGRA8_t*)SrcPxPal;
+    if(SrcPxPal) Ctx.PxIdx = (       uint8_t*)SrcPxData;
+    else         Ctx.PxBGR = (struct BGRA8_t*)SrcPxData;
+
+    //! Mark the tiles touched by the rectangles
+    //! NOTE: Tiles are counted from the bottom row up
+    int TileW  = TilesData->TileW;
+    int TileH  = TilesData->TileH;
+    int nTiles = TilesData->TilesX * TilesData->TilesY;
+    uint8_t *TileDirty = calloc(nTiles, sizeof(uint8_t));
+    if(!TileDirty) return 0;
+    //! NOTE: Rectangles are clipped to the tile grid. Rectangles with
+    //! a negative size, or whose ends would overflow, are rejected.
+    int GridW = TilesData->TilesX * TileW;
+    int GridH = TilesData->TilesY * TileH;
+    for(i=0; i<nRects; i++)
+    {
+        int32_t RectX = Rects[i*4+0], RectW = Rects[i*4+2];
+        int32_t RectY = Rects[i*4+1], RectH = Rects[i*4+3];
+        if(RectW < 0 || RectH < 0 || RectX > INT32_MAX - RectW || RectY > INT32_MAX - RectH)
+        {
+            free(TileDirty);
+            return 0;
+        }
+        int x0 = RectX, x1 = RectX + RectW;
+        int y0 = RectY, y1 = RectY + RectH;
+        if(Ctx.Layout & BMPCTX_TOPDOWN)
+        {
+            //! NOTE: Clip before flipping, so that this can't overflow
+            if(y0 < 0) y0 = 0;
+            if(y1 > Ctx.Height) y1 = Ctx.Height;
+            int t = Ctx.Height - y0;
+            y0 = Ctx.Height - y1, y1 = t;
+        }
+        if(x0 < 0) x0 = 0;
+        if(y0 < 0) y0 = 0;
+        if(x1 > GridW) x1 = GridW;
+        if(y1 > GridH) y1 = GridH;
+        for(ty=y0/TileH; ty*TileH<y1; ty++) for(tx=x0/TileW; tx*TileW<x1; tx++)
+            {
+                TileDirty[ty*TilesData->TilesX + tx] = 1;
+            }
+    }
+
+    //! Setup progress reporting and cancellation
+    struct QuantCtrl_t Ctrl = QualetizeCtx_GetCtrl(QCtx, CancelTicket);
+    QuantStats_Clear(&QCtx->Stats);
+    QCtx->OutOfTime = 0;
+
+    //! Re-convert the changed tiles, and update the results
+    //! NOTE: Output rows are in the input's order, so walk them
+    //! backwards from the last row for top-down images
+    int PxStride = Ctx.Width;
+    uint8_t *PxData = DstPxIdx;
+    if(Ctx.Layout & BMPCTX_TOPDOWN)
+    {
+        PxData  += (size_t)(Ctx.Height-1) * Ctx.Width;
+        PxStride = -PxStride;
+    }
+    QuantCtrl_BeginStage(&Ctrl, QUANTSTAGE_CONVERT);
+    TilesData_UpdateTiles(TilesData, &Ctx, TileDirty, &QCtx->Session.BitRange, QCtx->Session.DitherMode, QCtx->Session.DitherLevel);
+    QuantCtrl_EndStage(&Ctrl);
+    int Ok = QualetizeUpdate(
         &Ctx, TilesData,
+        PxData,
+        PxStride,
+        QCtx->Session.Palette,
+        QCtx->Session.nPalettes,
+        QCtx->Session.nColoursPerPalette,
+        QCtx->Session.nUnusedColoursPerPalette,
+        QCtx->Session.nColourClusterPasses,
+        &QCtx->Session.BitRange,
+        QCtx->Session.DitherMode,
+        QCtx->Session.DitherLevel,
+        TileDirty,
+        &Ctrl
+    );
+    free(TileDirty);
+    if(!Ok)
+    {
+        QCtx->Session.TilesData = NULL;
+        return Ctrl.Cancelled ? -1 : 0;
+    }
+
+    //! Store the palette
+    int nColours = QCtx->Session.nPalettes * QCtx->Session.nColoursPerPalette;
+    for(i=0; i<nColours; i++)
+    {
+        struct BGRA8_t p = BGRA8_FromBGRAf(&QCtx->Session.Palette[i]);
+        if(QCtx->Session.OutputPaletteIs24bitRGB)
+        {
+            DstPal[i*3+0] = p.r;
+            DstPal[i*3+1] = p.g;
+            DstPal[i*3+2] = p.b;
+        }
+        else ((struct BGRA8_t*)DstPal)[i] = p;
+    }
+
+    //! Store tile palette indices in the input's row order
+    if(TilePalIdx) for(ty=0; ty<TilesData->TilesY; ty++)
+        {
+            int DstRow = (Ctx.Layout & BMPCTX_TOPDOWN) ? (TilesData->TilesY-1 - ty) : ty;
+            memcpy(
+                TilePalIdx + DstRow*TilesData->TilesX,
+                TilesData->TilePalIdx + ty*TilesData->TilesX,
+                TilesData->TilesX*sizeof(int32_t)
+            );
+        }
+
+    //! All done
+    return 1;
+}
+
+/**************************************/
+
+//! One-shot conversion; see QualetizeCtx_Quantize() for arguments
+DECLSPEC int QualetizeFromRawImage(
+    //! Image specification
+    int ImgWidth,
+    int ImgHeight,
+    const uint8_t *SrcPxData,
+    const uint8_t *SrcPxPal,
+    uint8_t *DstPxIdx,
+    uint8_t *DstPal,
+    int      nUnusedColoursPerPalette,
+    int      OutputPaletteIs24bitRGB,
+
+    //! Quantization control
+    int      nPalettes,
+    int      nColoursPerPalette,
+    int      TileW,
+    int      TileH,
+    int32_t *TilePalIdx,
+    int      nTileClusterPasses,
+    int      nColourClusterPasses,
+    const uint8_t BitRange[4],
+    int           DitherMode,
+    float         DitherLevel
+)
+{
+    //! Use a temporary context, destroying its arena after use
+    struct QualetizeCtx_t QCtx = {.Arena = NULL};
+    int Result = QualetizeCtx_Quantize(
+        &QCtx,
+        ImgWidth,
+        ImgHeight,
+        SrcPxData,
+        SrcPxPal,
         DstPxIdx,
-        (struct BGRAf_t*)DstPal,
+        DstPal,
+        nUnusedColoursPerPalette,
+        OutputPaletteIs24bitRGB,
         nPalettes,
         nColoursPerPalette,
-        nUnusedColoursPerPalette,
+        TileW,
+        TileH,
+        TilePalIdx,
         nTileClusterPasses,
         nColourClusterPasses,
-        (const struct BGRA8_t*)BitRange,
+        BitRange,
         DitherMode,
-        DitherLevel,
-        0
+        DitherLevel
     );
+    free(QCtx.Arena);
+    return Result;
+}
 
-    //! Store tile palette indices
-    if(TilePalIdx)
-    {
-        int i;
-        int32_t *Dst = TilePalIdx;
-        const int32_t *Src = TilesData->TilePalIdx;
-        for(i=0; i<(ImgWidth*ImgHeight)/(TileW*TileH); i++) *Dst++ = *Src++;
-    }
+/**************************************/
 
-    //! Convert palette to RRGGBB if needed
-    //! NOTE: Pointer aliasing, but target format is smaller than the source
-    if(OutputPaletteIs24bitRGB)
-    {
-        int nCol = nPalettes * nColoursPerPalette;
-        uint8_t *Dst = DstPal;
-        const struct BGRA8_t *Src = (const struct BGRA8_t*)DstPal;
-        if(nCol) do
-            {
-                struct BGRA8_t x = *Src++;
-                *Dst++ = x.r;
-                *Dst++ = x.g;
-                *Dst++ = x.b;
-            }
-            while(--nCol);
-    }
+//! One-shot remap; see QualetizeCtx_Remap() for arguments
+DECLSPEC int QualetizeFromRawImageWithPalette(
+    //! Image specification
+    int ImgWidth,
+    int ImgHeight,
+    const uint8_t *SrcPxData,
+    const uint8_t *SrcPxPal,
+    uint8_t *DstPxIdx,
+    uint8_t *DstPal,
+    const uint8_t *SrcTilePal,
+    int      nUnusedColoursPerPalette,
+    int      OutputPaletteIs24bitRGB,
 
-    //! Destroy tiling context, and all done
-    free(TilesData);
-    return 1;
+    //! Quantization control
+    int      nPalettes,
+    int      nColoursPerPalette,
+    int      TileW,
+    int      TileH,
+    int32_t *TilePalIdx,
+    const uint8_t BitRange[4],
+    int           DitherMode,
+    float         DitherLevel
+)
+{
+    //! Use a temporary context, destroying its arena after use
+    struct QualetizeCtx_t QCtx = {.Arena = NULL};
+    int Result = QualetizeCtx_Process(
+        &QCtx,
+        ImgWidth,
+        ImgHeight,
+        SrcPxData,
+        SrcPxPal,
+        DstPxIdx,
+        DstPal,
+        SrcTilePal,
+        nUnusedColoursPerPalette,
+        OutputPaletteIs24bitRGB,
+        nPalettes,
+        nColoursPerPalette,
+        TileW,
+        TileH,
+        TilePalIdx,
+        0,
+        0,
+        BitRange,
+        DitherMode,
+        DitherLevel
+    );
+    free(QCtx.Arena);
+    return Result;
 }
 
 /**************************************/
@@ -1,24 +1,58 @@
 /**************************************/
+#include <math.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+/**************************************/
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <unistd.h>
+#endif
 /**************************************/
 #include "dither.h"
 #include "quantize.h"
+#include "simd.h"
 #include "tiles.h"
 /**************************************/
 
 #define DEFAULT_TILECLUSTER_PASSES   16
 #define DEFAULT_COLOURCLUSTER_PASSES 16
 
+//! Fraction of the time budget that is kept back for dithering
+#define TIMEBUDGET_DITHER_SHARE 0.1
+
+//! When updating tiles, a palette is re-clustered once its changed
+//! tiles remap with this much more error (per pixel) than the others
+#define UPDATE_RECLUSTER_RATIO 2.0f
+
+//! Tile reassignment hands out tiles to its threads in batches of this
+//! many, and only starts another thread for each batch beyond the first
+#define REASSIGN_BATCH_TILES 64
+#define REASSIGN_MAX_THREADS 64
+
 /**************************************/
 #define ALIGN2N(x,N) (((x) + (N)-1) &~ ((N)-1))
 #define DATA_ALIGNMENT 32
 #define DATA_ALIGN(x) ALIGN2N((uintptr_t)(x), DATA_ALIGNMENT) //! NOTE: Cast to uintptr_t
 /**************************************/
+#ifdef __GNUC__
+# define TILES_INLINE static inline __attribute__((always_inline))
+# define TILES_UNROLL_(x) _Pragma(#x)
+# define TILES_UNROLL(n) TILES_UNROLL_(GCC unroll n)
+#else
+# define TILES_INLINE static inline
+# define TILES_UNROLL(n)
+#endif
+/**************************************/
 
 //! Fill out the tile data
-static inline void ConvertToTiles(
+//! NOTE: This is instantiated for common tile sizes below; with
+//! constant TileW/TileH, the pixel loops can be fully unrolled.
+TILES_INLINE void ConvertToTiles_Shape(
     struct TilesData_t *TilesData,
     const struct BGRAf_t *PxBGRA,
     int TileW,
@@ -35,13 +69,18 @@ static inline void ConvertToTiles(
         {
             //! Copy pixels as YUV, and get mean
             struct BGRAf_t Mean = {0,0,0,0};
-            for(py=0; py<TileH; py++) for(px=0; px<TileW; px++)
+            const struct BGRAf_t *Src = PxBGRA + (ty*TileH)*(nTileX*TileW) + tx*TileW;
+            for(py=0; py<TileH; py++)
+            {
+                TILES_UNROLL(16)
+                for(px=0; px<TileW; px++)
                 {
                     //! Convert and store pixel
-                    struct BGRAf_t Px = BGRAf_AsYUV(&PxBGRA[(ty*TileH+py)*(nTileX*TileW) + (tx*TileW+px)]);
+                    struct BGRAf_t Px = BGRAf_AsYUV(&Src[py*(nTileX*TileW) + px]);
                     *PxData++ = Px;
                     Mean = BGRAf_Add(&Mean, &Px);
                 }
+            }
 
             //! Now reduce luma importance slightly because otherwise we
             //! try too hard to optimize for that and forget about colour
@@ -53,6 +92,375 @@ static inline void ConvertToTiles(
             *TileValue++ = Mean;
         }
 }
+#define CONVERTTOTILES_DEFINE(W, H) \
+	static void ConvertToTiles_##W##x##H(struct TilesData_t *TilesData, const struct BGRAf_t *PxBGRA, int nTileX, int nTileY) { \
+		ConvertToTiles_Shape(TilesData, PxBGRA, W, H, nTileX, nTileY); \
+	}
+CONVERTTOTILES_DEFINE( 8,  8)
+CONVERTTOTILES_DEFINE(16, 16)
+#undef CONVERTTOTILES_DEFINE
+static void ConvertToTiles(
+    struct TilesData_t *TilesData,
+    const struct BGRAf_t *PxBGRA,
+    int TileW,
+    int TileH,
+    int nTileX,
+    int nTileY
+)
+{
+    if     (TileW ==  8 && TileH ==  8) ConvertToTiles_8x8  (TilesData, PxBGRA, nTileX, nTileY);
+    else if(TileW == 16 && TileH == 16) ConvertToTiles_16x16(TilesData, PxBGRA, nTileX, nTileY);
+    else ConvertToTiles_Shape(TilesData, PxBGRA, TileW, TileH, nTileX, nTileY);
+}
+
+/**************************************/
+
+//! Append the pixels of a tile to Dst, returning the new end
+//! NOTE: With SkipClear != 0, alpha=0 pixels are not appended. This
+//! is done without branching by always storing, but only advancing
+//! over pixels that are kept. Instantiated for common tile sizes.
+TILES_INLINE struct BGRAf_t *GatherTilePx_Shape(struct BGRAf_t *Dst, const struct BGRAf_t *Src, int nPxTile, int SkipClear)
+{
+    int k;
+    if(SkipClear)
+    {
+        TILES_UNROLL(16)
+        for(k=0; k<nPxTile; k++)
+        {
+            struct BGRAf_t x = Src[k];
+            *Dst = x;
+            Dst += (x.a != 0.0f);
+        }
+    }
+    else
+    {
+        TILES_UNROLL(16)
+        for(k=0; k<nPxTile; k++) *Dst++ = Src[k];
+    }
+    return Dst;
+}
+#define GATHERTILEPX_DEFINE(N) \
+	static struct BGRAf_t *GatherTilePx_##N(struct BGRAf_t *Dst, const struct BGRAf_t *Src, int SkipClear) { \
+		return GatherTilePx_Shape(Dst, Src, N, SkipClear); \
+	}
+GATHERTILEPX_DEFINE( 64) //! 8x8
+GATHERTILEPX_DEFINE(256) //! 16x16
+#undef GATHERTILEPX_DEFINE
+
+//! Gather the pixels of all tiles using a palette into TilesData->PxTemp
+//! Returns the number of pixels gathered, and stores the number of tiles
+//! to *nPalTiles.
+//! NOTE: Do not add alpha=0 pixels when SkipClear != 0, as this is a
+//! separate thing altogether when PalUnusedEntries != 0.
+static int GatherPalettePx(struct TilesData_t *TilesData, int PalIdx, int SkipClear, int *nPalTiles)
+{
+    int j, n = 0;
+    int nPxTile = TilesData->TileW  * TilesData->TileH;
+    int nTiles  = TilesData->TilesX * TilesData->TilesY;
+    struct BGRAf_t *Dst = TilesData->PxTemp;
+    for(j=0; j<nTiles; j++) if(TilesData->TilePalIdx[j] == PalIdx)
+        {
+            const struct BGRAf_t *Src = TilesData->TilePxPtr[j].PxBGRAf;
+            if     (nPxTile ==  64) Dst = GatherTilePx_64 (Dst, Src, SkipClear);
+            else if(nPxTile == 256) Dst = GatherTilePx_256(Dst, Src, SkipClear);
+            else Dst = GatherTilePx_Shape(Dst, Src, nPxTile, SkipClear);
+            n++;
+        }
+    *nPalTiles = n;
+    return Dst - TilesData->PxTemp;
+}
+
+/**************************************/
+
+//! Get the bounding box of n points
+static void GetBounds(const struct BGRAf_t *x, int n, struct BGRAf_t *Min, struct BGRAf_t *Max)
+{
+    int k;
+    *Min = (struct BGRAf_t){ INFINITY,  INFINITY,  INFINITY,  INFINITY};
+    *Max = (struct BGRAf_t){-INFINITY, -INFINITY, -INFINITY, -INFINITY};
+    for(k=0; k<n; k++)
+    {
+        Min->b = fminf(Min->b, x[k].b), Max->b = fmaxf(Max->b, x[k].b);
+        Min->g = fminf(Min->g, x[k].g), Max->g = fmaxf(Max->g, x[k].g);
+        Min->r = fminf(Min->r, x[k].r), Max->r = fmaxf(Max->r, x[k].r);
+        Min->a = fminf(Min->a, x[k].a), Max->a = fmaxf(Max->a, x[k].a);
+    }
+}
+
+//! Get the gap between two intervals (0 if they overlap)
+static inline float GetIntervalGap(float MinA, float MaxA, float MinB, float MaxB)
+{
+    return (MinA > MaxB) ? (MinA - MaxB) : (MinB > MaxA) ? (MinB - MaxA) : 0.0f;
+}
+
+//! Get the error of remapping a tile to a palette
+//! NOTE: Stops early (returning a partial sum) once the error reaches
+//! MaxErr, as the palette can then no longer be the best one.
+static float GetRemapError(const struct BGRAf_t *Px, int nPxTile, const struct BGRAf_t *Pal, int nEntries, float MaxErr, int64_t *nDistEvals)
+{
+    int k;
+    float Err = 0.0f;
+    for(k=0; k<nPxTile && Err < MaxErr; k++)
+    {
+        float MinDst;
+        Simd_NearestPaletteL2(&Px[k], Pal, nEntries, &MinDst);
+        Err += MinDst;
+    }
+    *nDistEvals += (int64_t)k * nEntries;
+    return Err;
+}
+
+//! Tile reassignment shared by all threads
+struct ReassignJob_t
+{
+    struct TilesData_t *TilesData;
+    const struct BGRAf_t *Palette;
+    const struct BGRAf_t *PalMin, *PalMax;
+    int nPals;
+    int PalStride;
+    int FirstEntry;
+    const uint8_t *Used;
+    int KeepCurrent;
+    const uint8_t *TileMask;
+    atomic_int NextTile; //! First tile of the next batch to hand out
+};
+
+//! Tile reassignment results of one thread
+struct ReassignThread_t
+{
+    struct ReassignJob_t *Job;
+    int     nChanged;
+    int64_t nDistEvals;
+    uint8_t Dirty[TILESDATA_MAX_CLUSTERS];
+#ifdef _WIN32
+    HANDLE Handle;
+#else
+    pthread_t Handle;
+#endif
+};
+
+//! Find the palette that remaps a tile with least error
+static int ReassignTile(const struct ReassignJob_t *Job, int TileIdx, int64_t *nDistEvals)
+{
+    int j;
+    const struct TilesData_t *TilesData = Job->TilesData;
+    int nPxTile   = TilesData->TileW * TilesData->TileH;
+    int PalStride = Job->PalStride;
+    int nEntries  = PalStride - Job->FirstEntry;
+    const struct BGRAf_t *Palette = Job->Palette + Job->FirstEntry;
+
+    struct BGRAf_t TileMin, TileMax;
+    const struct BGRAf_t *Px = TilesData->TilePxPtr[TileIdx].PxBGRAf;
+    GetBounds(Px, nPxTile, &TileMin, &TileMax);
+
+    int   CurPal  = TilesData->TilePalIdx[TileIdx];
+    int   BestPal = 0;
+    float BestErr = INFINITY;
+    if(Job->KeepCurrent)
+    {
+        BestPal = CurPal;
+        BestErr = GetRemapError(Px, nPxTile, Palette + CurPal*PalStride, nEntries, INFINITY, nDistEvals);
+    }
+    for(j=0; j<Job->nPals; j++)
+    {
+        if((Job->KeepCurrent && j == CurPal) || (Job->Used && !Job->Used[j])) continue;
+
+        //! Skip palettes that are too far away to be the best one
+        //! NOTE: The margin covers rounding in the sum of the pixel errors
+        struct BGRAf_t Gap =
+        {
+            GetIntervalGap(TileMin.b, TileMax.b, Job->PalMin[j].b, Job->PalMax[j].b),
+            GetIntervalGap(TileMin.g, TileMax.g, Job->PalMin[j].g, Job->PalMax[j].g),
+            GetIntervalGap(TileMin.r, TileMax.r, Job->PalMin[j].r, Job->PalMax[j].r),
+            GetIntervalGap(TileMin.a, TileMax.a, Job->PalMin[j].a, Job->PalMax[j].a),
+        };
+        if(BGRAf_Len2(&Gap) * nPxTile * (1.0f - 1.0e-4f) >= BestErr) continue;
+
+        //! Sum the error of the nearest palette entry for every pixel
+        float Err = GetRemapError(Px, nPxTile, Palette + j*PalStride, nEntries, BestErr, nDistEvals);
+        if(Err < BestErr) BestPal = j, BestErr = Err;
+    }
+    return BestPal;
+}
+
+//! Reassign batches of tiles until none are left
+//! NOTE: Each tile is only written by the thread that took its batch
+static void ReassignTiles_Run(struct ReassignThread_t *Thread)
+{
+    int i;
+    struct ReassignJob_t *Job = Thread->Job;
+    struct TilesData_t *TilesData = Job->TilesData;
+    int nTiles = TilesData->TilesX * TilesData->TilesY;
+    for(;;)
+    {
+        int First = atomic_fetch_add(&Job->NextTile, REASSIGN_BATCH_TILES);
+        if(First >= nTiles) break;
+        int Last = (nTiles - First < REASSIGN_BATCH_TILES) ? nTiles : (First + REASSIGN_BATCH_TILES);
+        for(i=First; i<Last; i++)
+        {
+            if(Job->TileMask && !Job->TileMask[i]) continue;
+            int CurPal  = TilesData->TilePalIdx[i];
+            int BestPal = ReassignTile(Job, i, &Thread->nDistEvals);
+            if(BestPal != CurPal)
+            {
+                Thread->Dirty[CurPal] = Thread->Dirty[BestPal] = 1;
+                Thread->nChanged++;
+            }
+            TilesData->TilePalIdx[i] = BestPal;
+        }
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ReassignTiles_ThreadMain(LPVOID User)
+{
+    ReassignTiles_Run((struct ReassignThread_t*)User);
+    return 0;
+}
+#else
+static void *ReassignTiles_ThreadMain(void *User)
+{
+    ReassignTiles_Run((struct ReassignThread_t*)User);
+    return NULL;
+}
+#endif
+
+//! Get the number of processors to run threads on
+static int GetProcessorCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO Info;
+    GetSystemInfo(&Info);
+    return (int)Info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+#endif
+}
+
+//! Assign each tile to the palette that remaps it with least error
+//! Palette j holds entries Palette[j*PalStride + FirstEntry .. (j+1)*PalStride-1].
+//! Only palettes with Used[j] != 0 are considered (Used may be NULL).
+//! With KeepCurrent != 0, each tile starts from its current palette,
+//! which it keeps on ties; otherwise, ties go to the lowest palette.
+//! Dirty[] (if not NULL) is set for every palette gaining or losing tiles.
+//! Only tiles with TileMask[i] != 0 are considered (TileMask may be NULL).
+//! NOTE: No pixel can be nearer to a palette entry than the gap between
+//! the bounding boxes of the tile and palette, so palettes whose gap
+//! alone gives more error than the best palette so far are skipped.
+//! NOTE: Tiles are handed out in batches to up to nThreads threads
+//! (0 = One per processor), including the calling thread. Each tile
+//! only depends on the palettes, so the result is the same for any
+//! number of threads.
+//! Returns the number of tiles that changed palette.
+static int ReassignTiles(
+    struct TilesData_t *TilesData,
+    const struct BGRAf_t *Palette,
+    int nPals,
+    int PalStride,
+    int FirstEntry,
+    const uint8_t *Used,
+    int KeepCurrent,
+    uint8_t *Dirty,
+    const uint8_t *TileMask,
+    int nThreads,
+    int64_t *nDistEvals
+)
+{
+    int i, j;
+    int nTiles   = TilesData->TilesX * TilesData->TilesY;
+    int nEntries = PalStride - FirstEntry;
+    Simd_Init();
+
+    //! Get palette bounds
+    struct BGRAf_t PalMin[TILESDATA_MAX_CLUSTERS], PalMax[TILESDATA_MAX_CLUSTERS];
+    for(j=0; j<nPals; j++) GetBounds(Palette + j*PalStride + FirstEntry, nEntries, &PalMin[j], &PalMax[j]);
+    struct ReassignJob_t Job =
+    {
+        .TilesData   = TilesData,
+        .Palette     = Palette,
+        .PalMin      = PalMin,
+        .PalMax      = PalMax,
+        .nPals       = nPals,
+        .PalStride   = PalStride,
+        .FirstEntry  = FirstEntry,
+        .Used        = Used,
+        .KeepCurrent = KeepCurrent,
+        .TileMask    = TileMask,
+    };
+    atomic_init(&Job.NextTile, 0);
+
+    //! Start the threads
+    //! NOTE: Threads that fail to start just leave more work to the others
+    int nBatches = (nTiles + REASSIGN_BATCH_TILES-1) / REASSIGN_BATCH_TILES;
+    if(nThreads <= 0) nThreads = GetProcessorCount();
+    if(nThreads > nBatches) nThreads = nBatches;
+    if(nThreads > REASSIGN_MAX_THREADS) nThreads = REASSIGN_MAX_THREADS;
+    if(nThreads < 1) nThreads = 1;
+    struct ReassignThread_t ThreadsLocal[1], *Threads = ThreadsLocal;
+    if(nThreads > 1)
+    {
+        Threads = malloc(nThreads * sizeof(struct ReassignThread_t));
+        if(!Threads) Threads = ThreadsLocal, nThreads = 1;
+    }
+    int nStarted;
+    for(nStarted=0; nStarted<nThreads; nStarted++)
+    {
+        struct ReassignThread_t *Thread = &Threads[nStarted];
+        Thread->Job        = &Job;
+        Thread->nChanged   = 0;
+        Thread->nDistEvals = 0;
+        for(j=0; j<nPals; j++) Thread->Dirty[j] = 0;
+        if(nStarted == 0) continue; //! <- Runs on this thread
+#ifdef _WIN32
+        Thread->Handle = CreateThread(NULL, 0, ReassignTiles_ThreadMain, Thread, 0, NULL);
+        if(!Thread->Handle) break;
+#else
+        if(pthread_create(&Thread->Handle, NULL, ReassignTiles_ThreadMain, Thread)) break;
+#endif
+    }
+
+    //! Work alongside the threads, then gather the results
+    ReassignTiles_Run(&Threads[0]);
+    int nChanged = 0;
+    for(i=0; i<nStarted; i++)
+    {
+        struct ReassignThread_t *Thread = &Threads[i];
+        if(i != 0)
+        {
+#ifdef _WIN32
+            WaitForSingleObject(Thread->Handle, INFINITE);
+            CloseHandle(Thread->Handle);
+#else
+            pthread_join(Thread->Handle, NULL);
+#endif
+        }
+        nChanged    += Thread->nChanged;
+        *nDistEvals += Thread->nDistEvals;
+        if(Dirty) for(j=0; j<nPals; j++) Dirty[j] |= Thread->Dirty[j];
+    }
+    if(Threads != ThreadsLocal) free(Threads);
+    return nChanged;
+}
+
+/**************************************/
+
+//! Get the memory needed for TilesData_FromBitmapIntoBuffer()
+size_t TilesData_GetAllocSize(int Width, int Height, int TileW, int TileH)
+{
+    size_t nPx    = (size_t)Width * Height;
+    size_t nTiles = (size_t)(Width / TileW) * (Height / TileH);
+    return DATA_ALIGNMENT-1                                                + //! Rounding
+           DATA_ALIGN(sizeof(struct TilesData_t))                          +
+           DATA_ALIGN(nTiles*sizeof(union TilePx_t))                       + //! TilePxPtr
+           DATA_ALIGN(nTiles*sizeof(struct BGRAf_t))                       + //! TileValue
+           DATA_ALIGN(nPx   *sizeof(struct BGRAf_t))                       + //! PxData
+           DATA_ALIGN(nPx   *sizeof(struct BGRAf_t))                       + //! PxTemp
+           DATA_ALIGN(nPx   *sizeof(int32_t)       )                       + //! PxTempIdx
+           DATA_ALIGN(nTiles*sizeof(int32_t)       )                       + //! TilePalIdx
+           DATA_ALIGN(nTiles*sizeof(int32_t)       )                       + //! TileClusterIdx
+           DATA_ALIGN(TILESDATA_MAX_CLUSTERS*sizeof(struct QuantCluster_t));  //! Clusters
+}
 
 /**************************************/
 
@@ -67,21 +475,31 @@ struct TilesData_t *TilesData_FromBitmap(
 )
 {
     //! Allocate memory for tiles
+    //! NOTE: The structure is placed at the start of the buffer, so
+    //! the returned pointer is the one that must be free()'d
+    void *Buffer = malloc(TilesData_GetAllocSize(Ctx->Width, Ctx->Height, TileW, TileH));
+    if(!Buffer) return NULL;
+    return TilesData_FromBitmapIntoBuffer(Buffer, Ctx, TileW, TileH, BitRange, DitherType, DitherLevel);
+}
+
+/**************************************/
+
+//! Convert bitmap to tiles, using caller-supplied memory
+struct TilesData_t *TilesData_FromBitmapIntoBuffer(
+    void *Buffer,
+    const struct BmpCtx_t *Ctx,
+    int TileW,
+    int TileH,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel
+)
+{
     int nPx    = Ctx->Width * Ctx->Height;
     int nTileX = (Ctx->Width  / TileW);
     int nTileY = (Ctx->Height / TileH);
     int nTiles = nTileX * nTileY;
-    struct TilesData_t *TilesData = malloc(
-                                        DATA_ALIGNMENT-1                          + //! Rounding
-                                        DATA_ALIGN(sizeof(struct TilesData_t))    +
-                                        DATA_ALIGN(nTiles*sizeof(union TilePx_t)) + //! TilePxPtr
-                                        DATA_ALIGN(nTiles*sizeof(struct BGRAf_t)) + //! TileValue
-                                        DATA_ALIGN(nPx   *sizeof(struct BGRAf_t)) + //! PxData
-                                        DATA_ALIGN(nPx   *sizeof(struct BGRAf_t)) + //! PxTemp
-                                        DATA_ALIGN(nPx   *sizeof(int32_t)       ) + //! PxTempIdx
-                                        DATA_ALIGN(nTiles*sizeof(int32_t)       )   //! TilePalIdx
-                                    );
-    if(!TilesData) return NULL;
+    struct TilesData_t *TilesData = Buffer;
 
     //! Setup structure
     TilesData->TileW      = TileW;
@@ -94,10 +512,17 @@ struct TilesData_t *TilesData_FromBitmap(
     TilesData->PxTemp     = (struct BGRAf_t*)DATA_ALIGN(TilesData->PxData    + nPx);
     TilesData->PxTempIdx  = (int32_t       *)DATA_ALIGN(TilesData->PxTemp    + nPx);
     TilesData->TilePalIdx = (int32_t       *)DATA_ALIGN(TilesData->PxTempIdx + nPx);
+    TilesData->TileClusterIdx = (int32_t*)DATA_ALIGN(TilesData->TilePalIdx + nTiles);
+    TilesData->Clusters   = (struct QuantCluster_t*)DATA_ALIGN(TilesData->TileClusterIdx + nTiles);
+    TilesData->nTileClusters      = 0;
+    TilesData->nTileClusterPasses = 0;
+    memset(TilesData->PalStopped, 0, sizeof(TilesData->PalStopped));
 
     //! Apply first-pass dithering into PxTemp[] and fill tiles using this data
     DitherImage(
         Ctx,
+        0,
+        0,
         BitRange,
         TilesData->PxTemp,
         0,
@@ -120,6 +545,62 @@ struct TilesData_t *TilesData_FromBitmap(
 
 /**************************************/
 
+//! Quantize the PxCnt pixels in TilesData->PxTemp into a palette
+//! With Reseed != 0, clustering starts from the entries already in the
+//! palette rather than from scratch (this needs Ctrl != NULL).
+//! *Stopped is set if refinement stopped at Ctrl->TargetError.
+//! Returns 0 on cancellation
+static int QuantizePalette(
+    struct TilesData_t *TilesData,
+    int PxCnt,
+    struct BGRAf_t *Palette,
+    int MaxPalSize,
+    int PalUnusedEntries,
+    int nColourClusterPasses,
+    int Reseed,
+    uint8_t *Stopped,
+    struct QuantCtrl_t *Ctrl
+)
+{
+    int j;
+    struct QuantCluster_t *Clusters = TilesData->Clusters;
+    *Stopped = 0;
+    if(!PxCnt)
+    {
+        //! No data - output an empty palette so that
+        //! the following palettes stay in place
+        for(j=0; j<PalUnusedEntries+MaxPalSize; j++) *Palette++ = (struct BGRAf_t)
+        {
+            0,0,0,0
+        };
+        return 1;
+    }
+
+    //! Perform quantization
+    int Init = 0;
+    if(Reseed)
+    {
+        for(j=0; j<MaxPalSize; j++) Clusters[j].Centroid = Palette[PalUnusedEntries+j];
+        Init = Ctrl->Init, Ctrl->Init = QUANTINIT_CENTROIDS;
+    }
+    int TargetReached = 0;
+    if(Ctrl) TargetReached = Ctrl->TargetReached, Ctrl->TargetReached = 0;
+    QuantCtrl_BeginStage(Ctrl, QUANTSTAGE_COLOURS);
+    int Ok = QuantCluster_Quantize(Clusters, MaxPalSize, TilesData->PxTemp, PxCnt, TilesData->PxTempIdx, nColourClusterPasses, Ctrl);
+    QuantCtrl_EndStage(Ctrl);
+    if(Ctrl) *Stopped = (Ctrl->TargetReached != 0), Ctrl->TargetReached |= TargetReached;
+    if(Reseed) Ctrl->Init = Init;
+    if(!Ok) return 0;
+
+    //! Extract palette from cluster centroids
+    for(j=0; j<PalUnusedEntries; j++) *Palette++ = (struct BGRAf_t)
+    {
+        0,0,0,0
+    };
+    for(j=0; j<MaxPalSize;       j++) *Palette++ = Clusters[j].Centroid;
+    return 1;
+}
+
 //! Create quantized palette
 int TilesData_QuantizePalettes(
     struct TilesData_t *TilesData,
@@ -128,10 +609,11 @@ int TilesData_QuantizePalettes(
     int MaxPalSize,
     int PalUnusedEntries,
     int nTileClusterPasses,
-    int nColourClusterPasses
+    int nColourClusterPasses,
+    struct QuantCtrl_t *Ctrl
 )
 {
-    int i, j, k;
+    int i;
     int nPxTile = TilesData->TileW  * TilesData->TileH;
     int nTiles  = TilesData->TilesX * TilesData->TilesY;
 
@@ -143,56 +625,441 @@ int TilesData_QuantizePalettes(
     //! the maximum palette size
     MaxPalSize -= PalUnusedEntries;
 
-    //! Allocate clusters
-    struct QuantCluster_t *Clusters, *_Clusters;
+    //! Get clusters
+    //! NOTE: These live in the tile data, so no allocation is needed here
+    struct QuantCluster_t *Clusters = TilesData->Clusters;
+    if(MaxTilePals > TILESDATA_MAX_CLUSTERS || MaxPalSize > TILESDATA_MAX_CLUSTERS) return 0;
+
+    //! Divide the time budget between the stages
+    //! NOTE: Each stage is given time in proportion to its expected
+    //! cost per pass (points*clusters), and any time left over by a
+    //! stage carries over to the following ones.
+    double EndTime = 0.0;
+    if(Ctrl && Ctrl->TimeBudget > 0.0)
     {
-        int nClusters = MaxTilePals;
-        if(MaxPalSize > nClusters) nClusters = MaxPalSize;
-        _Clusters = malloc(DATA_ALIGNMENT-1 + nClusters*sizeof(struct QuantCluster_t));
-        if(!_Clusters) return 0;
-        Clusters = (struct QuantCluster_t*)DATA_ALIGN(_Clusters);
+        double Now        = QuantStats_GetTime();
+        double TileCost   = (double)nTiles * MaxTilePals;
+        double ColourCost = (double)nTiles * nPxTile * MaxPalSize;
+        EndTime = Now + Ctrl->TimeBudget*(1.0 - TIMEBUDGET_DITHER_SHARE);
+        Ctrl->Deadline = Now + (EndTime - Now) * TileCost / (TileCost + ColourCost);
     }
 
     //! Categorize tiles by palette
-    QuantCluster_Quantize(Clusters, MaxTilePals, TilesData->TileValue, nTiles, TilesData->TilePalIdx, nTileClusterPasses);
+    if(Ctrl)
+    {
+        Ctrl->State.Palette   = 0;
+    }
+    if(TilesData->nTileClusters == MaxTilePals && TilesData->nTileClusterPasses == nTileClusterPasses)
+    {
+        //! Re-use the saved clustering
+        //! NOTE: This is restored from the copy, as tile refinement
+        //! may have moved tiles since it was saved.
+        for(i=0; i<nTiles; i++) TilesData->TilePalIdx[i] = TilesData->TileClusterIdx[i];
+    }
+    else
+    {
+        //! NOTE: Ctrl->TargetError only applies to colour clustering
+        float TargetError = 0.0f;
+        if(Ctrl) TargetError = Ctrl->TargetError, Ctrl->TargetError = 0.0f;
+        QuantCtrl_BeginStage(Ctrl, QUANTSTAGE_TILES);
+        int Ok = QuantCluster_Quantize(Clusters, MaxTilePals, TilesData->TileValue, nTiles, TilesData->TilePalIdx, nTileClusterPasses, Ctrl);
+        QuantCtrl_EndStage(Ctrl);
+        if(Ctrl) Ctrl->TargetError = TargetError;
+        TilesData->nTileClusters = 0;
+        if(!Ok)
+        {
+            if(Ctrl) Ctrl->Deadline = 0.0;
+            return 0;
+        }
+
+        //! Save the clustering for re-use
+        //! NOTE: Under a time budget, the result depends on timing, so
+        //! it is not saved.
+        if(EndTime == 0.0) TilesData_SetTileClusters(TilesData, TilesData->TilePalIdx, MaxTilePals, nTileClusterPasses);
+    }
 
     //! Quantize tile palettes
+    int SkipClear  = (PalUnusedEntries != 0);
+    int PalStride  = PalUnusedEntries + MaxPalSize;
+    int nTilesLeft = nTiles;
+    uint8_t PalUsed[TILESDATA_MAX_CLUSTERS];
     for(i=0; i<MaxTilePals; i++)
     {
-        struct BGRAf_t *PxTemp = TilesData->PxTemp;
-
         //! Get all pixels of all tiles falling into this palette
-        int PxCnt;
+        int nPalTiles;
+        int PxCnt = GatherPalettePx(TilesData, i, SkipClear, &nPalTiles);
+        PalUsed[i] = (nPalTiles != 0);
+
+        //! Give this palette its share of the remaining time
+        if(EndTime != 0.0 && nPalTiles)
+        {
+            double Now = QuantStats_GetTime();
+            Ctrl->Deadline = Now + (EndTime - Now) * nPalTiles / nTilesLeft;
+            nTilesLeft -= nPalTiles;
+        }
+        if(Ctrl) Ctrl->State.Palette = i;
+        if(!QuantizePalette(TilesData, PxCnt, Palette + i*PalStride, MaxPalSize, PalUnusedEntries, nColourClusterPasses, 0, &TilesData->PalStopped[i], Ctrl))
+        {
+            if(Ctrl) Ctrl->Deadline = 0.0;
+            return 0;
+        }
+    }
+
+    //! Refine the assignment of tiles to palettes against the palettes
+    //! actually produced, re-quantizing the palettes that change, and
+    //! finishing with an assignment to the final palettes
+    //! NOTE: Palettes that were left without tiles are not considered.
+    if(Ctrl && Ctrl->TileRefinePasses > 0)
+    {
+        int Pass;
+        uint8_t PalDirty[TILESDATA_MAX_CLUSTERS];
+        if(EndTime != 0.0) Ctrl->Deadline = EndTime;
+        for(Pass=0; ; Pass++)
         {
-            struct BGRAf_t *Dst = PxTemp;
-            for(j=0; j<nTiles; j++) if(TilesData->TilePalIdx[j] == i)
+            //! Move tiles to their best palettes
+            int64_t nDistEvals = 0;
+            QuantCtrl_BeginStage(Ctrl, QUANTSTAGE_REFINE);
+            Ctrl->State.Pass = Pass;
+            if(QuantCtrl_Update(Ctrl))
+            {
+                QuantCtrl_EndStage(Ctrl);
+                Ctrl->Deadline = 0.0;
+                return 0;
+            }
+            for(i=0; i<MaxTilePals; i++) PalDirty[i] = 0;
+            int nChanged = ReassignTiles(TilesData, Palette, MaxTilePals, PalStride, SkipClear ? (PalUnusedEntries-1) : 0, PalUsed, 1, PalDirty, NULL, Ctrl->nThreads, &nDistEvals);
+            if(Ctrl->Stats)
+            {
+                Ctrl->Stats->Stage[QUANTSTAGE_REFINE].nPasses++;
+                Ctrl->Stats->Stage[QUANTSTAGE_REFINE].nDistEvals += nDistEvals;
+            }
+            QuantCtrl_EndStage(Ctrl);
+            if(!nChanged || Pass == Ctrl->TileRefinePasses) break;
+            if(EndTime != 0.0 && QuantStats_GetTime() >= EndTime) break;
+
+            //! Re-quantize the palettes that gained or lost tiles
+            for(i=0; i<MaxTilePals; i++) if(PalDirty[i])
                 {
-                    const struct BGRAf_t *Src = TilesData->TilePxPtr[j].PxBGRAf;
-                    for(k=0; k<nPxTile; k++)
-                        {
-                            //! NOTE: Do not add alpha=0 pixels, as this is a separate
-                            //! thing altogether when PalUnusedEntries != 0.
-                            struct BGRAf_t x = *Src++;
-                            if(PalUnusedEntries != 0 && x.a != 0) *Dst++ = x;
-                        }
+                    int nPalTiles;
+                    int PxCnt = GatherPalettePx(TilesData, i, SkipClear, &nPalTiles);
+                    PalUsed[i] = (nPalTiles != 0);
+                    Ctrl->State.Palette = i;
+                    if(!QuantizePalette(TilesData, PxCnt, Palette + i*PalStride, MaxPalSize, PalUnusedEntries, nColourClusterPasses, 1, &TilesData->PalStopped[i], Ctrl))
+                    {
+                        Ctrl->Deadline = 0.0;
+                        return 0;
+                    }
                 }
-            PxCnt = Dst - PxTemp;
         }
-        if(!PxCnt) continue;
+    }
+
+    //! Return success
+    if(Ctrl) Ctrl->Deadline = 0.0;
+    return 1;
+}
+
+/**************************************/
 
-        //! Perform quantization
-        QuantCluster_Quantize(Clusters, MaxPalSize, PxTemp, PxCnt, TilesData->PxTempIdx, nColourClusterPasses);
+//! Refine the palettes that stopped early at Ctrl->TargetError
+int TilesData_RefinePalettes(
+    struct TilesData_t *TilesData,
+    struct BGRAf_t *Palette,
+    int MaxTilePals,
+    int MaxPalSize,
+    int PalUnusedEntries,
+    int nColourClusterPasses,
+    struct QuantCtrl_t *Ctrl
+)
+{
+    int i;
+    if(nColourClusterPasses == 0) nColourClusterPasses = DEFAULT_COLOURCLUSTER_PASSES;
+    MaxPalSize -= PalUnusedEntries;
+    if(MaxTilePals > TILESDATA_MAX_CLUSTERS || MaxPalSize > TILESDATA_MAX_CLUSTERS) return 0;
+
+    //! Re-seeding needs a control structure
+    struct QuantCtrl_t LocalCtrl = {.Init = QUANTINIT_SPLIT};
+    if(!Ctrl) Ctrl = &LocalCtrl;
 
-        //! Extract palette from cluster centroids
-        for(j=0; j<PalUnusedEntries; j++) *Palette++ = (struct BGRAf_t)
+    //! Continue refining from the current entries, to convergence
+    int Ok = 1;
+    int SkipClear = (PalUnusedEntries != 0);
+    int PalStride = PalUnusedEntries + MaxPalSize;
+    float TargetError = Ctrl->TargetError;
+    Ctrl->TargetError = 0.0f;
+    for(i=0; i<MaxTilePals && Ok; i++) if(TilesData->PalStopped[i])
         {
-            0,0,0,0
-        };
-        for(j=0; j<MaxPalSize;       j++) *Palette++ = Clusters[j].Centroid;
+            int nPalTiles;
+            int PxCnt = GatherPalettePx(TilesData, i, SkipClear, &nPalTiles);
+            Ctrl->State.Palette = i;
+            Ok = QuantizePalette(TilesData, PxCnt, Palette + i*PalStride, MaxPalSize, PalUnusedEntries, nColourClusterPasses, 1, &TilesData->PalStopped[i], Ctrl);
+        }
+    Ctrl->TargetError = TargetError;
+    return Ok;
+}
+
+/**************************************/
+
+//! Ladder state while clustering
+struct TileLadder_t
+{
+    int32_t *LadderIdx;
+    int     *LadderPals;
+    int      nLevels;
+    int      MaxTilePals;
+    int      LastLevel; //! Last level reported (-1 = None)
+};
+
+//! Get the level of a palette count, or -1 if not on the ladder
+static int TileLadder_GetLevel(const struct TileLadder_t *Ladder, int nPals)
+{
+    int Level;
+    if(nPals == Ladder->MaxTilePals) return Ladder->nLevels-1;
+    for(Level=0; Level<Ladder->nLevels-1; Level++) if(nPals == (1<<Level)) return Level;
+    return -1;
+}
+
+//! Keep the tile clustering of a split level
+static void TileLadder_OnLevel(void *User, int nClusters, const int32_t *DataClusters, int nData)
+{
+    int i;
+    struct TileLadder_t *Ladder = User;
+    int Level = TileLadder_GetLevel(Ladder, nClusters);
+    if(Level < 0) return;
+    int32_t *Dst = Ladder->LadderIdx + (size_t)Level*nData;
+    for(i=0; i<nData; i++) Dst[i] = DataClusters[i];
+    Ladder->LadderPals[Level] = nClusters;
+    Ladder->LastLevel = Level;
+}
+
+//! Cluster tiles for a ladder of palette counts
+int TilesData_ClusterTileLadder(
+    struct TilesData_t *TilesData,
+    int32_t *LadderIdx,
+    int *LadderPals,
+    int MaxTilePals,
+    int nTileClusterPasses,
+    struct QuantCtrl_t *Ctrl
+)
+{
+    int i;
+    int nTiles = TilesData->TilesX * TilesData->TilesY;
+    if(MaxTilePals < 1 || MaxTilePals > TILESDATA_MAX_CLUSTERS) return 0;
+    if(nTileClusterPasses == 0) nTileClusterPasses = DEFAULT_TILECLUSTER_PASSES;
+
+    //! Set up the ladder
+    struct TileLadder_t Ladder = {.LadderIdx = LadderIdx, .LadderPals = LadderPals, .MaxTilePals = MaxTilePals, .LastLevel = -1};
+    while((1 << Ladder.nLevels) < MaxTilePals) Ladder.nLevels++;
+    Ladder.nLevels++;
+    for(i=0; i<Ladder.nLevels; i++) LadderPals[i] = 0;
+
+    //! A single palette holds every tile, and isn't reached by splitting
+    for(i=0; i<nTiles; i++) LadderIdx[i] = 0;
+    LadderPals[0] = 1;
+
+    //! Cluster tiles, keeping each level
+    //! NOTE: Ctrl->TargetError only applies to colour clustering
+    struct QuantCtrl_t LocalCtrl = {.Init = QUANTINIT_SPLIT};
+    if(!Ctrl) Ctrl = &LocalCtrl;
+    float TargetError = Ctrl->TargetError;
+    Ctrl->TargetError     = 0.0f;
+    Ctrl->Level           = TileLadder_OnLevel;
+    Ctrl->LevelUser       = &Ladder;
+    Ctrl->State.Palette   = 0;
+    QuantCtrl_BeginStage(Ctrl, QUANTSTAGE_TILES);
+    int Ok = QuantCluster_Quantize(TilesData->Clusters, MaxTilePals, TilesData->TileValue, nTiles, TilesData->TilePalIdx, nTileClusterPasses, Ctrl);
+    QuantCtrl_EndStage(Ctrl);
+    Ctrl->TargetError = TargetError;
+    Ctrl->Level       = NULL;
+    Ctrl->LevelUser   = NULL;
+    if(!Ok) return 0;
+
+    //! The final result is the top level. If clustering converged
+    //! before reaching it, the levels that were skipped would have
+    //! converged to this same result, so take it for those too.
+    //! NOTE: If no level was reported, nothing is known about the
+    //! lower levels, so only the top level is kept.
+    int FirstLevel = (Ladder.LastLevel < 0) ? (Ladder.nLevels-1) : (Ladder.LastLevel+1);
+    for(i=FirstLevel; i<Ladder.nLevels; i++)
+    {
+        TileLadder_OnLevel(&Ladder, (i == Ladder.nLevels-1) ? MaxTilePals : (1<<i), TilesData->TilePalIdx, nTiles);
+    }
+    TilesData_SetTileClusters(TilesData, TilesData->TilePalIdx, MaxTilePals, nTileClusterPasses);
+    return Ladder.nLevels;
+}
+
+//! Save a tile clustering to re-use
+void TilesData_SetTileClusters(
+    struct TilesData_t *TilesData,
+    const int32_t *TileIdx,
+    int nTilePals,
+    int nTileClusterPasses
+)
+{
+    int i;
+    int nTiles = TilesData->TilesX * TilesData->TilesY;
+    if(nTileClusterPasses == 0) nTileClusterPasses = DEFAULT_TILECLUSTER_PASSES;
+    for(i=0; i<nTiles; i++) TilesData->TileClusterIdx[i] = TileIdx[i];
+    TilesData->nTileClusters      = nTilePals;
+    TilesData->nTileClusterPasses = nTileClusterPasses;
+}
+
+/**************************************/
+
+//! Assign tiles to the palettes that remap them with least error
+void TilesData_AssignPalettes(
+    struct TilesData_t *TilesData,
+    const struct BGRAf_t *Palette,
+    int MaxTilePals,
+    int MaxPalSize,
+    int PalUnusedEntries,
+    const struct QuantCtrl_t *Ctrl
+)
+{
+    //! NOTE: Search the same entries that DitherImage() does
+    int64_t nDistEvals = 0;
+    int FirstEntry = PalUnusedEntries ? (PalUnusedEntries-1) : 0;
+    ReassignTiles(TilesData, Palette, MaxTilePals, MaxPalSize, FirstEntry, NULL, 0, NULL, NULL, Ctrl ? Ctrl->nThreads : 0, &nDistEvals);
+}
+
+/**************************************/
+
+//! Re-convert tiles whose pixels have changed
+void TilesData_UpdateTiles(
+    struct TilesData_t *TilesData,
+    const struct BmpCtx_t *Ctx,
+    const uint8_t *TileDirty,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel
+)
+{
+    int i, k;
+    int TileW   = TilesData->TileW;
+    int TileH   = TilesData->TileH;
+    int nPxTile = TileW * TileH;
+    int nTiles  = TilesData->TilesX * TilesData->TilesY;
+    for(i=0; i<nTiles; i++) if(TileDirty[i])
+        {
+            //! Apply first-pass dithering to the tile alone, straight
+            //! into its pixels (PxTemp[] is free for the diffusion buffer)
+            int x = (i % TilesData->TilesX) * TileW;
+            int y = (i / TilesData->TilesX) * TileH;
+            struct BGRAf_t *Dst = TilesData->TilePxPtr[i].PxBGRAf;
+            struct BmpCtx_t Rect = BmpCtx_GetRect(Ctx, x, y, TileW, TileH);
+            DitherImage(
+                &Rect,
+                x,
+                y,
+                BitRange,
+                Dst,
+                0,
+                0,
+                0,
+                0,
+                0,
+                NULL,
+                NULL,
+                NULL,
+                DitherType,
+                DitherLevel,
+                TilesData->PxTemp
+            );
+
+            //! Convert pixels and get value as in ConvertToTiles()
+            struct BGRAf_t Mean = {0,0,0,0};
+            for(k=0; k<nPxTile; k++)
+            {
+                Dst[k] = BGRAf_AsYUV(&Dst[k]);
+                Mean = BGRAf_Add(&Mean, &Dst[k]);
+            }
+            Mean.b *= 1.0f / 3;
+            Mean.a /= (float)nPxTile;
+            TilesData->TileValue[i] = Mean;
+        }
+
+    //! The saved tile clustering no longer matches the tiles
+    TilesData->nTileClusters = 0;
+}
+
+/**************************************/
+
+//! Update palettes after tiles have changed
+int TilesData_UpdatePalettes(
+    struct TilesData_t *TilesData,
+    struct BGRAf_t *Palette,
+    int MaxTilePals,
+    int MaxPalSize,
+    int PalUnusedEntries,
+    int nColourClusterPasses,
+    const uint8_t *TileDirty,
+    uint8_t *PalDirty,
+    struct QuantCtrl_t *Ctrl
+)
+{
+    int i;
+    int nPxTile = TilesData->TileW  * TilesData->TileH;
+    int nTiles  = TilesData->TilesX * TilesData->TilesY;
+    if(nColourClusterPasses == 0) nColourClusterPasses = DEFAULT_COLOURCLUSTER_PASSES;
+    MaxPalSize -= PalUnusedEntries;
+    if(MaxTilePals > TILESDATA_MAX_CLUSTERS || MaxPalSize > TILESDATA_MAX_CLUSTERS) return 0;
+
+    //! Re-seeding needs a control structure
+    struct QuantCtrl_t LocalCtrl = {.Init = QUANTINIT_SPLIT};
+    if(!Ctrl) Ctrl = &LocalCtrl;
+
+    //! Move the changed tiles to their best palettes
+    //! NOTE: Palettes without tiles are not considered (as in
+    //! TilesData_QuantizePalettes()), as their entries are unset.
+    int64_t nDistEvals = 0;
+    int SkipClear  = (PalUnusedEntries != 0);
+    int PalStride  = PalUnusedEntries + MaxPalSize;
+    int FirstEntry = SkipClear ? (PalUnusedEntries-1) : 0;
+    int nEntries   = PalStride - FirstEntry;
+    uint8_t PalUsed[TILESDATA_MAX_CLUSTERS];
+    for(i=0; i<MaxTilePals; i++) PalUsed[i] = PalDirty[i] = 0;
+    for(i=0; i<nTiles; i++) PalUsed[TilesData->TilePalIdx[i]] = 1;
+    QuantCtrl_BeginStage(Ctrl, QUANTSTAGE_REFINE);
+    Ctrl->State.Pass = 0;
+    if(QuantCtrl_Update(Ctrl))
+    {
+        QuantCtrl_EndStage(Ctrl);
+        return 0;
+    }
+    ReassignTiles(TilesData, Palette, MaxTilePals, PalStride, FirstEntry, PalUsed, 1, PalDirty, TileDirty, Ctrl->nThreads, &nDistEvals);
+
+    //! Check whether the palettes that kept changed tiles still suit them,
+    //! by comparing the error of the changed tiles against the others
+    float ErrDirty[TILESDATA_MAX_CLUSTERS], ErrClean[TILESDATA_MAX_CLUSTERS];
+    int   nDirty  [TILESDATA_MAX_CLUSTERS], nClean  [TILESDATA_MAX_CLUSTERS];
+    for(i=0; i<MaxTilePals; i++) ErrDirty[i] = ErrClean[i] = 0.0f, nDirty[i] = nClean[i] = 0;
+    for(i=0; i<nTiles; i++) if(TileDirty[i]) nDirty[TilesData->TilePalIdx[i]]++;
+    for(i=0; i<nTiles; i++)
+    {
+        int Pal = TilesData->TilePalIdx[i];
+        if(!nDirty[Pal] || PalDirty[Pal]) continue;
+        float Err = GetRemapError(TilesData->TilePxPtr[i].PxBGRAf, nPxTile, Palette + Pal*PalStride + FirstEntry, nEntries, INFINITY, &nDistEvals);
+        if(TileDirty[i]) ErrDirty[Pal] += Err;
+        else             ErrClean[Pal] += Err, nClean[Pal]++;
+    }
+    for(i=0; i<MaxTilePals; i++) if(nDirty[i] && !PalDirty[i])
+        {
+            PalDirty[i] = !nClean[i] || ErrDirty[i]*nClean[i] > UPDATE_RECLUSTER_RATIO*ErrClean[i]*nDirty[i];
+        }
+    if(Ctrl->Stats)
+    {
+        Ctrl->Stats->Stage[QUANTSTAGE_REFINE].nPasses++;
+        Ctrl->Stats->Stage[QUANTSTAGE_REFINE].nDistEvals += nDistEvals;
     }
+    QuantCtrl_EndStage(Ctrl);
 
-    //! Clean up, return
-    free(_Clusters);
+    //! Re-quantize the palettes that need it, starting from their current entries
+    for(i=0; i<MaxTilePals; i++) if(PalDirty[i])
+        {
+            int nPalTiles;
+            int PxCnt = GatherPalettePx(TilesData, i, SkipClear, &nPalTiles);
+            Ctrl->State.Palette   = i;
+            if(!QuantizePalette(TilesData, PxCnt, Palette + i*PalStride, MaxPalSize, PalUnusedEntries, nColourClusterPasses, 1, &TilesData->PalStopped[i], Ctrl)) return 0;
+        }
     return 1;
 }
 
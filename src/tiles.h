@@ -1,10 +1,15 @@
 /**************************************/
 #pragma once
 /**************************************/
+#include <stddef.h>
 #include <stdint.h>
 /**************************************/
 #include "bitmap.h"
 #include "colourspace.h"
+#include "quantize.h"
+/**************************************/
+#define TILESDATA_MAX_CLUSTERS BMP_PALETTE_COLOURS
+#define TILESDATA_MAX_LADDER   9 //! Levels of 1, 2, 4, ..., TILESDATA_MAX_CLUSTERS palettes
 /**************************************/
 
 union TilePx_t
@@ -24,10 +29,28 @@ struct TilesData_t
     struct BGRAf_t *PxTemp;     //! Temporary processing data (ImageW*ImageH elements)
     int32_t        *PxTempIdx;  //! Temporary processing data (palette entry indices)
     int32_t        *TilePalIdx; //! Tile palette indices
+    struct QuantCluster_t *Clusters; //! Quantization clusters (TILESDATA_MAX_CLUSTERS elements)
+
+    //! Saved tile clustering
+    //! TilesData_QuantizePalettes() keeps the result of tile clustering
+    //! here, so that quantizing the same tiles again with the same number
+    //! of palettes (eg. with another palette size) can skip that stage.
+    //! NOTE: This is cleared on conversion. Callers that change clustering
+    //! options between calls on the same tiles must clear nTileClusters.
+    int32_t        *TileClusterIdx;     //! Palette index of each tile
+    int             nTileClusters;      //! Number of palettes clustered to (0 = None saved)
+    int             nTileClusterPasses; //! Passes used for the saved clustering
+
+    //! Palettes whose colour clustering last stopped at Ctrl->TargetError
+    //! (see TilesData_RefinePalettes())
+    uint8_t PalStopped[TILESDATA_MAX_CLUSTERS];
 };
 
 /**************************************/
 
+//! Get the memory needed for TilesData_FromBitmapIntoBuffer()
+size_t TilesData_GetAllocSize(int Width, int Height, int TileW, int TileH);
+
 //! Convert bitmap to tiles
 //! NOTE: To destroy, call free() on the returned pointer
 struct TilesData_t *TilesData_FromBitmap(
@@ -39,10 +62,27 @@ struct TilesData_t *TilesData_FromBitmap(
     float DitherLevel
 );
 
+//! Convert bitmap to tiles, using caller-supplied memory
+//! NOTE: Buffer must be at least TilesData_GetAllocSize() bytes,
+//! and suitably aligned (eg. from malloc()). The returned pointer
+//! is always equal to Buffer, which remains owned by the caller.
+struct TilesData_t *TilesData_FromBitmapIntoBuffer(
+    void *Buffer,
+    const struct BmpCtx_t *Ctx,
+    int TileW,
+    int TileH,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel
+);
+
 //! Create quantized palette
 //! NOTE: PalUnusedEntries is used for 'padding', such as on
 //! the GBA/NDS where index 0 of every palette is transparent
 //! NOTE: Palette is generated in YUVA mode
+//! NOTE: Returns 0 on failure or cancellation (see QuantCtrl_t; Ctrl may be NULL)
+//! NOTE: With Ctrl->TimeBudget set, the clustering stages are given
+//! deadlines that leave part of the budget for the final dithering.
 int TilesData_QuantizePalettes(
     struct TilesData_t *TilesData,
     struct BGRAf_t *Palette,
@@ -50,7 +90,102 @@ int TilesData_QuantizePalettes(
     int MaxPalSize,
     int PalUnusedEntries,
     int nTileClusterPasses,
-    int nColourClusterPasses
+    int nColourClusterPasses,
+    struct QuantCtrl_t *Ctrl
+);
+
+//! Refine the palettes that stopped early at Ctrl->TargetError
+//! The palettes that TilesData_QuantizePalettes() (or
+//! TilesData_UpdatePalettes()) stopped refining once their error met
+//! Ctrl->TargetError are refined further with full refinement, starting
+//! from their current entries. Tiles are not moved between palettes.
+//! NOTE: Palette must be in YUVA mode, and is updated in place.
+//! NOTE: Returns 0 on failure or cancellation (see QuantCtrl_t; Ctrl may be NULL)
+int TilesData_RefinePalettes(
+    struct TilesData_t *TilesData,
+    struct BGRAf_t *Palette,
+    int MaxTilePals,
+    int MaxPalSize,
+    int PalUnusedEntries,
+    int nColourClusterPasses,
+    struct QuantCtrl_t *Ctrl
+);
+
+//! Cluster tiles for a ladder of palette counts
+//! Binary splitting passes through 1, 2, 4, ... palettes on its way to
+//! MaxTilePals, so each of these levels (and MaxTilePals itself) has the
+//! same tile clustering as a separate run with that many palettes would.
+//! Level i has LadderPals[i] palettes, and the palette index of each tile
+//! in LadderIdx[i*nTiles + n]; levels that could not be kept (eg. with
+//! seeding initializers, which do not split, or with mini-batch or
+//! coarse-to-fine clustering) have LadderPals[i] = 0.
+//! The clustering for MaxTilePals is also saved in the tile data.
+//! NOTE: LadderIdx[] must hold TILESDATA_MAX_LADDER*nTiles elements.
+//! NOTE: Returns the number of levels, or 0 on failure or cancellation.
+int TilesData_ClusterTileLadder(
+    struct TilesData_t *TilesData,
+    int32_t *LadderIdx,
+    int *LadderPals,
+    int MaxTilePals,
+    int nTileClusterPasses,
+    struct QuantCtrl_t *Ctrl
+);
+
+//! Save a tile clustering to re-use (see TilesData_t)
+//! TileIdx[] holds the palette index of each tile.
+void TilesData_SetTileClusters(
+    struct TilesData_t *TilesData,
+    const int32_t *TileIdx,
+    int nTilePals,
+    int nTileClusterPasses
+);
+
+//! Assign tiles to the palettes that remap them with least error
+//! NOTE: Palette must be in YUVA mode (as from TilesData_QuantizePalettes()).
+//! NOTE: This does NOT consider dithering; it is only an estimate.
+//! NOTE: Ctrl (which may be NULL) only sets the number of threads.
+void TilesData_AssignPalettes(
+    struct TilesData_t *TilesData,
+    const struct BGRAf_t *Palette,
+    int MaxTilePals,
+    int MaxPalSize,
+    int PalUnusedEntries,
+    const struct QuantCtrl_t *Ctrl
+);
+
+//! Re-convert tiles whose pixels have changed
+//! Tiles with TileDirty[i] != 0 are converted again from Ctx, which must
+//! have the same size as the image the tiles were first converted from.
+//! NOTE: Error diffusion (DITHER_FLOYDSTEINBERG) is applied to each tile
+//! on its own, so it may differ slightly from converting the whole image.
+void TilesData_UpdateTiles(
+    struct TilesData_t *TilesData,
+    const struct BmpCtx_t *Ctx,
+    const uint8_t *TileDirty,
+    const struct BGRA8_t *BitRange,
+    int   DitherType,
+    float DitherLevel
+);
+
+//! Update palettes after tiles have changed
+//! The tiles with TileDirty[i] != 0 are moved to the palettes that remap
+//! them best, and the palettes that gained or lost tiles, or that now
+//! remap their changed tiles much worse than their other tiles, are
+//! re-quantized starting from their current entries.
+//! NOTE: Palette must be in YUVA mode, and is updated in place.
+//! NOTE: PalDirty[] receives MaxTilePals flags marking the palettes
+//! that were re-quantized.
+//! NOTE: Returns 0 on failure or cancellation (see QuantCtrl_t; Ctrl may be NULL)
+int TilesData_UpdatePalettes(
+    struct TilesData_t *TilesData,
+    struct BGRAf_t *Palette,
+    int MaxTilePals,
+    int MaxPalSize,
+    int PalUnusedEntries,
+    int nColourClusterPasses,
+    const uint8_t *TileDirty,
+    uint8_t *PalDirty,
+    struct QuantCtrl_t *Ctrl
 );
 
 /**************************************/